@@ -0,0 +1,135 @@
+#include "adapt.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct Adapt {
+    pthread_mutex_t lock;
+    pthread_cond_t room;
+    unsigned limit;
+    unsigned max;
+    unsigned inflight;
+    bool slow_start;        // doubling, until the first cut
+    int64_t window_ns;      // start of the window
+    size_t bytes;           // done in the window
+    int64_t latency_ns;     // summed over the files done in the window
+    unsigned files;
+    double throughput;      // of the previous window
+    double latency;         // of the previous window
+};
+
+static
+int64_t Adapt_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+Adapt *Adapt_new(unsigned max)
+{
+    Adapt *adapt;
+
+    adapt = malloc(sizeof(Adapt));
+    if (!adapt) {
+        warn("malloc");
+        return NULL;
+    }
+
+    *adapt = (Adapt){
+        .limit = 1,
+        .max = max ? max : 1,
+        .slow_start = true,
+        .window_ns = Adapt_now(),
+    };
+    pthread_mutex_init(&adapt->lock, NULL);
+    pthread_cond_init(&adapt->room, NULL);
+    return adapt;
+}
+
+// Additive increase, multiplicative decrease.  A window too short to
+// have seen files done is extended.
+static
+void Adapt_update(Adapt *adapt, int64_t now)
+{
+    double throughput, latency;
+    bool faster, slower;
+
+    if (!adapt->files)
+        return;
+
+    throughput = adapt->bytes * 1e9 / (now - adapt->window_ns);
+    latency = (double)adapt->latency_ns / adapt->files;
+
+    faster = throughput > adapt->throughput * 1.05;
+    slower = throughput < adapt->throughput * 0.9
+        || (!faster && latency > adapt->latency * 1.5);
+
+    if (adapt->throughput && slower) {
+        adapt->limit -= (adapt->limit + 3) / 4;
+        if (!adapt->limit)
+            adapt->limit = 1;
+        adapt->slow_start = false;
+    } else if (!adapt->throughput || faster)
+        adapt->limit = adapt->slow_start ? 2 * adapt->limit
+                                         : adapt->limit + 1;
+
+    if (adapt->limit > adapt->max)
+        adapt->limit = adapt->max;
+
+    adapt->throughput = throughput;
+    adapt->latency = latency;
+    adapt->window_ns = now;
+    adapt->bytes = 0;
+    adapt->latency_ns = 0;
+    adapt->files = 0;
+}
+
+int64_t Adapt_enter(Adapt *adapt)
+{
+    pthread_mutex_lock(&adapt->lock);
+    while (adapt->inflight >= adapt->limit)
+        pthread_cond_wait(&adapt->room, &adapt->lock);
+    ++adapt->inflight;
+    pthread_mutex_unlock(&adapt->lock);
+    return Adapt_now();
+}
+
+void Adapt_leave(Adapt *adapt, int64_t begin_ns, size_t bytes)
+{
+    int64_t now = Adapt_now();
+
+    pthread_mutex_lock(&adapt->lock);
+    --adapt->inflight;
+    adapt->bytes += bytes;
+    adapt->latency_ns += now - begin_ns;
+    ++adapt->files;
+    if (now - adapt->window_ns >= (int64_t)Adapt_WINDOW_MS * 1000000)
+        Adapt_update(adapt, now);
+    pthread_cond_broadcast(&adapt->room);
+    pthread_mutex_unlock(&adapt->lock);
+}
+
+unsigned Adapt_limit(Adapt *adapt)
+{
+    unsigned limit;
+
+    pthread_mutex_lock(&adapt->lock);
+    limit = adapt->limit;
+    pthread_mutex_unlock(&adapt->lock);
+    return limit;
+}
+
+void Adapt_del(Adapt *adapt)
+{
+    if (!adapt)
+        return;
+
+    pthread_cond_destroy(&adapt->room);
+    pthread_mutex_destroy(&adapt->lock);
+    free(adapt);
+}
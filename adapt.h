@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Finds how many files to have in flight at once, for the devices at
+// hand.  Every Adapt_WINDOW_MS, the throughput of the window (bytes of
+// the files done, per second) is compared to the previous one: while it
+// grows, the limit grows, doubling at first and then one by one; once
+// it falls, or stalls while the latency of the files grows, the limit
+// is cut by a quarter.
+
+enum {
+    Adapt_WINDOW_MS = 200,
+    Adapt_MAXJOBS = 64,         // the ceiling, unless given
+};
+
+typedef struct Adapt Adapt;
+
+// The limit starts at 1, and never goes beyond max.
+Adapt *Adapt_new(unsigned max);
+
+// Waits for room under the limit, and returns the time the file
+// entered, to be given back to Adapt_leave.
+int64_t Adapt_enter(Adapt *);
+
+void Adapt_leave(Adapt *, int64_t begin_ns, size_t bytes);
+
+unsigned Adapt_limit(Adapt *);
+
+void Adapt_del(Adapt *);
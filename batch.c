@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+
+#include "batch.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "events.h"
+#include "uring.h"
+#include "util.h"
+
+// A batch collects the files coming from the input, and hashes them in
+// the order of their physical location on the storage, so that
+// rotational media are read with a (mostly) forward-moving head.  With
+// an io_uring hasher, the reads of consecutive files overlap, which
+// keeps solid state drives busy.
+//
+// The files are then handed to the FileRepo in the input order, so
+// that the resulting catalog is the same as the one obtained by adding
+// the files one by one.
+//
+// The files of a batch are stat'ed all at once, through io_uring or
+// else by several threads, so that file systems with a high latency
+// (NFS, CIFS) serve them in parallel rather than one round-trip each.
+
+enum {
+    Batch_STAT_DEPTH = 256,     // stat requests in flight
+    Batch_STAT_THREADS = 16,    // without io_uring
+};
+
+typedef struct {
+    const char *path;
+    const char *key;
+    const char *filehash;   // with fast keys, if read along the key
+    File file;
+    uint64_t location;
+    uint64_t seq;
+    bool valid;
+    bool unchanged; // catalogued already: not read
+} Item;
+
+struct Batch {
+    FileRepo *filerepo;
+    struct Events *events;
+    Item *items;
+    Item **order;
+    const char **paths;
+    char **keys;
+    char **filehashes;
+    struct statx *stats;
+    int *errnums;
+    Uring *uring;       // NULL if io_uring is not available
+    size_t size;
+    size_t used;
+};
+
+void Batch_del(Batch *batch)
+{
+    if (!batch)
+        return;
+
+    for (size_t i = 0; i < batch->used; ++i)
+        free((void *)batch->items[i].path);
+    free(batch->items);
+    free(batch->order);
+    free(batch->paths);
+    free(batch->keys);
+    free(batch->filehashes);
+    free(batch->stats);
+    free(batch->errnums);
+    Uring_del(batch->uring);
+    free(batch);
+}
+
+Batch *Batch_new(FileRepo *filerepo, struct Events *events, size_t size)
+{
+    Batch *batch;
+
+    batch = malloc(sizeof(Batch));
+    if (!batch) {
+        warn("malloc");
+        goto fail;
+    }
+
+    *batch = (Batch){
+        .filerepo = filerepo,
+        .events = events,
+        .size = size ? size : 1,
+    };
+
+    batch->items = calloc(batch->size, sizeof(Item));
+    if (!batch->items) {
+        warn("calloc");
+        goto fail;
+    }
+
+    batch->order = calloc(batch->size, sizeof(Item *));
+    if (!batch->order) {
+        warn("calloc");
+        goto fail;
+    }
+
+    batch->paths = calloc(batch->size, sizeof(const char *));
+    batch->keys = calloc(batch->size, sizeof(char *));
+    batch->filehashes = calloc(batch->size, sizeof(char *));
+    batch->stats = calloc(batch->size, sizeof(struct statx));
+    batch->errnums = calloc(batch->size, sizeof(int));
+    if (!batch->paths || !batch->keys || !batch->filehashes
+            || !batch->stats || !batch->errnums) {
+        warn("calloc");
+        goto fail;
+    }
+
+    batch->uring = Uring_new_stat(batch->size < Batch_STAT_DEPTH
+                                  ? batch->size
+                                  : Batch_STAT_DEPTH);
+
+    return batch;
+
+fail:
+    Batch_del(batch);
+    return NULL;
+}
+
+static
+uint64_t Batch_location(const Item *item)
+{
+    int fd;
+    union {
+        struct fiemap fiemap;
+        char raw[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } buffer = {
+        .fiemap = {
+            .fm_length = FIEMAP_MAX_OFFSET,
+            .fm_extent_count = 1,
+        },
+    };
+
+    fd = open(item->path, O_RDONLY);
+    if (fd == -1)
+        return item->file.inode_id;
+
+    // Not all file systems support FIEMAP, and empty or inline files
+    // have no extent: the inode number is the next best guess, as
+    // inodes are usually allocated close to their data.
+    if (ioctl(fd, FS_IOC_FIEMAP, &buffer.fiemap) == -1
+            || buffer.fiemap.fm_mapped_extents == 0) {
+        Util_fdclose(&fd);
+        return item->file.inode_id;
+    }
+
+    Util_fdclose(&fd);
+    return buffer.fiemap.fm_extents[0].fe_physical;
+}
+
+static
+int Batch_cmp_location(const void *a, const void *b)
+{
+    const Item *i1 = *(const Item **)a;
+    const Item *i2 = *(const Item **)b;
+
+    if (i1->file.device_id != i2->file.device_id)
+        return i1->file.device_id < i2->file.device_id ? -1 : 1;
+    if (i1->location != i2->location)
+        return i1->location < i2->location ? -1 : 1;
+    return 0;
+}
+
+typedef struct {
+    Batch *batch;
+    size_t first;
+    size_t step;
+} Stater;
+
+static
+void *Batch_stat_slice(void *arg)
+{
+    const Stater *stater = arg;
+    Batch *batch = stater->batch;
+
+    for (size_t i = stater->first; i < batch->used; i += stater->step)
+        batch->errnums[i] = statx(AT_FDCWD, batch->paths[i], 0,
+                                  STATX_BASIC_STATS, &batch->stats[i])
+                            ? errno
+                            : 0;
+    return NULL;
+}
+
+static
+void Batch_stat_threads(Batch *batch)
+{
+    Stater staters[Batch_STAT_THREADS];
+    pthread_t threads[Batch_STAT_THREADS];
+    size_t nthreads, started = 0;
+
+    nthreads = batch->used < Batch_STAT_THREADS
+               ? batch->used
+               : Batch_STAT_THREADS;
+
+    for (size_t t = 0; t < nthreads; ++t)
+        staters[t] = (Stater){
+            .batch = batch,
+            .first = t,
+            .step = nthreads,
+        };
+
+    // The first slice is handled by the calling thread.
+    for (size_t t = 1; t < nthreads; ++t) {
+        if (pthread_create(&threads[t], NULL, Batch_stat_slice,
+                           &staters[t]))
+            break;
+        started = t;
+    }
+
+    for (size_t t = started + 1; t < nthreads; ++t)
+        Batch_stat_slice(&staters[t]);
+    if (nthreads)
+        Batch_stat_slice(&staters[0]);
+
+    for (size_t t = 1; t <= started; ++t)
+        pthread_join(threads[t], NULL);
+}
+
+static
+void Batch_stat(Batch *batch)
+{
+    for (size_t i = 0; i < batch->used; ++i)
+        batch->paths[i] = batch->items[i].path;
+
+    if (batch->uring && Uring_stat_files(batch->uring, batch->paths,
+                                         batch->used, batch->stats,
+                                         batch->errnums) == 0)
+        return;
+
+    // A ring unable to stat is not tried again.
+    Uring_del(batch->uring);
+    batch->uring = NULL;
+    Batch_stat_threads(batch);
+}
+
+static
+int Batch_init_file(Batch *batch, size_t i)
+{
+    const struct statx *stx = &batch->stats[i];
+    Item *item = &batch->items[i];
+    struct stat statbuf;
+
+    if (batch->errnums[i]) {
+        errno = batch->errnums[i];
+        warn("stat(%s, ...)", item->path);
+        return -1;
+    }
+
+    statbuf = (struct stat){
+        .st_mode = stx->stx_mode,
+        .st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor),
+        .st_ino = stx->stx_ino,
+        .st_size = stx->stx_size,
+        .st_mtim = {
+            .tv_sec = stx->stx_mtime.tv_sec,
+            .tv_nsec = stx->stx_mtime.tv_nsec,
+        },
+    };
+    return File_init_stat(&item->file, item->path, &statbuf);
+}
+
+int Batch_flush(Batch *batch)
+{
+    size_t n_order = 0;
+    int64_t begin;
+    int fails = 0;
+
+    begin = Events_trace_begin(batch->events);
+    Batch_stat(batch);
+    Events_trace_end(batch->events, "stat", NULL, begin);
+
+    for (size_t i = 0; i < batch->used; ++i) {
+        Item *item = &batch->items[i];
+
+        item->valid = !Batch_init_file(batch, i);
+        if (!item->valid)
+            continue;
+
+        item->unchanged = FileRepo_unchanged(batch->filerepo, &item->file);
+        if (item->unchanged)
+            continue;
+
+        // Already checksummed by an interrupted run.
+        item->key = FileRepo_journaled_key(batch->filerepo, &item->file);
+        if (item->key) {
+            item->key = strdup(item->key);
+            if (!item->key) {
+                warn("strdup");
+                item->valid = false;
+            }
+            continue;
+        }
+
+        item->location = Batch_location(item);
+        batch->order[n_order++] = item;
+    }
+
+    qsort(batch->order, n_order, sizeof(Item *), Batch_cmp_location);
+
+    for (size_t i = 0; i < n_order; ++i)
+        batch->paths[i] = batch->order[i]->path;
+
+    // The files of a batch are read together: one span for all.
+    begin = Events_trace_begin(batch->events);
+    FileRepo_key_files(batch->filerepo, batch->paths, n_order,
+                       batch->keys, batch->filehashes);
+    Events_trace_end(batch->events, "hash", NULL, begin);
+
+    for (size_t i = 0; i < n_order; ++i) {
+        Item *item = batch->order[i];
+
+        item->key = batch->keys[i];
+        item->filehash = batch->filehashes[i];
+        item->valid = item->key != NULL;
+    }
+
+    for (size_t i = 0; i < batch->used; ++i) {
+        Item *item = &batch->items[i];
+
+        if (!item->unchanged
+                && (!item->valid
+                    || FileRepo_add_file(batch->filerepo,
+                                         &item->file,
+                                         item->seq,
+                                         item->key,
+                                         item->filehash))) {
+            Events_skipped_filename(batch->events, item->path);
+            ++fails;
+        }
+
+        File_free(&item->file);
+        free((void *)item->key);
+        free((void *)item->filehash);
+        free((void *)item->path);
+        *item = (Item){};
+    }
+
+    batch->used = 0;
+    return fails;
+}
+
+int Batch_add(Batch *batch, const char *path, uint64_t seq)
+{
+    const char *copy;
+    int fails = 0;
+
+    if (batch->used == batch->size)
+        fails = Batch_flush(batch);
+
+    copy = strdup(path);
+    if (!copy) {
+        warn("strdup");
+        Events_skipped_filename(batch->events, path);
+        return fails + 1;
+    }
+
+    batch->items[batch->used++] = (Item){
+        .path = copy,
+        .seq = seq,
+    };
+    return fails;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "filerepo.h"
+
+typedef struct Batch Batch;
+
+struct Events;
+
+Batch *Batch_new(FileRepo *, struct Events *, size_t size);
+
+// Both return the number of files that could not be added.  The file
+// comes at rank seq in the input.
+int Batch_add(Batch *, const char *path, uint64_t seq);
+int Batch_flush(Batch *);
+
+void Batch_del(Batch *);
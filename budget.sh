@@ -0,0 +1,146 @@
+#!/bin/sh
+
+# Syscall budgets: fixed workloads run under strace(1), and the system
+# calls they make per file are checked against budgets, so that a change
+# making cathy chattier with the kernel fails the tests.  They require
+# strace: without it, they fail, unless BUDGET_OPTIONAL=1 is set in the
+# environment, which skips them explicitly.
+
+set -e
+
+if ! command -v strace >/dev/null; then
+	if [ "${BUDGET_OPTIONAL:-0}" = 1 ]; then
+		echo >&2 "# SKIP: strace not found, syscall budgets not checked"
+		exit 0
+	fi
+	echo >&2 "strace not found: set BUDGET_OPTIONAL=1 to skip the budgets"
+	exit 1
+fi
+
+echo >&2 "# NOTE: logging in test.log"
+exec 3>>test.log
+failures=
+tmpdir=
+
+atexit() {
+	local e="$?"
+
+	if [ "$tmpdir" ]; then
+		rm -rf "$tmpdir"
+	fi
+
+	if [ "$e" != 0 ]; then
+		echo >&2 "command failed"
+		exit 1
+	fi
+
+	if [ "$failures" ]; then
+		echo >&2 "$failures budgets exceeded"
+	else
+		echo >&2 "SUCCESS!"
+	fi
+
+	exit ${failures:-0}
+}
+trap atexit EXIT
+
+cathy="$(command -v cathy)"
+tmpdir="$(mktemp -d)"
+filehier="$tmpdir/hier"
+mkdir "$filehier"
+
+# The workload: unique files, some of them copied once.
+nfiles=200
+ndups=50
+for i in $(seq $nfiles); do
+	printf "file %d\n" "$i" >"$filehier/file$i"
+done
+for i in $(seq $ndups); do
+	cp -a "$filehier/file$i" "$filehier/copy$i"
+done
+find "$filehier" -type f -print0 >"$tmpdir/input"
+ninput=$((nfiles + ndups))
+
+# Runs cathy on the workload, following its children, and keeps the
+# summary of strace -c.  retrace keeps the output of the previous run.
+trace() {
+	rm -rf "$tmpdir/out"
+	mkdir "$tmpdir/out"
+	retrace "$@"
+}
+
+retrace() {
+	strace -f -c -o "$tmpdir/summary" \
+		"$cathy" -o "$tmpdir/out" "$@" <"$tmpdir/input" 2>&3
+	cat "$tmpdir/summary" >&3
+}
+
+# The calls to the given syscalls, summed.
+calls() {
+	awk -v names=" $* " '
+		index(names, " " $NF " ") { n += $4 }
+		END { print n + 0 }
+	' "$tmpdir/summary"
+}
+
+total() {
+	awk '$NF == "total" { print $4 }' "$tmpdir/summary"
+}
+
+# at_most what count budget: fails if count exceeds budget.
+at_most() {
+	local result=ok
+
+	if [ "$2" -gt "$3" ]; then
+		result=fail
+		failures=$((failures + 1))
+	fi
+	printf >&3 "%s: %d, budget %d\n" "$1" "$2" "$3"
+	printf >&2 "%s - %s: %d <= %d\n" $result "$1" "$2" "$3"
+}
+
+forks="fork vfork clone clone3"
+
+echo >&2 "# builtin hasher and comparer"
+trace -H builtin -C builtin
+at_most "forks" "$(calls $forks)" 0
+at_most "execs" "$(calls execve execveat)" 1
+at_most "syscalls" "$(total)" $((45 * ninput))
+at_most "opens" "$(calls open openat openat2)" $((4 * ninput))
+at_most "stats" "$(calls stat lstat fstat newfstatat statx)" $((5 * ninput))
+at_most "symlinks" "$(calls symlink symlinkat)" $((2 * nfiles))
+at_most "mkdirs" "$(calls mkdir mkdirat)" $((6 * nfiles))
+# Paths are resolved once per directory, not per file.
+at_most "readlinks" "$(calls readlink readlinkat)" 16
+at_most "unlinks" "$(calls unlink unlinkat)" 0
+
+echo >&2 "# builtin, removing the duplicates"
+trace -H builtin -C builtin -r
+at_most "unlinks" "$(calls unlink unlinkat)" $ndups
+at_most "syscalls" "$(total)" $((45 * ninput))
+
+echo >&2 "# builtin, relinking after a crash"
+trace -H builtin -C builtin -J "$tmpdir/journal"
+# Interrupted before any link was journaled: the links are all looked
+# for, in a single by-time directory.
+size="$(tr '\0' '\n' <"$tmpdir/journal" |
+	awk '$0 == "L" { print n; exit } { n += length($0) + 1 }')"
+truncate -s "$size" "$tmpdir/journal"
+retrace -H builtin -C builtin -J "$tmpdir/journal"
+at_most "symlinks" "$(calls symlink symlinkat)" 0
+at_most "readlinks" "$(calls readlink readlinkat)" $((3 * nfiles))
+rm "$tmpdir/journal"
+
+echo >&2 "# external hasher and comparer"
+trace
+at_most "forks" "$(calls $forks)" $((ninput + ndups))
+
+echo >&2 "# builtin, resuming a file appended to"
+head -c 64000000 /dev/urandom >"$tmpdir/big"
+printf "%s\0" "$tmpdir/big" >"$tmpdir/input"
+trace -H builtin -a "$tmpdir/state"
+head -c 1000000 /dev/urandom >>"$tmpdir/big"
+trace -H builtin -a "$tmpdir/state"
+# Hashed anew, the file alone would take 65 reads of 1 MiB, and the
+# run about 70.
+at_most "reads" "$(calls read pread64)" 24
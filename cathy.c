@@ -1,23 +1,67 @@
 #include <err.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <sysexits.h>
 #include <unistd.h>
 
+#include "adapt.h"
+#include "batch.h"
+#include "chunks.h"
+#include "devqueue.h"
 #include "events.h"
 #include "file.h"
 #include "filerepo.h"
 #include "hasher.h"
+#include "index.h"
 #include "ioread.h"
+#include "journal.h"
+#include "merge.h"
 #include "outdir.h"
+#include "query.h"
+#include "rebuild.h"
+#include "stream.h"
+#include "throttle.h"
+#include "unlinker.h"
+#include "util.h"
+#include "verify.h"
+#include "watch.h"
 
 typedef struct {
     const char *cmpprg;
     const char *hashprg;
     const char *outdir;
     const char *events_logfile;
+    const char *query;
+    const char *journal;
+    const char *trace;
+    const char *resume;
+    char * const *partials;
+    size_t npartials;
+    size_t batch_size;
+    size_t memcap;
+    size_t throttle_rate;
+    unsigned throttle_latency;
+    OutDir_Layout layout;
+    unsigned jobs;
+    unsigned coprocs;
+    unsigned shard_index;
+    unsigned shard_count;
+    unsigned queue_depth;
+    Stream_Policy io_policy;
+    bool adaptive;
+    bool chunks;
+    bool fast_keys;
+    bool merge;
+    bool rebuild;
     bool remove_files;
+    bool verify;
+    bool watch;
 } Options;
 
 static
@@ -25,16 +69,118 @@ void usage(const char *prgname, int exval)
 {
     fprintf(stderr,
         "usage: %s"
+        " [-a state_file]"
+        " [-A]"
+        " [-b batch_size]"
+        " [-c]"
         " [-C comparer]"
         " [-e events_log_file]"
         " [-H hasher]"
+        " [-I io_policy]"
+        " [-j jobs]"
+        " [-J journal]"
+        " [-L layout]"
+        " [-m memory_cap]"
+        " [-M]"
         " [-o outdir]"
+        " [-P coprocesses]"
+        " [-q catalog]"
         " [-r]"
+        " [-R]"
+        " [-s shard/count]"
+        " [-t rate[,latency_ms]]"
+        " [-T trace_file]"
+        " [-u queue_depth]"
+        " [-V]"
+        " [-w]"
+        " [-x]"
+        " [partial_catalog ...]"
         "\n",
         prgname);
     exit(exval);
 }
 
+static
+size_t parse_size(const char *prgname, const char *arg)
+{
+    unsigned long long value;
+    char *end;
+
+    errno = 0;
+    value = strtoull(arg, &end, 10);
+    if (errno || end == arg || *arg == '-' || *end != '\0'
+            || value > SIZE_MAX) {
+        warnx("invalid number: '%s'", arg);
+        usage(prgname, EX_USAGE);
+    }
+    return value;
+}
+
+static
+size_t parse_bytes(const char *prgname, const char *arg)
+{
+    static const char units[] = "kMG";
+    unsigned long long value;
+    const char *unit;
+    char *end;
+
+    errno = 0;
+    value = strtoull(arg, &end, 10);
+    if (*end && end[1] == '\0' && (unit = strchr(units, *end)) != NULL) {
+        int shift = 10 * (unit - units + 1);
+
+        if (value > SIZE_MAX >> shift)
+            errno = ERANGE;
+        else
+            value <<= shift;
+        ++end;
+    }
+
+    if (errno || end == arg || *arg == '-' || *end != '\0'
+            || value > SIZE_MAX) {
+        warnx("invalid size: '%s'", arg);
+        usage(prgname, EX_USAGE);
+    }
+    return value;
+}
+
+static
+void parse_shard(const char *prgname, const char *arg, Options *outopts)
+{
+    int end = -1;
+
+    if (sscanf(arg, "%u/%u%n", &outopts->shard_index,
+               &outopts->shard_count, &end) != 2
+            || end == -1 || arg[end] != '\0'
+            || outopts->shard_index >= outopts->shard_count) {
+        warnx("invalid shard: '%s'", arg);
+        usage(prgname, EX_USAGE);
+    }
+}
+
+static
+void parse_throttle(const char *prgname, const char *arg, Options *outopts)
+{
+    const char *comma = strchr(arg, ',');
+    size_t len = comma ? (size_t)(comma - arg) : strlen(arg);
+    char rate[32];
+
+    if (len >= sizeof(rate)) {
+        warnx("invalid rate: '%s'", arg);
+        usage(prgname, EX_USAGE);
+    }
+    memcpy(rate, arg, len);
+    rate[len] = '\0';
+
+    outopts->throttle_rate = parse_bytes(prgname, rate);
+    if (outopts->throttle_rate == 0) {
+        warnx("invalid rate: '%s'", arg);
+        usage(prgname, EX_USAGE);
+    }
+    if (comma)
+        outopts->throttle_latency = parse_size(prgname, comma + 1);
+}
+
 static
 void parseopts(int argc, char **argv, Options *outopts)
 {
@@ -44,10 +190,24 @@ void parseopts(int argc, char **argv, Options *outopts)
         .cmpprg = "cmp",
         .hashprg = "sha1sum",
         .outdir = ".",
+        .io_policy = Stream_SEQUENTIAL,
     };
 
-    while (opt = getopt(argc, argv, "C:e:hH:o:r"), opt != -1) {
+    while (opt = getopt(argc, argv, "a:Ab:cC:e:hH:I:j:J:L:m:Mo:P:q:rRs:t:T:u:Vwx"),
+           opt != -1) {
         switch (opt) {
+        case 'a':
+            outopts->resume = optarg;
+            break;
+        case 'A':
+            outopts->adaptive = true;
+            break;
+        case 'b':
+            outopts->batch_size = parse_size(argv[0], optarg);
+            break;
+        case 'c':
+            outopts->chunks = true;
+            break;
         case 'C':
             outopts->cmpprg = optarg;
             break;
@@ -57,33 +217,584 @@ void parseopts(int argc, char **argv, Options *outopts)
         case 'H':
             outopts->hashprg = optarg;
             break;
+        case 'I':
+            if (Stream_parse_policy(optarg, &outopts->io_policy))
+                usage(argv[0], EX_USAGE);
+            break;
+        case 'j':
+            outopts->jobs = parse_size(argv[0], optarg);
+            if (outopts->jobs == 0)
+                usage(argv[0], EX_USAGE);
+            break;
+        case 'J':
+            outopts->journal = optarg;
+            break;
+        case 'L':
+            if (OutDir_parse_layout(optarg, &outopts->layout))
+                usage(argv[0], EX_USAGE);
+            break;
+        case 'm':
+            outopts->memcap = parse_bytes(argv[0], optarg);
+            break;
+        case 'M':
+            outopts->merge = true;
+            break;
         case 'o':
             outopts->outdir = optarg;
             break;
+        case 'P':
+            outopts->coprocs = parse_size(argv[0], optarg);
+            break;
+        case 'q':
+            outopts->query = optarg;
+            break;
         case 'r':
             outopts->remove_files = true;
             break;
+        case 'R':
+            outopts->rebuild = true;
+            break;
+        case 's':
+            parse_shard(argv[0], optarg, outopts);
+            break;
+        case 't':
+            parse_throttle(argv[0], optarg, outopts);
+            break;
+        case 'T':
+            outopts->trace = optarg;
+            break;
+        case 'u':
+            outopts->queue_depth = parse_size(argv[0], optarg);
+            break;
+        case 'V':
+            outopts->verify = true;
+            break;
+        case 'w':
+            outopts->watch = true;
+            break;
+        case 'x':
+            outopts->fast_keys = true;
+            break;
         default:
             usage(argv[0], opt == 'h' ? 0 : EX_USAGE);
         }
     }
+
+    outopts->partials = argv + optind;
+    outopts->npartials = argc - optind;
+    if (outopts->merge && outopts->watch) {
+        warnx("-M and -w are mutually exclusive");
+        usage(argv[0], EX_USAGE);
+    }
+
+    if (outopts->watch) {
+        if (outopts->npartials == 0) {
+            warnx("directories to watch are required by -w");
+            usage(argv[0], EX_USAGE);
+        }
+    } else if (outopts->merge != (outopts->npartials > 0)) {
+        warnx("partial catalogs are required by, and only by, -M");
+        usage(argv[0], EX_USAGE);
+    }
+
+    if (outopts->watch
+            && (outopts->chunks || outopts->jobs || outopts->memcap
+                || outopts->query || outopts->rebuild
+                || outopts->shard_count)) {
+        warnx("-w cannot be combined with -c, -j, -m, -q, -R or -s");
+        usage(argv[0], EX_USAGE);
+    }
+
+    if (outopts->memcap
+            && (outopts->batch_size || outopts->chunks
+                || outopts->fast_keys)) {
+        warnx("-m cannot be combined with -b, -c or -x");
+        usage(argv[0], EX_USAGE);
+    }
+
+    if (outopts->journal
+            && (outopts->memcap || outopts->merge || outopts->query
+                || outopts->rebuild)) {
+        warnx("-J cannot be combined with -m, -M, -q or -R");
+        usage(argv[0], EX_USAGE);
+    }
+
+    if (outopts->verify
+            && (outopts->batch_size || outopts->chunks || outopts->journal
+                || outopts->memcap || outopts->merge || outopts->query
+                || outopts->rebuild || outopts->remove_files
+                || outopts->shard_count || outopts->watch
+                || outopts->fast_keys)) {
+        warnx("-V cannot be combined with -b, -c, -J, -m, -M, -q, -r, -R,"
+              " -s, -w or -x");
+        usage(argv[0], EX_USAGE);
+    }
+
+    if (outopts->adaptive
+            && (outopts->batch_size || outopts->memcap || outopts->merge
+                || outopts->query || outopts->rebuild || outopts->verify
+                || outopts->watch)) {
+        warnx("-A cannot be combined with -b, -m, -M, -q, -R, -V or -w");
+        usage(argv[0], EX_USAGE);
+    }
+
+    if (outopts->resume
+            && (strcmp(outopts->hashprg, Hasher_BUILTIN)
+                || outopts->rebuild || outopts->verify)) {
+        warnx("-a requires -H " Hasher_BUILTIN ", and cannot be combined"
+              " with -R or -V");
+        usage(argv[0], EX_USAGE);
+    }
+
+    if (outopts->layout.nlevels && outopts->query) {
+        warnx("-L cannot be combined with -q");
+        usage(argv[0], EX_USAGE);
+    }
+
+    if (!outopts->jobs)
+        outopts->jobs = outopts->adaptive ? Adapt_MAXJOBS : 1;
 }
 
 static
-void loop_entries(const FileRepo *filerepo,
-                  const OutDir *outdir,
-                  Events *events)
+bool in_shard(const Options *opts, const char *path)
+{
+    uint64_t hash = 0xcbf29ce484222325;    // FNV-1a
+
+    for (const char *c = path; *c; ++c)
+        hash = (hash ^ (unsigned char)*c) * 0x100000001b3;
+    return hash % opts->shard_count == opts->shard_index;
+}
+
+// A duplicate removed by an interrupted run, which the input still
+// lists.
+static
+bool already_removed(const Journal *journal, const char *path)
+{
+    struct stat statbuf;
+
+    return Journal_is_removed(journal, path)
+        && lstat(path, &statbuf) == -1 && errno == ENOENT;
+}
+
+// The input is shared by the threads adding files: each one takes the
+// next path, and adds it by itself.  Without batches, the paths are
+// read ahead and queued by device, so that the devices are read in
+// parallel, each one by as many threads as suits it.
+typedef struct {
+    IORead ioread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       // a device has room again
+    DevQueue *devqueue;         // NULL unless scheduling by device
+    Adapt *adapt;               // NULL unless adapting the concurrency
+    bool eof;
+    uint64_t seq;               // the paths read so far
+    FileRepo *filerepo;
+    const Journal *journal;
+    Events *events;
+    const Options *opts;
+    int fails;
+} Input;
+
+enum {
+    Input_LOOKAHEAD = 1024,
+};
+
+// The next path, and its rank in the input.
+static
+char *input_read(Input *input, uint64_t *seq)
+{
+    const char *fname;
+    char *copy = NULL;
+
+    while (!copy && (fname = IORead_next(&input->ioread), fname != NULL)) {
+        if (input->opts->shard_count && !in_shard(input->opts, fname))
+            continue;
+        if (input->journal && already_removed(input->journal, fname))
+            continue;
+
+        copy = strdup(fname);
+        if (!copy) {
+            warn("strdup");
+            Events_skipped_filename(input->events, fname);
+            ++input->fails;
+        }
+        *seq = input->seq++;
+    }
+    return copy;
+}
+
+static
+char *input_schedule(Input *input, DevQueue_Device **device, uint64_t *seq)
+{
+    for (;;) {
+        struct stat statbuf;
+        char *path;
+
+        path = DevQueue_pop(input->devqueue, device, seq);
+        if (path)
+            return path;
+
+        // Read ahead, until a file is found on a device having room.
+        if (!input->eof
+                && DevQueue_pending(input->devqueue) < Input_LOOKAHEAD) {
+            path = input_read(input, seq);
+            if (!path) {
+                input->eof = true;
+                continue;
+            }
+
+            // Stat'ed unlocked, as a slow device would hold the other
+            // threads, and following symbolic links, as the file added
+            // is the target.  A file which cannot be stat'ed fails later,
+            // when added.
+            pthread_mutex_unlock(&input->lock);
+            if (stat(path, &statbuf))
+                statbuf.st_dev = 0;
+            pthread_mutex_lock(&input->lock);
+
+            if (DevQueue_push(input->devqueue, path, *seq,
+                              statbuf.st_dev)) {
+                Events_skipped_filename(input->events, path);
+                ++input->fails;
+            }
+            free(path);
+            continue;
+        }
+
+        if (input->eof && DevQueue_pending(input->devqueue) == 0)
+            return NULL;
+        pthread_cond_wait(&input->ready, &input->lock);
+    }
+}
+
+// The next path to add, to be freed, or NULL at the end of the input,
+// and its rank.  With device queues, the device counts the file as
+// being read until input_done.
+static
+char *input_next(Input *input, DevQueue_Device **device, uint64_t *seq)
+{
+    char *path;
+
+    pthread_mutex_lock(&input->lock);
+    path = input->devqueue
+        ? input_schedule(input, device, seq)
+        : input_read(input, seq);
+    pthread_mutex_unlock(&input->lock);
+    return path;
+}
+
+static
+void input_done(Input *input, DevQueue_Device *device)
+{
+    if (!device)
+        return;
+
+    pthread_mutex_lock(&input->lock);
+    DevQueue_done(device);
+    pthread_cond_broadcast(&input->ready);
+    pthread_mutex_unlock(&input->lock);
+}
+
+static
+void *input_worker(void *arg)
+{
+    Input *input = arg;
+    Batch *batch = NULL;
+    DevQueue_Device *device = NULL;
+    char *fname;
+    uint64_t seq;
+    int fails = 0;
+
+    if (input->opts->batch_size) {
+        batch = Batch_new(input->filerepo, input->events,
+                          input->opts->batch_size);
+        if (!batch) {
+            fails = 1;
+            goto exit;
+        }
+    }
+
+    while (fname = input_next(input, &device, &seq), fname != NULL) {
+        int64_t begin = input->adapt ? Adapt_enter(input->adapt) : 0;
+        off_t size = 0;
+
+        if (batch)
+            fails += Batch_add(batch, fname, seq);
+        else if (FileRepo_add(input->filerepo, fname, seq, &size)) {
+            Events_skipped_filename(input->events, fname);
+            ++fails;
+        }
+        if (input->adapt)
+            Adapt_leave(input->adapt, begin, size);
+        free(fname);
+        input_done(input, device);
+    }
+
+    if (batch)
+        fails += Batch_flush(batch);
+
+exit:
+    Batch_del(batch);
+    pthread_mutex_lock(&input->lock);
+    input->fails += fails;
+    pthread_mutex_unlock(&input->lock);
+    return NULL;
+}
+
+static
+int loop_input(FileRepo *filerepo,
+               const Journal *journal,
+               Events *events,
+               const Options *opts)
+{
+    Input input = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .ready = PTHREAD_COND_INITIALIZER,
+        .filerepo = filerepo,
+        .journal = journal,
+        .events = events,
+        .opts = opts,
+    };
+    pthread_t *threads;
+    unsigned started = 0;
+
+    if (opts->jobs > 1 && FileRepo_set_concurrent(filerepo))
+        return 1;
+
+    // Batches are read in the order of their location instead, and the
+    // adaptive mode finds the limit by itself.
+    if (opts->jobs > 1 && !opts->batch_size && !opts->adaptive) {
+        input.devqueue = DevQueue_new(opts->jobs);
+        if (!input.devqueue)
+            return 1;
+    }
+
+    if (opts->adaptive) {
+        input.adapt = Adapt_new(opts->jobs);
+        if (!input.adapt) {
+            DevQueue_del(input.devqueue);
+            return 1;
+        }
+    }
+
+    threads = calloc(opts->jobs, sizeof(pthread_t));
+    if (!threads) {
+        warn("calloc");
+        Adapt_del(input.adapt);
+        DevQueue_del(input.devqueue);
+        return 1;
+    }
+
+    IORead_init(&input.ioread);
+
+    // The calling thread is one of the workers.
+    for (unsigned j = 1; j < opts->jobs; ++j) {
+        int e = pthread_create(&threads[j], NULL, input_worker, &input);
+
+        if (e) {
+            errno = e;
+            warn("pthread_create");
+            break;
+        }
+        started = j;
+    }
+
+    input_worker(&input);
+
+    for (unsigned j = 1; j <= started; ++j)
+        pthread_join(threads[j], NULL);
+
+    if (input.ioread.errno_s)
+        ++input.fails;
+
+    if (input.adapt)
+        Events_concurrency(events, Adapt_limit(input.adapt));
+
+    IORead_free(&input.ioread);
+    Adapt_del(input.adapt);
+    DevQueue_del(input.devqueue);
+    free(threads);
+    return input.fails;
+}
+
+typedef struct {
+    OutDir *outdir;         // NULL for shards: only the index is written.
+    Index_Writer *writer;
+    Unlinker *unlinker;     // NULL unless removing files.
+    Journal *journal;       // NULL unless journaling.
+} Output;
+
+enum {
+    // With a memory cap, removals are carried out by groups this big.
+    Output_UNLINK_GROUP = 1 << 16,
+};
+
+static
+int output_open(Output *output,
+                const Options *opts,
+                const char *spilldir,
+                Journal *journal,
+                Events *events)
+{
+    *output = (Output){
+        .journal = journal,
+    };
+
+    if (opts->shard_count) {
+        if (mkdir(opts->outdir, 0777) && errno != EEXIST) {
+            warn("mkdir(%s, 0777)", opts->outdir);
+            return -1;
+        }
+    } else {
+        output->outdir = OutDir_new(opts->outdir, &opts->layout);
+        if (!output->outdir)
+            return -1;
+    }
+
+    output->writer = Index_Writer_new();
+    if (!output->writer)
+        goto fail;
+
+    if (spilldir) {
+        char *prefix = Util_concat(spilldir, "/output.", NULL);
+
+        if (!prefix || Index_Writer_set_spill(output->writer, prefix,
+                                              opts->memcap / 2)) {
+            free(prefix);
+            goto fail;
+        }
+        free(prefix);
+    }
+
+    if (opts->remove_files) {
+        output->unlinker = Unlinker_new(events,
+                                        spilldir ? Output_UNLINK_GROUP : 0);
+        if (!output->unlinker)
+            goto fail;
+        if (journal)
+            Unlinker_set_journal(output->unlinker, journal);
+    }
+
+    return 0;
+
+fail:
+    OutDir_del(output->outdir);
+    Index_Writer_del(output->writer);
+    return -1;
+}
+
+static
+int output_link(const Output *output, const FileRepo_Entry *entry)
+{
+    const OutDir_LinkInfo linkinfo = {
+        .hash = entry->filehash,
+        .path = entry->file->path,
+        .mtime = entry->file->mtime,
+    };
+
+    if (!output->journal)
+        return OutDir_link(output->outdir, &linkinfo);
+
+    // The links recorded are the ones of the recorded version of the file.
+    if (Journal_is_linked(output->journal, linkinfo.path)
+            && Journal_find_hash(output->journal, entry->file))
+        return 0;
+
+    // The links made after the last sync of the journal are not known.
+    if (Journal_resumed(output->journal)
+            ? OutDir_relink(output->outdir, &linkinfo)
+            : OutDir_link(output->outdir, &linkinfo))
+        return -1;
+
+    return Journal_add_link(output->journal, linkinfo.path);
+}
+
+static
+int output_traced_link(const Output *output,
+                       const FileRepo_Entry *entry,
+                       Events *events)
+{
+    int64_t begin = Events_trace_begin(events);
+    int ex = output_link(output, entry);
+
+    Events_trace_end(events, "link", entry->file->path, begin);
+    return ex;
+}
+
+// Links and indexes a file kept.
+static
+int output_entry(Output *output, const FileRepo_Entry *entry, Events *events)
+{
+    if (!entry->filehash) {
+        warnx("failed to hash file %s", entry->file->path);
+        return 1;
+    }
+
+    if (output->outdir && output_traced_link(output, entry, events)) {
+        warnx("failed to link file %s (filehash %s)",
+            entry->file->path,
+            entry->filehash);
+        return 0;
+    }
+
+    Events_accept_file(events, entry->file);
+
+    if (output->writer && Index_Writer_add(output->writer,
+                                           entry->filehash,
+                                           entry->file)) {
+        Index_Writer_del(output->writer);
+        output->writer = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+static
+int loop_entries(const FileRepo *filerepo, Output *output, Events *events)
 {
     void *aux = NULL;
     const FileRepo_Entry *entry;
+    int fails = 0;
+
+    while (entry = FileRepo_iter(filerepo, &aux), entry != NULL)
+        fails += output_entry(output, entry, events);
+
+    return fails;
+}
+
+// Links the entries new since the last batch, and removes the new
+// duplicates, and the links to the files no longer catalogued.
+static
+int loop_fresh(FileRepo *filerepo, Output *output, Events *events)
+{
+    const FileRepo_Entry *entry;
+    const File *file;
+    int fails = 0;
+
+    while (entry = FileRepo_next_stale(filerepo), entry != NULL) {
+        const OutDir_LinkInfo linkinfo = {
+            .hash = entry->filehash,
+            .path = entry->file->path,
+            .mtime = entry->file->mtime,
+        };
 
-    while (entry = FileRepo_iter(filerepo, &aux), entry != NULL) {
-        if (OutDir_link(outdir, &(OutDir_LinkInfo){
-                .hash = entry->filehash,
-                .path = entry->file->path,
-                .mtime = entry->file->mtime,
-            })
-        ) {
+        if (OutDir_unlink(output->outdir, &linkinfo)) {
+            warnx("failed to unlink file %s (filehash %s)",
+                entry->file->path,
+                entry->filehash);
+            ++fails;
+        }
+        Events_supersede_file(events, entry->file);
+    }
+
+    while (entry = FileRepo_next_fresh(filerepo), entry != NULL) {
+        if (!entry->filehash) {
+            warnx("failed to hash file %s", entry->file->path);
+            ++fails;
+            continue;
+        }
+
+        if (output_traced_link(output, entry, events)) {
             warnx("failed to link file %s (filehash %s)",
                 entry->file->path,
                 entry->filehash);
@@ -92,33 +803,548 @@ void loop_entries(const FileRepo *filerepo,
 
         Events_accept_file(events, entry->file);
     }
+
+    while (file = FileRepo_next_fresh_removal(filerepo), file != NULL) {
+        Events_reject_file(events, file);
+        if (output->unlinker && Unlinker_add(output->unlinker, file)) {
+            Events_unlink_failed(events, file, errno);
+            ++fails;
+        }
+    }
+
+    if (output->unlinker)
+        fails += Unlinker_run(output->unlinker);
+    return fails;
+}
+
+static
+int loop_index(const FileRepo *filerepo, Index_Writer *writer)
+{
+    void *aux = NULL;
+    const FileRepo_Entry *entry;
+
+    while (entry = FileRepo_iter(filerepo, &aux), entry != NULL)
+        if (entry->filehash
+                && Index_Writer_add(writer, entry->filehash, entry->file))
+            return 1;
+    return 0;
 }
 
 static
-void loop_removals(const FileRepo *filerepo,
-                   Events *events,
-                   bool remove_files)
+int loop_removals(const FileRepo *filerepo, Output *output, Events *events)
 {
     void *aux = NULL;
     const File *file;
+    int fails = 0;
 
     while (file = FileRepo_iter_removals(filerepo, &aux), file != NULL) {
         Events_reject_file(events, file);
-        if (remove_files)
-            unlink(file->path);
+        if (output->unlinker && Unlinker_add(output->unlinker, file)) {
+            Events_unlink_failed(events, file, errno);
+            ++fails;
+        }
+    }
+
+    return fails;
+}
+
+static
+int output_close(Output *output, const char *indexpath)
+{
+    int fails = 0;
+
+    if (output->unlinker)
+        fails += Unlinker_run(output->unlinker);
+
+    // The index covers the whole catalog, as the links do: the entries of
+    // the previous runs into the output directory are kept.
+    if (!output->writer
+            || Index_Writer_add_index(output->writer, indexpath)
+            || Index_Writer_write(output->writer, indexpath))
+        ++fails;
+
+    Unlinker_del(output->unlinker);
+    Index_Writer_del(output->writer);
+    OutDir_del(output->outdir);
+    return fails;
+}
+
+static
+int loop_chunks(const FileRepo *filerepo,
+                const Options *opts,
+                Throttle *throttle,
+                DirCache *dircache,
+                Events *events)
+{
+    void *aux = NULL;
+    const FileRepo_Entry *entry;
+    Chunks *chunks;
+    int fails = 0;
+
+    chunks = Chunks_new(opts->io_policy, events);
+    if (!chunks)
+        return 1;
+    Chunks_set_throttle(chunks, throttle);
+    Chunks_set_dircache(chunks, dircache);
+
+    while (entry = FileRepo_iter(filerepo, &aux), entry != NULL)
+        if (Chunks_add_file(chunks, entry->file))
+            ++fails;
+
+    Chunks_del(chunks);
+    return fails;
+}
+
+// The file of an entry, as stat'ed if reachable from this host, or as
+// indexed otherwise.  Returns 1 if not reachable.
+static
+int merge_file(const Index_Entry *entry, File *file)
+{
+    struct stat statbuf;
+
+    if (stat(entry->path, &statbuf) == 0)
+        return File_init_stat(file, entry->path, &statbuf);
+
+    *file = (File){
+        .path = strdup(entry->path),
+        .mtime = entry->mtime,
+        .size = entry->size,
+    };
+    if (!file->path) {
+        warn("strdup");
+        return -1;
+    }
+    return 1;
+}
+
+// Files of other hosts (e.g. of shards catalogued there) cannot be
+// compared from here: their group is decided on the digest alone,
+// keeping the oldest file.  Only the files reachable are removed.
+static
+int merge_by_digest(const Index_Entry *entries,
+                    File *files,
+                    const bool *reachable,
+                    size_t count,
+                    Output *output,
+                    Events *events)
+{
+    size_t kept = count;
+    int fails;
+
+    for (size_t i = 0; i < count; ++i)
+        if (files[i].path
+                && (kept == count || files[i].mtime < files[kept].mtime))
+            kept = i;
+    if (kept == count)
+        return 0;
+
+    fails = output_entry(output, &(FileRepo_Entry){
+        .file = &files[kept],
+        .filehash = entries[kept].digest,
+    }, events);
+
+    for (size_t i = 0; i < count; ++i) {
+        if (i == kept || !files[i].path)
+            continue;
+
+        Events_duplicate(events, &files[kept], &files[i]);
+        Events_reject_file(events, &files[i]);
+        if (reachable[i] && output->unlinker
+                && Unlinker_add(output->unlinker, &files[i])) {
+            Events_unlink_failed(events, &files[i], errno);
+            ++fails;
+        }
+    }
+    return fails;
+}
+
+static
+int merge_group(const Index_Entry *entries,
+                size_t count,
+                const Hasher *hash,
+                Output *output,
+                Events *events)
+{
+    FileRepo *filerepo = NULL;
+    File *files;
+    bool *reachable;
+    bool everywhere = true;
+    int fails = 0, ex;
+
+    files = calloc(count, sizeof(File));
+    reachable = calloc(count, sizeof(bool));
+    if (!files || !reachable) {
+        warn("calloc");
+        fails = count;
+        goto exit;
+    }
+
+    // Files are compared (and must be identified by inode) only if they
+    // are more than one.
+    for (size_t i = 0; i < count; ++i) {
+        if (count == 1) {
+            files[i] = (File){
+                .path = strdup(entries[i].path),
+                .mtime = entries[i].mtime,
+                .size = entries[i].size,
+            };
+            ex = files[i].path ? 0 : -1;
+            if (ex)
+                warn("strdup");
+        } else
+            ex = merge_file(&entries[i], &files[i]);
+
+        if (ex == -1) {
+            Events_skipped_filename(events, entries[i].path);
+            ++fails;
+        }
+        reachable[i] = ex == 0;
+        everywhere &= ex != 1;
+    }
+
+    if (!everywhere) {
+        fails += merge_by_digest(entries, files, reachable, count, output,
+                                 events);
+        goto exit;
+    }
+
+    // A short lived FileRepo applies the same rules as a single run
+    // to the files sharing a digest.
+    filerepo = FileRepo_new(hash, events, false);
+    if (!filerepo) {
+        fails = count;
+        goto exit;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+        if (files[i].path
+                && FileRepo_add_file(filerepo, &files[i], i,
+                                     entries[i].digest, NULL)) {
+            Events_skipped_filename(events, entries[i].path);
+            ++fails;
+        }
+
+    fails += loop_entries(filerepo, output, events);
+    fails += loop_removals(filerepo, output, events);
+
+exit:
+    FileRepo_del(filerepo);
+    for (size_t i = 0; files && i < count; ++i)
+        File_free(&files[i]);
+    free(files);
+    free(reachable);
+    return fails;
+}
+
+// Catalogs the entries of the indexes, grouped by digest.
+static
+int merge_indexes(Index * const *indexes,
+                  size_t nindexes,
+                  const Options *opts,
+                  const Hasher *hash,
+                  const char *indexpath,
+                  const char *spilldir,
+                  Events *events)
+{
+    Merge *merge;
+    Output output;
+    const Index_Entry *entries;
+    size_t count;
+    int fails = 0, e;
+
+    merge = Merge_new(indexes, nindexes);
+    if (!merge)
+        return 1;
+
+    if (output_open(&output, opts, spilldir, NULL, events)) {
+        Merge_del(merge);
+        return 1;
+    }
+
+    while (e = Merge_next(merge, &entries, &count), e == 0 && count)
+        fails += merge_group(entries, count, hash, &output, events);
+    if (e)
+        ++fails;
+
+    fails += output_close(&output, indexpath);
+    Merge_del(merge);
+    return fails;
+}
+
+static
+int run_merge(const Options *opts,
+              const Hasher *hash,
+              const char *indexpath,
+              const char *spilldir,
+              Events *events)
+{
+    Index **indexes;
+    int fails = 0;
+
+    indexes = calloc(opts->npartials, sizeof(Index *));
+    if (!indexes) {
+        warn("calloc");
+        return 1;
+    }
+
+    for (size_t i = 0; i < opts->npartials; ++i) {
+        indexes[i] = Index_open(opts->partials[i]);
+        if (!indexes[i]) {
+            ++fails;
+            goto exit;
+        }
+    }
+
+    fails += merge_indexes(indexes, opts->npartials, opts, hash, indexpath,
+                           spilldir, events);
+    Events_print_stats(events, !opts->remove_files);
+
+exit:
+    for (size_t i = 0; i < opts->npartials; ++i)
+        Index_close(indexes[i]);
+    free(indexes);
+    return fails;
+}
+
+static
+int loop_input_spill(Index_Writer *writer,
+                     const Hasher *hash,
+                     Events *events,
+                     const Options *opts)
+{
+    IORead ioread;
+    const char *fname;
+    int fails = 0;
+
+    IORead_init(&ioread);
+    while (fname = IORead_next(&ioread), fname != NULL) {
+        File file;
+        const char *filehash;
+
+        if (opts->shard_count && !in_shard(opts, fname))
+            continue;
+
+        if (File_init(&file, fname)) {
+            Events_skipped_filename(events, fname);
+            ++fails;
+            continue;
+        }
+
+        filehash = Hasher_hash_file(hash, fname);
+        if (!filehash || Index_Writer_add(writer, filehash, &file)) {
+            Events_skipped_filename(events, fname);
+            ++fails;
+        }
+        File_free(&file);
+    }
+    if (ioread.errno_s)
+        ++fails;
+
+    IORead_free(&ioread);
+    return fails;
+}
+
+// Out of core run: the input is checksummed into an index, sorted by
+// spilling runs to the disk, and then catalogued as a merge would.
+static
+int run_external(const Options *opts,
+                 const Hasher *hash,
+                 const char *indexpath,
+                 const char *spilldir,
+                 Events *events)
+{
+    Index_Writer *writer;
+    Index *index = NULL;
+    char *prefix, *sorted = NULL;
+    int fails = 0;
+
+    writer = Index_Writer_new();
+    prefix = Util_concat(spilldir, "/input.", NULL);
+    sorted = Util_concat(spilldir, "/input", NULL);
+    if (!writer || !prefix || !sorted
+            || Index_Writer_set_spill(writer, prefix, opts->memcap)) {
+        ++fails;
+        goto exit;
+    }
+
+    fails += loop_input_spill(writer, hash, events, opts);
+
+    if (Index_Writer_write(writer, sorted)) {
+        ++fails;
+        goto exit;
+    }
+    Index_Writer_del(writer);
+    writer = NULL;
+
+    index = Index_open(sorted);
+    if (!index) {
+        ++fails;
+        goto exit;
     }
+
+    fails += merge_indexes(&index, 1, opts, hash, indexpath, spilldir,
+                           events);
+    Events_print_stats(events, !opts->remove_files);
+
+exit:
+    Index_close(index);
+    Index_Writer_del(writer);
+    if (sorted && unlink(sorted) && errno != ENOENT)
+        warn("unlink(%s)", sorted);
+    free(sorted);
+    free(prefix);
+    return fails;
+}
+
+static
+char *spill_open(const Options *opts)
+{
+    char *spilldir;
+
+    if (mkdir(opts->outdir, 0777) && errno != EEXIST) {
+        warn("mkdir(%s, 0777)", opts->outdir);
+        return NULL;
+    }
+
+    spilldir = Util_concat(opts->outdir, "/.spill.XXXXXX", NULL);
+    if (spilldir && !mkdtemp(spilldir)) {
+        warn("mkdtemp(%s)", spilldir);
+        free(spilldir);
+        return NULL;
+    }
+    return spilldir;
+}
+
+// Catalogs the files under the watched directories, and then the new
+// ones, batch after batch, until terminated.  The index is written at
+// the end.
+static
+int run_watch(const Options *opts,
+              FileRepo *filerepo,
+              Journal *journal,
+              const char *indexpath,
+              Events *events)
+{
+    Watch *watch = NULL;
+    Batch *batch = NULL;
+    Output output;
+    const char * const *paths;
+    size_t npaths;
+    uint64_t seq = 0;
+    int fails = 0, e;
+
+    FileRepo_set_incremental(filerepo);
+
+    if (output_open(&output, opts, NULL, journal, events))
+        return 1;
+
+    if (opts->batch_size) {
+        batch = Batch_new(filerepo, events, opts->batch_size);
+        if (!batch) {
+            ++fails;
+            goto exit;
+        }
+    }
+
+    watch = Watch_new(opts->partials, opts->npartials, opts->outdir);
+    if (!watch) {
+        ++fails;
+        goto exit;
+    }
+
+    while (e = Watch_wait(watch, &paths, &npaths), e == 0) {
+        for (size_t i = 0; i < npaths; ++i)
+            if (journal && already_removed(journal, paths[i]))
+                continue;
+            else if (batch)
+                fails += Batch_add(batch, paths[i], seq++);
+            else if (FileRepo_add(filerepo, paths[i], seq++, NULL)) {
+                Events_skipped_filename(events, paths[i]);
+                ++fails;
+            }
+
+        if (batch)
+            fails += Batch_flush(batch);
+        fails += loop_fresh(filerepo, &output, events);
+        if (journal)
+            Journal_sync(journal);
+    }
+    if (e == -1)
+        ++fails;
+
+    // The index is made of the current entries, as the catalog: the
+    // files replaced by older copies of them, and their links, are gone.
+    if (output.writer)
+        fails += loop_index(filerepo, output.writer);
+
+exit:
+    fails += output_close(&output, indexpath);
+    Events_print_stats(events, !opts->remove_files);
+    Watch_del(watch);
+    Batch_del(batch);
+    return fails;
+}
+
+static
+int run_rebuild(const Options *opts, const char *indexpath, Events *events)
+{
+    Index *index;
+    OutDir *outdir = NULL;
+    int fails = 0;
+
+    index = Index_open(indexpath);
+    if (!index)
+        return 1;
+
+    outdir = OutDir_new(opts->outdir, &opts->layout);
+    if (!outdir) {
+        ++fails;
+        goto exit;
+    }
+
+    fails += Rebuild_run(index, outdir, events, opts->jobs);
+    Events_print_stats(events, !opts->remove_files);
+
+exit:
+    OutDir_del(outdir);
+    Index_close(index);
+    return fails;
+}
+
+static
+int run_verify(const Options *opts,
+               const Hasher *hash,
+               const char *indexpath,
+               Events *events)
+{
+    Index *index;
+    int fails;
+
+    index = Index_open(indexpath);
+    if (!index)
+        return 1;
+
+    fails = Verify_run(index, hash, events, opts->jobs);
+    Events_print_stats(events, true);
+
+    Index_close(index);
+    return fails;
 }
 
 int main(int argc, char **argv)
 {
     Options opts;
-    IORead ioread;
     Hasher *hash = NULL;
+    Throttle *throttle = NULL;
+    DirCache *dircache = NULL;
+    Resume *resume = NULL;
     FileRepo *filerepo = NULL;
-    OutDir *outdir = NULL;
+    Output output;
     int fails = 0;
-    const char *fname;
     Events *events = NULL;
+    char *indexpath = NULL;
+    char *spilldir = NULL;
+    Journal *journal = NULL;
 
     parseopts(argc, argv, &opts);
 
@@ -128,43 +1354,132 @@ int main(int argc, char **argv)
         goto exit;
     }
 
-    hash = Hasher_new(opts.hashprg, opts.cmpprg);
+    if (opts.trace && Events_set_trace(events, opts.trace)) {
+        ++fails;
+        goto exit;
+    }
+
+    indexpath = Util_concat(opts.outdir, "/", Index_FILENAME, NULL);
+    if (!indexpath) {
+        ++fails;
+        goto exit;
+    }
+
+    if (opts.rebuild) {
+        fails += run_rebuild(&opts, indexpath, events);
+        goto exit;
+    }
+
+    hash = Hasher_new(opts.hashprg, opts.cmpprg, opts.io_policy,
+                      opts.coprocs, opts.queue_depth);
     if (!hash) {
         ++fails;
         goto exit;
     }
 
-    filerepo = FileRepo_new(hash, events);
-    if (!filerepo) {
+    dircache = DirCache_new();
+    if (!dircache) {
         ++fails;
         goto exit;
     }
+    Hasher_set_dircache(hash, dircache);
 
-    IORead_init(&ioread);
-    while (fname = IORead_next(&ioread), fname != NULL)
-        if (FileRepo_add(filerepo, fname)) {
-            Events_skipped_filename(events, fname);
+    if (opts.resume) {
+        resume = Resume_open(opts.resume);
+        if (!resume) {
             ++fails;
+            goto exit;
         }
-    if (ioread.errno_s)
+        Hasher_set_resume(hash, resume);
+    }
+
+    if (opts.throttle_rate) {
+        throttle = Throttle_new(opts.throttle_rate, opts.throttle_latency);
+        if (!throttle) {
+            ++fails;
+            goto exit;
+        }
+        // Before any thread is started, so that all of them inherit it.
+        Throttle_set_idle();
+        Hasher_set_throttle(hash, throttle);
+    }
+
+    if (opts.query) {
+        fails += Query_run(opts.query, hash);
+        goto exit;
+    }
+
+    if (opts.verify) {
+        fails += run_verify(&opts, hash, indexpath, events);
+        goto exit;
+    }
+
+    if (opts.memcap) {
+        spilldir = spill_open(&opts);
+        if (!spilldir) {
+            ++fails;
+            goto exit;
+        }
+    }
+
+    if (opts.merge) {
+        fails += run_merge(&opts, hash, indexpath, spilldir, events);
+        goto exit;
+    }
+
+    if (opts.memcap) {
+        fails += run_external(&opts, hash, indexpath, spilldir, events);
+        goto exit;
+    }
+
+    filerepo = FileRepo_new(hash, events, opts.fast_keys);
+    if (!filerepo) {
         ++fails;
+        goto exit;
+    }
+    FileRepo_set_dircache(filerepo, dircache);
 
-    outdir = OutDir_new(opts.outdir);
-    if (!outdir) {
+    if (opts.journal) {
+        journal = Journal_open(opts.journal);
+        if (!journal) {
+            ++fails;
+            goto exit;
+        }
+        FileRepo_set_journal(filerepo, journal);
+    }
+
+    if (opts.watch) {
+        fails += run_watch(&opts, filerepo, journal, indexpath, events);
+        goto exit;
+    }
+
+    fails += loop_input(filerepo, journal, events, &opts);
+
+    if (output_open(&output, &opts, NULL, journal, events)) {
         ++fails;
         goto exit;
     }
 
-    loop_entries(filerepo, outdir, events);
-    loop_removals(filerepo, events, opts.remove_files);
+    fails += loop_entries(filerepo, &output, events);
+    fails += loop_removals(filerepo, &output, events);
+    fails += output_close(&output, indexpath);
+
+    if (opts.chunks)
+        fails += loop_chunks(filerepo, &opts, throttle, dircache, events);
 
     Events_print_stats(events, !opts.remove_files);
 
 exit:
-    OutDir_del(outdir);
+    if (spilldir && rmdir(spilldir))
+        warn("rmdir(%s)", spilldir);
+    free(spilldir);
     FileRepo_del(filerepo);
+    Journal_del(journal);
     Hasher_del(hash);
-    IORead_free(&ioread);
+    Resume_del(resume);
+    DirCache_del(dircache);
+    Throttle_del(throttle);
     Events_del(events);
+    free(indexpath);
     return fails ? EXIT_FAILURE : EXIT_SUCCESS;
 }
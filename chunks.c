@@ -0,0 +1,235 @@
+#include "chunks.h"
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uthash.h>
+
+#include "events.h"
+#include "sha1.h"
+
+enum {
+    Chunks_MIN = 2 << 10,
+    Chunks_AVG = 8 << 10,
+    Chunks_MAX = 64 << 10,
+
+    // About 200 MiB of digests, for 16 GiB of distinct data.
+    Chunks_TABLE_MAX = 1 << 21,
+};
+
+// Normalized chunking: cut points are harder to find before the average
+// size, and easier after it.  The gear hash shifts left, so its high
+// bits depend on the widest window of input.
+#define Chunks_MASK_S (((UINT64_C(1) << 15) - 1) << 49)
+#define Chunks_MASK_L (((UINT64_C(1) << 11) - 1) << 53)
+
+typedef struct {
+    uint8_t digest[Sha1_DIGEST_LENGTH];
+    UT_hash_handle hh;
+} Chunk;
+
+struct Chunks {
+    Chunk *chunks;
+    size_t nchunks;
+    bool full;
+    struct Events *events;
+    Throttle *throttle;         // NULL unless throttling
+    DirCache *dircache;         // NULL unless opening relative to dirs
+    Stream_Policy policy;
+    char *streambuf;
+    uint8_t *window;
+    uint64_t gear[256];
+};
+
+void Chunks_del(Chunks *chunks)
+{
+    Chunk *chunk, *tmp;
+
+    if (!chunks)
+        return;
+
+    HASH_ITER(hh, chunks->chunks, chunk, tmp) {
+        HASH_DEL(chunks->chunks, chunk);
+        free(chunk);
+    }
+
+    free(chunks->streambuf);
+    free(chunks->window);
+    free(chunks);
+}
+
+Chunks *Chunks_new(Stream_Policy policy, struct Events *events)
+{
+    Chunks *chunks;
+    uint64_t seed = 0;
+
+    chunks = malloc(sizeof(Chunks));
+    if (!chunks) {
+        warn("malloc");
+        goto fail;
+    }
+
+    *chunks = (Chunks){
+        .events = events,
+        .policy = policy,
+    };
+
+    chunks->streambuf = Stream_buffer_new();
+    if (!chunks->streambuf)
+        goto fail;
+
+    chunks->window = malloc(Stream_BUFLEN + Chunks_MAX);
+    if (!chunks->window) {
+        warn("malloc");
+        goto fail;
+    }
+
+    // Any fixed pseudo-random table will do (splitmix64).
+    for (int i = 0; i < 256; ++i) {
+        uint64_t z = (seed += UINT64_C(0x9e3779b97f4a7c15));
+
+        z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+        chunks->gear[i] = z ^ (z >> 31);
+    }
+
+    return chunks;
+
+fail:
+    Chunks_del(chunks);
+    return NULL;
+}
+
+void Chunks_set_throttle(Chunks *chunks, Throttle *throttle)
+{
+    chunks->throttle = throttle;
+}
+
+void Chunks_set_dircache(Chunks *chunks, DirCache *dircache)
+{
+    chunks->dircache = dircache;
+}
+
+static
+size_t Chunks_cut(const Chunks *chunks, const uint8_t *data, size_t len)
+{
+    uint64_t fp = 0;
+    size_t i, normal;
+
+    if (len > Chunks_MAX)
+        len = Chunks_MAX;
+    if (len <= Chunks_MIN)
+        return len;
+
+    normal = len < Chunks_AVG ? len : Chunks_AVG;
+
+    for (i = Chunks_MIN; i < normal; ++i) {
+        fp = (fp << 1) + chunks->gear[data[i]];
+        if (!(fp & Chunks_MASK_S))
+            return i + 1;
+    }
+
+    for (; i < len; ++i) {
+        fp = (fp << 1) + chunks->gear[data[i]];
+        if (!(fp & Chunks_MASK_L))
+            return i + 1;
+    }
+
+    return len;
+}
+
+// Returns 1 if the chunk was already known, 0 if not, -1 on error.
+static
+int Chunks_record(Chunks *chunks, const uint8_t *data, size_t len)
+{
+    Sha1 sha1;
+    uint8_t digest[Sha1_DIGEST_LENGTH];
+    Chunk *chunk;
+
+    Sha1_init(&sha1);
+    Sha1_update(&sha1, data, len);
+    Sha1_final(&sha1, digest);
+
+    HASH_FIND(hh, chunks->chunks, digest, sizeof(digest), chunk);
+    if (chunk)
+        return 1;
+
+    // Once the table is full, chunks are only looked up: the bytes
+    // shared with the files seen later are not counted.
+    if (chunks->nchunks == Chunks_TABLE_MAX) {
+        if (!chunks->full)
+            warnx("chunk table full, new chunks are no longer recorded");
+        chunks->full = true;
+        return 0;
+    }
+
+    chunk = malloc(sizeof(Chunk));
+    if (!chunk) {
+        warn("malloc");
+        return -1;
+    }
+
+    memcpy(chunk->digest, digest, sizeof(digest));
+    HASH_ADD(hh, chunks->chunks, digest, sizeof(chunk->digest), chunk);
+    ++chunks->nchunks;
+    return 0;
+}
+
+int Chunks_add_file(Chunks *chunks, const File *file)
+{
+    Stream stream;
+    uint8_t *window = chunks->window;
+    size_t pos = 0, len = 0;
+    size_t total = 0, shared = 0;
+    bool eof = false;
+
+    if (Stream_open(&stream, chunks->dircache, file->path, chunks->policy,
+                    chunks->streambuf))
+        return -1;
+
+    for (;;) {
+        size_t cut;
+        int known;
+
+        // Refill, keeping at least a maximum-sized chunk in the window,
+        // so that cut points do not depend on the read size.
+        if (len - pos < Chunks_MAX && !eof) {
+            const char *data;
+            ssize_t n;
+
+            memmove(window, window + pos, len - pos);
+            len -= pos;
+            pos = 0;
+
+            n = Throttle_stream_read(chunks->throttle, &stream, &data);
+            if (n == -1)
+                goto fail;
+            memcpy(window + len, data, n);
+            len += n;
+            eof = n == 0;
+            continue;
+        }
+
+        if (pos == len)
+            break;
+
+        cut = Chunks_cut(chunks, window + pos, len - pos);
+        known = Chunks_record(chunks, window + pos, cut);
+        if (known == -1)
+            goto fail;
+
+        total += cut;
+        if (known)
+            shared += cut;
+        pos += cut;
+    }
+
+    Stream_close(&stream);
+    Events_chunked(chunks->events, file, total, shared);
+    return 0;
+
+fail:
+    Stream_close(&stream);
+    return -1;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "dircache.h"
+#include "file.h"
+#include "stream.h"
+#include "throttle.h"
+
+// Content-defined chunking analysis: files are split into chunks whose
+// boundaries depend on the content (FastCDC), so that data shared by
+// two files is found even at different offsets.  The digests of the
+// chunks seen so far are kept, up to a bound, and each file is reported
+// with the amount of its bytes belonging to chunks seen before.
+
+typedef struct Chunks Chunks;
+
+struct Events;
+
+Chunks *Chunks_new(Stream_Policy, struct Events *);
+
+// Throttles the reads, as Hasher_set_throttle does.
+void Chunks_set_throttle(Chunks *, Throttle *);
+
+// Opens files under their cached directory.
+void Chunks_set_dircache(Chunks *, DirCache *);
+
+int Chunks_add_file(Chunks *, const File *);
+
+void Chunks_del(Chunks *);
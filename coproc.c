@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+
+#include "coproc.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "util.h"
+
+typedef struct {
+    pthread_mutex_t lock;
+    pid_t pid;
+    FILE *in;       // requests, to the instance
+    FILE *out;      // replies, from the instance
+} Instance;
+
+struct Coproc {
+    const char *prg;
+    Instance *instances;
+    unsigned ninstances;
+    unsigned next;
+};
+
+static
+void Instance_stop(Instance *instance)
+{
+    int status;
+
+    // Closing the requests channel tells the instance to terminate.
+    if (instance->in)
+        fclose(instance->in);
+    if (instance->out)
+        fclose(instance->out);
+    instance->in = instance->out = NULL;
+
+    if (instance->pid > 0 && waitpid(instance->pid, &status, 0) == -1)
+        warn("waitpid");
+    instance->pid = 0;
+}
+
+static
+int Instance_start(Instance *instance, const char *prg)
+{
+    int to[2] = {-1, -1}, from[2] = {-1, -1};
+
+    if (pipe2(to, O_CLOEXEC) == -1 || pipe2(from, O_CLOEXEC) == -1) {
+        warn("pipe2");
+        goto fail;
+    }
+
+    instance->pid = fork();
+    switch (instance->pid) {
+    case -1:
+        warn("fork");
+        goto fail;
+
+    case 0:
+        if (dup2(to[0], STDIN_FILENO) == -1
+                || dup2(from[1], STDOUT_FILENO) == -1)
+            err(1, "dup2");
+        execlp(prg, prg, NULL);
+        err(1, "execlp %s", prg);
+
+    default:
+        break;
+    }
+
+    Util_fdclose(&to[0]);
+    Util_fdclose(&from[1]);
+
+    instance->in = fdopen(to[1], "w");
+    if (!instance->in) {
+        warn("fdopen");
+        goto fail;
+    }
+    to[1] = -1;
+
+    instance->out = fdopen(from[0], "r");
+    if (!instance->out) {
+        warn("fdopen");
+        goto fail;
+    }
+    from[0] = -1;
+
+    return 0;
+
+fail:
+    Util_fdclose(&to[0]);
+    Util_fdclose(&to[1]);
+    Util_fdclose(&from[0]);
+    Util_fdclose(&from[1]);
+    Instance_stop(instance);
+    return -1;
+}
+
+void Coproc_del(Coproc *coproc)
+{
+    if (!coproc)
+        return;
+
+    for (unsigned i = 0; i < coproc->ninstances; ++i) {
+        Instance_stop(&coproc->instances[i]);
+        pthread_mutex_destroy(&coproc->instances[i].lock);
+    }
+
+    free(coproc->instances);
+    free((void *)coproc->prg);
+    free(coproc);
+}
+
+Coproc *Coproc_new(const char *prg, unsigned instances)
+{
+    Coproc *coproc;
+
+    coproc = malloc(sizeof(Coproc));
+    if (!coproc) {
+        warn("malloc");
+        goto fail;
+    }
+    *coproc = (Coproc){};
+
+    coproc->prg = strdup(prg);
+    if (!coproc->prg) {
+        warn("strdup");
+        goto fail;
+    }
+
+    coproc->instances = calloc(instances, sizeof(Instance));
+    if (!coproc->instances) {
+        warn("calloc");
+        goto fail;
+    }
+
+    for (; coproc->ninstances < instances; ++coproc->ninstances)
+        pthread_mutex_init(&coproc->instances[coproc->ninstances].lock,
+                           NULL);
+
+    // A dying instance must fail a request, not kill us while we write.
+    signal(SIGPIPE, SIG_IGN);
+
+    return coproc;
+
+fail:
+    Coproc_del(coproc);
+    return NULL;
+}
+
+static
+Instance *Coproc_acquire(Coproc *coproc)
+{
+    unsigned start;
+
+    start = __atomic_fetch_add(&coproc->next, 1, __ATOMIC_RELAXED);
+
+    for (unsigned i = 0; i < coproc->ninstances; ++i) {
+        Instance *instance;
+
+        instance = &coproc->instances[(start + i) % coproc->ninstances];
+        if (pthread_mutex_trylock(&instance->lock) == 0)
+            return instance;
+    }
+
+    // All busy: queue on one of them.
+    pthread_mutex_lock(&coproc->instances[start % coproc->ninstances].lock);
+    return &coproc->instances[start % coproc->ninstances];
+}
+
+static
+int Instance_request(Instance *instance,
+                     const char *prg,
+                     const char * const *args,
+                     size_t nargs,
+                     char *reply,
+                     size_t replylen)
+{
+    char *newline;
+    int c;
+
+    if (!instance->pid && Instance_start(instance, prg))
+        return -1;
+
+    for (size_t i = 0; i < nargs; ++i)
+        if (fputs(args[i], instance->in) == EOF
+                || fputc('\0', instance->in) == EOF)
+            goto died;
+
+    if (fflush(instance->in) == EOF)
+        goto died;
+
+    if (!fgets(reply, replylen, instance->out))
+        goto died;
+
+    newline = strchr(reply, '\n');
+    if (newline) {
+        *newline = '\0';
+        return 0;
+    }
+
+    // Too long for a valid reply: skip the rest of it.
+    while (c = fgetc(instance->out), c != '\n')
+        if (c == EOF)
+            goto died;
+    warnx("%s: reply too long", prg);
+    return -1;
+
+died:
+    warnx("%s: coprocess terminated", prg);
+    Instance_stop(instance);
+    return -1;
+}
+
+int Coproc_request(Coproc *coproc,
+                   const char * const *args,
+                   size_t nargs,
+                   char *reply,
+                   size_t replylen)
+{
+    Instance *instance;
+    int ex;
+
+    instance = Coproc_acquire(coproc);
+    ex = Instance_request(instance, coproc->prg, args, nargs, reply,
+                          replylen);
+    pthread_mutex_unlock(&instance->lock);
+    return ex;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+
+// A pool of long-lived instances of a program, serving requests over
+// their standard input and output.  A request is a sequence of
+// NUL-terminated arguments, its reply a single line.
+
+typedef struct Coproc Coproc;
+
+Coproc *Coproc_new(const char *prg, unsigned instances);
+
+// The reply is stripped of the trailing newline.  Fails if the
+// instance dies, in which case it is restarted on the next request.
+int Coproc_request(Coproc *,
+                   const char * const *args,
+                   size_t nargs,
+                   char *reply,
+                   size_t replylen);
+
+void Coproc_del(Coproc *);
@@ -0,0 +1,211 @@
+#include "devqueue.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+#include <uthash.h>
+
+typedef struct Item {
+    char *path;
+    uint64_t seq;
+    struct Item *next;
+} Item;
+
+struct DevQueue_Device {
+    dev_t dev;
+    unsigned limit;
+    unsigned active;
+    Item *items;        // FIFO: popped at the head, pushed at the tail
+    Item *tail;
+    UT_hash_handle hh;
+};
+
+struct DevQueue {
+    DevQueue_Device *devices;
+    DevQueue_Device *next;      // the device to be served first
+    unsigned max_limit;
+    size_t pending;
+};
+
+// Partitions have no queue of their own: the one of the disk applies.
+static
+int DevQueue_rotational(dev_t dev)
+{
+    static const char * const formats[] = {
+        "/sys/dev/block/%u:%u/queue/rotational",
+        "/sys/dev/block/%u:%u/../queue/rotational",
+    };
+
+    for (size_t i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+        char path[64];
+        FILE *file;
+        int c;
+
+        snprintf(path, sizeof(path), formats[i], major(dev), minor(dev));
+        file = fopen(path, "r");
+        if (!file)
+            continue;
+        c = fgetc(file);
+        fclose(file);
+        return c == '1';
+    }
+
+    // Not a block device: network or memory file systems.
+    return -1;
+}
+
+static
+DevQueue_Device *DevQueue_device(DevQueue *devqueue, dev_t dev)
+{
+    DevQueue_Device *device, *devices = devqueue->devices;
+
+    HASH_FIND(hh, devices, &dev, sizeof(dev), device);
+    if (device)
+        return device;
+
+    device = malloc(sizeof(DevQueue_Device));
+    if (!device) {
+        warn("malloc");
+        return NULL;
+    }
+
+    *device = (DevQueue_Device){
+        .dev = dev,
+        .limit = devqueue->max_limit,
+    };
+
+    switch (DevQueue_rotational(dev)) {
+    case 1:
+        device->limit = DevQueue_ROTATIONAL;
+        break;
+    case 0:
+        if (device->limit > DevQueue_SOLID)
+            device->limit = DevQueue_SOLID;
+        break;
+    }
+
+    HASH_ADD(hh, devqueue->devices, dev, sizeof(dev), device);
+    return device;
+}
+
+DevQueue *DevQueue_new(unsigned max_limit)
+{
+    DevQueue *devqueue;
+
+    devqueue = malloc(sizeof(DevQueue));
+    if (!devqueue) {
+        warn("malloc");
+        return NULL;
+    }
+
+    *devqueue = (DevQueue){
+        .max_limit = max_limit ? max_limit : 1,
+    };
+    return devqueue;
+}
+
+int DevQueue_push(DevQueue *devqueue,
+                  const char *path,
+                  uint64_t seq,
+                  dev_t dev)
+{
+    DevQueue_Device *device;
+    Item *item;
+
+    device = DevQueue_device(devqueue, dev);
+    if (!device)
+        return -1;
+
+    item = malloc(sizeof(Item));
+    if (!item) {
+        warn("malloc");
+        return -1;
+    }
+
+    *item = (Item){
+        .path = strdup(path),
+        .seq = seq,
+    };
+    if (!item->path) {
+        warn("strdup");
+        free(item);
+        return -1;
+    }
+
+    if (device->tail)
+        device->tail->next = item;
+    else
+        device->items = item;
+    device->tail = item;
+    ++devqueue->pending;
+    return 0;
+}
+
+char *DevQueue_pop(DevQueue *devqueue,
+                   DevQueue_Device **devicep,
+                   uint64_t *seq)
+{
+    DevQueue_Device *start, *device;
+
+    start = devqueue->next ? devqueue->next : devqueue->devices;
+    device = start;
+    if (!device)
+        return NULL;
+
+    do {
+        Item *item = device->items;
+
+        if (item && device->active < device->limit) {
+            char *path = item->path;
+
+            *seq = item->seq;
+            device->items = item->next;
+            if (!device->items)
+                device->tail = NULL;
+            free(item);
+
+            ++device->active;
+            --devqueue->pending;
+            devqueue->next = device->hh.next;
+            *devicep = device;
+            return path;
+        }
+
+        device = device->hh.next ? device->hh.next : devqueue->devices;
+    } while (device != start);
+
+    return NULL;
+}
+
+void DevQueue_done(DevQueue_Device *device)
+{
+    --device->active;
+}
+
+size_t DevQueue_pending(const DevQueue *devqueue)
+{
+    return devqueue->pending;
+}
+
+void DevQueue_del(DevQueue *devqueue)
+{
+    DevQueue_Device *device, *tmp;
+
+    if (!devqueue)
+        return;
+
+    HASH_ITER(hh, devqueue->devices, device, tmp) {
+        HASH_DEL(devqueue->devices, device);
+        while (device->items) {
+            Item *item = device->items;
+
+            device->items = item->next;
+            free(item->path);
+            free(item);
+        }
+        free(device);
+    }
+    free(devqueue);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Files waiting to be read, queued by device.  Each device has its own
+// limit of files being read at once: one for rotational disks, which
+// concurrent reads would make seek back and forth, many for solid state
+// ones.  Devices are served in turn, so that all of them are kept busy.
+//
+// Not thread-safe: the callers share a lock.
+
+enum {
+    DevQueue_ROTATIONAL = 1,
+    DevQueue_SOLID = 32,
+};
+
+typedef struct DevQueue DevQueue;
+typedef struct DevQueue_Device DevQueue_Device;
+
+// No device gets more than max_limit files at once.
+DevQueue *DevQueue_new(unsigned max_limit);
+
+// The path comes with its rank in the input, given back by DevQueue_pop.
+int DevQueue_push(DevQueue *, const char *path, uint64_t seq, dev_t);
+
+// The next path of a device having room, to be freed, or NULL.  The
+// device counts the file as being read until DevQueue_done.
+char *DevQueue_pop(DevQueue *, DevQueue_Device **, uint64_t *seq);
+void DevQueue_done(DevQueue_Device *);
+
+// The number of files queued, not yet popped.
+size_t DevQueue_pending(const DevQueue *);
+
+void DevQueue_del(DevQueue *);
@@ -0,0 +1,269 @@
+#include "dircache.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uthash.h>
+
+#include "util.h"
+
+// The hash table keeps its entries in insertion order: an entry used is
+// moved to the end, and the first ones not in use are the ones closed.
+
+typedef struct {
+    char *path;
+    int fd;
+    char *realpath;     // resolved when first asked for
+    unsigned refs;      // calls in progress under the directory
+    bool dropped;       // out of the table, deleted when no longer used
+    UT_hash_handle hh;
+} Dir;
+
+struct DirCache {
+    Dir *dirs;
+    unsigned ndirs;
+    pthread_mutex_t lock;
+};
+
+static
+void Dir_del(Dir *dir)
+{
+    Util_fdclose(&dir->fd);
+    free(dir->path);
+    free(dir->realpath);
+    free(dir);
+}
+
+void DirCache_del(DirCache *cache)
+{
+    Dir *dir, *tmp;
+
+    if (!cache)
+        return;
+
+    HASH_ITER(hh, cache->dirs, dir, tmp) {
+        HASH_DEL(cache->dirs, dir);
+        Dir_del(dir);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+DirCache *DirCache_new(void)
+{
+    DirCache *cache;
+
+    cache = malloc(sizeof(DirCache));
+    if (!cache) {
+        warn("malloc");
+        return NULL;
+    }
+
+    *cache = (DirCache){};
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+static
+void DirCache_evict(DirCache *cache)
+{
+    Dir *dir, *tmp;
+
+    HASH_ITER(hh, cache->dirs, dir, tmp) {
+        if (cache->ndirs < DirCache_MAXFDS)
+            break;
+        if (dir->refs)
+            continue;
+        HASH_DEL(cache->dirs, dir);
+        Dir_del(dir);
+        --cache->ndirs;
+    }
+}
+
+static
+Dir *DirCache_open_dir(const char *path, size_t len)
+{
+    Dir *dir;
+
+    dir = malloc(sizeof(Dir));
+    if (!dir) {
+        warn("malloc");
+        return NULL;
+    }
+
+    *dir = (Dir){
+        .path = strndup(path, len),
+        .fd = -1,
+        .refs = 1,
+    };
+    if (!dir->path) {
+        warn("strndup");
+        goto fail;
+    }
+
+    dir->fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir->fd == -1)
+        goto fail;
+    return dir;
+
+fail:
+    Dir_del(dir);
+    return NULL;
+}
+
+// Finds and takes a directory, and marks it the most recently used.
+static
+Dir *DirCache_find(DirCache *cache, const char *path, size_t len)
+{
+    Dir *dir;
+
+    HASH_FIND(hh, cache->dirs, path, len, dir);
+    if (dir) {
+        HASH_DEL(cache->dirs, dir);
+        HASH_ADD_KEYPTR(hh, cache->dirs, dir->path, len, dir);
+        ++dir->refs;
+    }
+    return dir;
+}
+
+// Takes the directory of the path, opening it if needed, and yields the
+// name to resolve under it.  Returns NULL if the directory cannot be
+// opened (the caller then falls back to the whole path).
+static
+Dir *DirCache_get(DirCache *cache, const char *path, const char **name)
+{
+    const char *slash = strrchr(path, '/');
+    const char *dirpath = ".";
+    size_t len = 1;
+    Dir *dir, *opened;
+
+    if (!cache || (slash && slash[1] == '\0'))
+        return NULL;
+
+    if (slash) {
+        dirpath = path;
+        len = slash == path ? 1 : (size_t)(slash - path);
+        *name = slash + 1;
+    } else
+        *name = path;
+
+    pthread_mutex_lock(&cache->lock);
+    dir = DirCache_find(cache, dirpath, len);
+    pthread_mutex_unlock(&cache->lock);
+    if (dir)
+        return dir;
+
+    // Opened unlocked, so that a slow directory does not hold the other
+    // threads: the one opening it last gives up its own.
+    opened = DirCache_open_dir(dirpath, len);
+    if (!opened)
+        return NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    dir = DirCache_find(cache, dirpath, len);
+    if (!dir) {
+        DirCache_evict(cache);
+        HASH_ADD_KEYPTR(hh, cache->dirs, opened->path, len, opened);
+        ++cache->ndirs;
+        dir = opened;
+        opened = NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (opened)
+        Dir_del(opened);
+    return dir;
+}
+
+// Gives the directory back after a call under it.  A file not found
+// may be one of a directory removed, or replaced, since it was opened:
+// the directory is then dropped, to be opened again on next use, and
+// true is returned for the call to be made again by path.
+static
+bool DirCache_put(DirCache *cache, Dir *dir, bool failed)
+{
+    int errnum = errno;
+    bool retry, del;
+
+    retry = failed && (errnum == ENOENT || errnum == ESTALE);
+
+    pthread_mutex_lock(&cache->lock);
+    if (retry && !dir->dropped) {
+        HASH_DEL(cache->dirs, dir);
+        --cache->ndirs;
+        dir->dropped = true;
+    }
+    del = --dir->refs == 0 && dir->dropped;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (del)
+        Dir_del(dir);
+    errno = errnum;
+    return retry;
+}
+
+int DirCache_open(DirCache *cache, const char *path, int flags)
+{
+    const char *name;
+    Dir *dir;
+    int fd;
+
+    dir = DirCache_get(cache, path, &name);
+    if (!dir)
+        return open(path, flags);
+
+    fd = openat(dir->fd, name, flags);
+    if (DirCache_put(cache, dir, fd == -1))
+        fd = open(path, flags);
+    return fd;
+}
+
+int DirCache_lstat(DirCache *cache, const char *path, struct stat *statbuf)
+{
+    const char *name;
+    Dir *dir;
+    int ex;
+
+    dir = DirCache_get(cache, path, &name);
+    if (!dir)
+        return lstat(path, statbuf);
+
+    ex = fstatat(dir->fd, name, statbuf, AT_SYMLINK_NOFOLLOW);
+    if (DirCache_put(cache, dir, ex == -1))
+        ex = lstat(path, statbuf);
+    return ex;
+}
+
+char *DirCache_realpath(DirCache *cache, const char *path)
+{
+    const char *name, *dirpath;
+    char *result = NULL;
+    Dir *dir;
+
+    dir = DirCache_get(cache, path, &name);
+    if (!dir) {
+        result = realpath(path, NULL);
+        if (!result)
+            warn("realpath(%s)", path);
+        return result;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    if (!dir->realpath) {
+        dir->realpath = realpath(dir->path, NULL);
+        if (!dir->realpath)
+            warn("realpath(%s)", dir->path);
+    }
+    dirpath = dir->realpath;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (dirpath)
+        result = Util_concat(strcmp(dirpath, "/") ? dirpath : "", "/", name,
+                             NULL);
+    DirCache_put(cache, dir, false);
+    return result;
+}
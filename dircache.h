@@ -0,0 +1,33 @@
+#pragma once
+
+#include <sys/stat.h>
+
+// Open directories, kept by path, so that the files under them are
+// opened and stat'ed relative to them (through the *at() system calls)
+// rather than by walking their whole path each time.  At most
+// DirCache_MAXFDS directories are kept open: the least recently used
+// one not in use makes room for the next.  A directory under which a
+// file is not found is dropped, as it may have been removed, or
+// replaced, since: the call is made again by path.  Thread safe.
+//
+// Passing a NULL cache falls back to the plain system calls.
+
+enum {
+    DirCache_MAXFDS = 256,
+};
+
+typedef struct DirCache DirCache;
+
+DirCache *DirCache_new(void);
+
+// Like open(2), without creating files.
+int DirCache_open(DirCache *, const char *path, int flags);
+
+// Like lstat(2).
+int DirCache_lstat(DirCache *, const char *path, struct stat *);
+
+// The allocated absolute path, with no symbolic link, of a file which
+// is not one itself: only its directory is resolved, once.
+char *DirCache_realpath(DirCache *, const char *path);
+
+void DirCache_del(DirCache *);
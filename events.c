@@ -2,8 +2,12 @@
 
 #include <stdlib.h>
 #include <err.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "events.h"
@@ -19,11 +23,55 @@ struct Events {
         unsigned collisions;
         unsigned bad_timestamps;
         unsigned skipped;
+        size_t unlinked_space;
+        unsigned unlinked_files;
+        unsigned unlink_failures;
+        size_t chunked_space;
+        size_t shared_chunks;
+        unsigned chunked_files;
+        unsigned verified_files;
+        unsigned missing_files;
+        unsigned corrupt_files;
+        unsigned concurrency;
     } counters;
 
     FILE *logfile;
+
+    // Tracing.
+    FILE *tracefile;
+    int64_t origin;
+    pthread_key_t key;          // of the spans of the calling thread
+    pthread_mutex_t lock;       // of the list of all the spans
+    struct Spans *spans;
+    unsigned nthreads;
+    bool traced;        // a span was written already
+};
+
+enum {
+    Events_SPANS = 1024,        // kept by thread, until written at once
 };
 
+typedef struct {
+    const char *stage;
+    char *path;         // NULL unless the span is about one file
+    int64_t begin;      // nanoseconds since the origin
+    int64_t duration;
+} Span;
+
+// The spans of one thread not written yet.
+typedef struct Spans {
+    Span *spans;
+    size_t n;
+    unsigned tid;
+    struct Spans *next;
+} Spans;
+
+// Events may come from several threads.
+#define count(events, field, n) \
+    __atomic_fetch_add(&(events)->counters.field, (n), __ATOMIC_RELAXED)
+#define uncount(events, field, n) \
+    __atomic_fetch_sub(&(events)->counters.field, (n), __ATOMIC_RELAXED)
+
 static
 void say(const Events *events, const char *fmt, ...)
 {
@@ -40,15 +88,22 @@ void say(const Events *events, const char *fmt, ...)
 void Events_accept_file(Events *events, const File *file)
 {
     say(events, "Accept: " File_FMT "\n", File_REPR(file));
-    events->counters.unique_files++;
-    events->counters.total_space += file->size;
+    count(events, unique_files, 1);
+    count(events, total_space, file->size);
+}
+
+void Events_supersede_file(Events *events, const File *file)
+{
+    say(events, "Supersede: " File_FMT "\n", File_REPR(file));
+    uncount(events, unique_files, 1);
+    uncount(events, total_space, file->size);
 }
 
 void Events_reject_file(Events *events, const File *file)
 {
     say(events, "Reject: " File_FMT "\n", File_REPR(file));
-    events->counters.removed_files++;
-    events->counters.freed_space += file->size;
+    count(events, removed_files, 1);
+    count(events, freed_space, file->size);
 }
 
 void Events_duplicate(Events *events, const File *kept, const File *dropped)
@@ -62,27 +117,82 @@ void Events_duplicate(Events *events, const File *kept, const File *dropped)
         bad_timestamp ? " (bad timestamp)" : "");
 
     if (bad_timestamp)
-        events->counters.bad_timestamps++;
+        count(events, bad_timestamps, 1);
 }
 
 void Events_ignored_identical(Events *events, const File *kept, const File *dropped)
 {
     say(events, "Ignore: " File_FMT " is the same as " File_FMT "\n",
         File_REPR(kept), File_REPR(dropped));
-    events->counters.ignored_links++;
+    count(events, ignored_links, 1);
 }
 
 void Events_skipped_filename(Events *events, const char *fname)
 {
     say(events, "Skpped: '%s'\n", fname);
-    events->counters.skipped++;
+    count(events, skipped, 1);
+}
+
+void Events_unlinked(Events *events, const File *file)
+{
+    say(events, "Unlinked: " File_FMT "\n", File_REPR(file));
+    count(events, unlinked_files, 1);
+    count(events, unlinked_space, file->size);
+}
+
+void Events_unlink_failed(Events *events, const File *file, int errnum)
+{
+    say(events, "Unlink failed: " File_FMT ": %s\n", File_REPR(file),
+        strerror(errnum));
+    count(events, unlink_failures, 1);
+}
+
+void Events_chunked(Events *events,
+                    const File *file,
+                    size_t total,
+                    size_t shared)
+{
+    say(events, "Chunked: " File_FMT " shares %zu of %zu bytes\n",
+        File_REPR(file), shared, total);
+    count(events, chunked_files, 1);
+    count(events, chunked_space, total);
+    count(events, shared_chunks, shared);
 }
 
 void Events_collision(Events *events, const File *file, const char *hash)
 {
     say(events, "Collision: " File_FMT " having hash '%s'\n",
         File_REPR(file), hash);
-    events->counters.collisions++;
+    count(events, collisions, 1);
+}
+
+void Events_verified(Events *events, const File *file)
+{
+    say(events, "Verified: " File_FMT "\n", File_REPR(file));
+    count(events, verified_files, 1);
+}
+
+void Events_missing(Events *events, const File *file)
+{
+    say(events, "Missing: " File_FMT "\n", File_REPR(file));
+    count(events, missing_files, 1);
+}
+
+void Events_corrupt(Events *events, const File *file, const char *hash)
+{
+    if (hash)
+        say(events, "Corrupt: " File_FMT " having hash '%s'\n",
+            File_REPR(file), hash);
+    else
+        say(events, "Corrupt: " File_FMT " changed size\n",
+            File_REPR(file));
+    count(events, corrupt_files, 1);
+}
+
+void Events_concurrency(Events *events, unsigned limit)
+{
+    say(events, "Concurrency: %u files in flight\n", limit);
+    events->counters.concurrency = limit;
 }
 
 #define print(events, field, fmt) \
@@ -98,9 +208,205 @@ void Events_print_stats(const Events *events, bool dry_run)
     print(events, collisions, "%u");
     print(events, bad_timestamps, "%u");
     print(events, skipped, "%u");
+    if (!dry_run) {
+        print(events, unlinked_files, "%u");
+        print(events, unlinked_space, "%zu bytes");
+        print(events, unlink_failures, "%u");
+    }
+    if (events->counters.chunked_files) {
+        print(events, chunked_files, "%u");
+        print(events, chunked_space, "%zu bytes");
+        print(events, shared_chunks, "%zu bytes");
+    }
+    if (events->counters.verified_files || events->counters.missing_files
+            || events->counters.corrupt_files) {
+        print(events, verified_files, "%u");
+        print(events, missing_files, "%u");
+        print(events, corrupt_files, "%u");
+    }
+    if (events->counters.concurrency)
+        print(events, concurrency, "%u");
 }
 #undef print
 
+static
+int64_t Events_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static
+Spans *Events_spans(Events *events)
+{
+    Spans *spans;
+
+    spans = pthread_getspecific(events->key);
+    if (spans)
+        return spans;
+
+    spans = calloc(1, sizeof(Spans));
+    if (!spans) {
+        warn("calloc");
+        return NULL;
+    }
+
+    spans->spans = malloc(Events_SPANS * sizeof(Span));
+    if (!spans->spans) {
+        warn("malloc");
+        free(spans);
+        return NULL;
+    }
+
+    errno = pthread_setspecific(events->key, spans);
+    if (errno) {
+        warn("pthread_setspecific");
+        free(spans->spans);
+        free(spans);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&events->lock);
+    spans->tid = ++events->nthreads;
+    spans->next = events->spans;
+    events->spans = spans;
+    pthread_mutex_unlock(&events->lock);
+    return spans;
+}
+
+// The length of the UTF-8 sequence the string starts with, or 0 if it
+// does not start with a valid one.
+static
+size_t Events_utf8_len(const unsigned char *s)
+{
+    size_t len;
+    uint32_t code;
+
+    if (s[0] < 0x80)
+        return 1;
+    else if (s[0] >= 0xc2 && s[0] < 0xe0)
+        len = 2, code = s[0] & 0x1f;
+    else if (s[0] >= 0xe0 && s[0] < 0xf0)
+        len = 3, code = s[0] & 0x0f;
+    else if (s[0] >= 0xf0 && s[0] < 0xf5)
+        len = 4, code = s[0] & 0x07;
+    else
+        return 0;
+
+    for (size_t i = 1; i < len; ++i) {
+        if ((s[i] & 0xc0) != 0x80)
+            return 0;
+        code = code << 6 | (s[i] & 0x3f);
+    }
+
+    // Overlong sequences, surrogates, and past the last code point.
+    if ((len == 3 && code < 0x800) || (len == 4 && code < 0x10000)
+            || (code >= 0xd800 && code < 0xe000) || code > 0x10ffff)
+        return 0;
+    return len;
+}
+
+// JSON strings are UTF-8: control characters are escaped, and so are
+// the bytes of invalid sequences, one by one.
+static
+void Events_json_string(FILE *file, const char *s)
+{
+    fputc('"', file);
+    while (*s) {
+        unsigned char c = *s;
+        size_t len = Events_utf8_len((const unsigned char *)s);
+
+        if (c == '"' || c == '\\')
+            fprintf(file, "\\%c", c);
+        else if (c < 0x20 || c == 0x7f || len == 0)
+            fprintf(file, "\\u%04x", c);
+        else
+            fwrite(s, 1, len, file);
+        s += len ? len : 1;
+    }
+    fputc('"', file);
+}
+
+// Writes the spans of a thread, and forgets them.
+static
+void Events_write_spans(Events *events, Spans *spans)
+{
+    for (size_t i = 0; i < spans->n; ++i) {
+        Span *span = &spans->spans[i];
+
+        fprintf(events->tracefile,
+                "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                events->traced ? "," : "", span->stage, spans->tid,
+                span->begin / 1e3, span->duration / 1e3);
+        if (span->path) {
+            fprintf(events->tracefile, ",\"args\":{\"path\":");
+            Events_json_string(events->tracefile, span->path);
+            fputc('}', events->tracefile);
+        }
+        fputc('}', events->tracefile);
+        free(span->path);
+        events->traced = true;
+    }
+    spans->n = 0;
+}
+
+int64_t Events_trace_begin(const Events *events)
+{
+    return events->tracefile ? Events_now() : 0;
+}
+
+void Events_trace_end(Events *events,
+                      const char *stage,
+                      const char *path,
+                      int64_t begin)
+{
+    Spans *spans;
+    Span *span;
+
+    if (!events->tracefile)
+        return;
+
+    spans = Events_spans(events);
+    if (!spans)
+        return;
+
+    // Written as they come by, so that a long run keeps no more of them.
+    if (spans->n == Events_SPANS) {
+        pthread_mutex_lock(&events->lock);
+        Events_write_spans(events, spans);
+        pthread_mutex_unlock(&events->lock);
+    }
+
+    span = &spans->spans[spans->n];
+    *span = (Span){
+        .stage = stage,
+        .begin = begin - events->origin,
+        .duration = Events_now() - begin,
+    };
+    if (path && !(span->path = strdup(path))) {
+        warn("strdup");
+        return;
+    }
+    spans->n++;
+}
+
+static
+int Events_write_trace(Events *events)
+{
+    for (Spans *spans = events->spans; spans; spans = spans->next)
+        Events_write_spans(events, spans);
+    fprintf(events->tracefile, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    if (ferror(events->tracefile)) {
+        warnx("cannot write the trace");
+        return -1;
+    }
+    return 0;
+}
+
 void Events_del(Events *events)
 {
     if (!events)
@@ -108,9 +414,49 @@ void Events_del(Events *events)
 
     if (events->logfile)
         fclose(events->logfile);
+
+    if (events->tracefile) {
+        Events_write_trace(events);
+        if (fclose(events->tracefile))
+            warn("fclose");
+        pthread_key_delete(events->key);
+    }
+
+    while (events->spans) {
+        Spans *spans = events->spans;
+
+        events->spans = spans->next;
+        for (size_t i = 0; i < spans->n; ++i)
+            free(spans->spans[i].path);
+        free(spans->spans);
+        free(spans);
+    }
+
+    pthread_mutex_destroy(&events->lock);
     free(events);
 }
 
+int Events_set_trace(Events *events, const char *tracefile)
+{
+    events->tracefile = fopen(tracefile, "w");
+    if (!events->tracefile) {
+        warn("fopen(%s, ...)", tracefile);
+        return -1;
+    }
+
+    errno = pthread_key_create(&events->key, NULL);
+    if (errno) {
+        warn("pthread_key_create");
+        fclose(events->tracefile);
+        events->tracefile = NULL;
+        return -1;
+    }
+
+    fprintf(events->tracefile, "{\"traceEvents\":[");
+    events->origin = Events_now();
+    return 0;
+}
+
 Events *Events_new(const char *events_logfile)
 {
     Events *events = NULL;
@@ -123,6 +469,7 @@ Events *Events_new(const char *events_logfile)
     }
 
     *events = (Events){};
+    pthread_mutex_init(&events->lock, NULL);
 
     if (events_logfile) {
         events->logfile = fopen(events_logfile, "w");
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 #include "file.h"
 
 typedef struct Events Events;
@@ -8,11 +10,37 @@ Events *Events_new(const char *logfile);
 
 void Events_accept_file(Events *, const File *);
 void Events_reject_file(Events *, const File *);
+
+// A file accepted before, no longer catalogued.
+void Events_supersede_file(Events *, const File *);
 void Events_collision(Events *, const File *, const char *hash);
 void Events_duplicate(Events *, const File *, const File *);
 void Events_ignored_identical(Events *, const File *, const File *);
 void Events_skipped_filename(Events *, const char *fname);
+void Events_unlinked(Events *, const File *);
+void Events_unlink_failed(Events *, const File *, int errnum);
+void Events_chunked(Events *, const File *, size_t total, size_t shared);
+
+// Verification: the file has the recorded checksum, is gone, or has
+// changed (hash is NULL if its size did).
+void Events_verified(Events *, const File *);
+void Events_missing(Events *, const File *);
+void Events_corrupt(Events *, const File *, const char *hash);
+
+// The number of files in flight chosen by the adaptive mode.
+void Events_concurrency(Events *, unsigned limit);
 
 void Events_print_stats(const Events *, bool dry_run);
 
+// With a trace file, the stages files go through are timed, from any
+// thread, and written on deletion as Chrome trace events.
+int Events_set_trace(Events *, const char *tracefile);
+
+// The beginning of a stage, to be given to Events_trace_end.
+int64_t Events_trace_begin(const Events *);
+void Events_trace_end(Events *,
+                      const char *stage,
+                      const char *path,
+                      int64_t begin);
+
 void Events_del(Events *);
@@ -13,14 +13,33 @@ void File_free(File *file)
 int File_init(File *file, const char *path)
 {
     struct stat statbuf;
-    const char *abspath = NULL;
 
     if (stat(path, &statbuf) == -1) {
         warn("stat(%s, ...)", path);
-        goto fail;
+        return -1;
     }
 
-    switch (statbuf.st_mode & S_IFMT) {
+    return File_init_stat(file, path, &statbuf);
+}
+
+static
+void File_set(File *file, const char *abspath, const struct stat *statbuf)
+{
+    *file = (File){
+        .path = abspath,
+        .mtime = statbuf->st_mtim.tv_sec
+               + statbuf->st_mtim.tv_nsec / 1000000000,
+        .device_id = statbuf->st_dev,
+        .inode_id = statbuf->st_ino,
+        .size = statbuf->st_size,
+    };
+}
+
+int File_init_stat(File *file, const char *path, const struct stat *statbuf)
+{
+    const char *abspath = NULL;
+
+    switch (statbuf->st_mode & S_IFMT) {
     case S_IFREG:
     case S_IFLNK:
         break;
@@ -38,15 +57,7 @@ int File_init(File *file, const char *path)
         goto fail;
     }
 
-    *file = (File){
-        .path = abspath,
-        .mtime = statbuf.st_mtim.tv_sec
-               + statbuf.st_mtim.tv_nsec / 1000000000,
-        .device_id = statbuf.st_dev,
-        .inode_id = statbuf.st_ino,
-        .size = statbuf.st_size,
-    };
-
+    File_set(file, abspath, statbuf);
     return 0;
 
 fail:
@@ -54,7 +65,31 @@ fail:
     return -1;
 }
 
-bool File_identical(File *f1, File *f2)
+int File_init_at(File *file, DirCache *cache, const char *path)
+{
+    struct stat statbuf;
+    const char *abspath;
+
+    if (DirCache_lstat(cache, path, &statbuf) == -1) {
+        warn("lstat(%s, ...)", path);
+        return -1;
+    }
+
+    // Links, and whatever is to be skipped, take the long way.
+    if (!S_ISREG(statbuf.st_mode))
+        return S_ISLNK(statbuf.st_mode)
+            ? File_init(file, path)
+            : File_init_stat(file, path, &statbuf);
+
+    abspath = DirCache_realpath(cache, path);
+    if (!abspath)
+        return -1;
+
+    File_set(file, abspath, &statbuf);
+    return 0;
+}
+
+bool File_identical(const File *f1, const File *f2)
 {
     return f1->inode_id == f2->inode_id
         && f1->device_id == f2->device_id;
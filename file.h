@@ -5,6 +5,8 @@
 #include <sys/stat.h>
 #include <time.h>
 
+#include "dircache.h"
+
 typedef struct File {
     const char *path;
     time_t mtime;
@@ -18,7 +20,13 @@ typedef struct File {
 
 int File_init(File *, const char *path);
 
-bool File_identical(File *, File *);
+// Like File_init, with the file already stat'ed.
+int File_init_stat(File *, const char *path, const struct stat *);
+
+// Like File_init, resolving the path under its cached directory.
+int File_init_at(File *, DirCache *, const char *path);
+
+bool File_identical(const File *, const File *);
 
 void File_objswap(File *, File *);
 
@@ -1,7 +1,9 @@
 #include "filerepo.h"
 
 #include <err.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <sysexits.h>
 #include <uthash.h>
@@ -9,47 +11,91 @@
 #include <string.h>
 
 #include "events.h"
+#include "journal.h"
 
 typedef struct PFile {
     File file;
+    char *filehash;     // with fast keys, computed when needed
+    uint64_t seq;       // the first rank in the input of the file
     struct PFile *next;
+    bool fresh;
+    bool linked;        // returned by FileRepo_next_fresh
 } PFile;
 
 typedef struct {
-    PFile *unique_files;
-    const char *filehash;
+    PFile *unique_files;    // by decreasing rank
+    const char *key;
+    uint64_t seq;           // the first rank in the input of its files
     UT_hash_handle hh;
 } Record;
 
-struct FileRepo {
+// An entry not yet returned by FileRepo_next_fresh.
+typedef struct Fresh {
+    Record *record;
+    PFile *pfile;
+    struct Fresh *next;
+} Fresh;
+
+// A catalogued file, by path.
+typedef struct {
+    Record *record;
+    PFile *pfile;
+    UT_hash_handle hh;
+} Known;
+
+// An entry returned by FileRepo_next_fresh whose file is no longer
+// catalogued, to be returned by FileRepo_next_stale.
+typedef struct Stale {
+    File file;
+    char *filehash;
+    struct Stale *next;
+} Stale;
+
+// The records are spread over shards by key, so that threads adding
+// files of different keys do not wait for each other.  The removals,
+// and the fresh, known and stale entries are under the lock of the
+// repository.
+typedef struct {
     Record *records;
+    pthread_mutex_t lock;
+} Shard;
+
+struct FileRepo {
+    Shard *shards;
+    unsigned nshards;
+    pthread_mutex_t lock;
     const Hasher *hasher;
     Events *events;
     PFile *removals;
+    Journal *journal;   // NULL unless journaling
+    DirCache *dircache; // NULL unless stat'ing relative to dirs
+    bool fast_keys;
+
+    // Incremental tracking.
+    bool incremental;
+    Fresh *fresh;
+    FileRepo_Entry fresh_entry;
+    Known *known;
+    Stale *stale;
+    Stale *stale_entry;         // the last returned by FileRepo_next_stale
+    PFile *removals_mark;       // the newest removal already returned
+    PFile *removals_cursor;
 };
 
 static
-PFile *PFile_new(const char *path)
+PFile *PFile_new(File *file)
 {
     PFile *pfile;
 
     pfile = malloc(sizeof(PFile));
     if (!pfile) {
         warn("malloc");
-        goto fail;
+        return NULL;
     }
-    *pfile = (PFile){};
-
-    if (File_init(&pfile->file, path))
-        goto fail;
 
+    *pfile = (PFile){};
+    File_objswap(&pfile->file, file);
     return pfile;
-
-fail:
-    // NOTE: skipped call to File_free, as File_init is the last call
-    //  before returning.
-    free(pfile);
-    return NULL;
 }
 
 static
@@ -59,9 +105,39 @@ void PFile_del(PFile *pfile)
         return;
 
     File_free(&pfile->file);
+    free(pfile->filehash);
     free(pfile);
 }
 
+// As one thread adds them, in the order of the input, the files of a
+// record come by decreasing rank: so do they when several threads do.
+static
+void Record_insert(Record *record, PFile *pfile)
+{
+    PFile *prev = NULL, *next;
+
+    LL_FOREACH(record->unique_files, next) {
+        if (next->seq < pfile->seq)
+            break;
+        prev = next;
+    }
+
+    if (prev) {
+        pfile->next = prev->next;
+        prev->next = pfile;
+    } else
+        LL_PREPEND(record->unique_files, pfile);
+}
+
+static
+int Record_cmp_seq(const void *a, const void *b)
+{
+    const Record *r1 = *(const Record * const *)a;
+    const Record *r2 = *(const Record * const *)b;
+
+    return (r1->seq > r2->seq) - (r1->seq < r2->seq);
+}
+
 static
 void Record_del(Record *record)
 {
@@ -76,11 +152,33 @@ void Record_del(Record *record)
         PFile_del(pfile);
     }
 
-    free((void *)record->filehash);
+    free((void *)record->key);
     free(record);
 }
 
-FileRepo *FileRepo_new(const Hasher *hasher, Events *events)
+static
+int FileRepo_set_shards(FileRepo *filerepo, unsigned nshards)
+{
+    Shard *shards;
+
+    shards = calloc(nshards, sizeof(Shard));
+    if (!shards) {
+        warn("calloc");
+        return -1;
+    }
+
+    for (unsigned i = 0; i < nshards; ++i)
+        pthread_mutex_init(&shards[i].lock, NULL);
+
+    for (unsigned i = 0; i < filerepo->nshards; ++i)
+        pthread_mutex_destroy(&filerepo->shards[i].lock);
+    free(filerepo->shards);
+    filerepo->shards = shards;
+    filerepo->nshards = nshards;
+    return 0;
+}
+
+FileRepo *FileRepo_new(const Hasher *hasher, Events *events, bool fast_keys)
 {
     FileRepo *filerepo;
 
@@ -93,7 +191,12 @@ FileRepo *FileRepo_new(const Hasher *hasher, Events *events)
     *filerepo = (FileRepo){
         .hasher = hasher,
         .events = events,
+        .fast_keys = fast_keys,
     };
+    pthread_mutex_init(&filerepo->lock, NULL);
+
+    if (FileRepo_set_shards(filerepo, 1))
+        goto fail;
 
     return filerepo;
 
@@ -102,8 +205,182 @@ fail:
     return NULL;
 }
 
+static
+const char *FileRepo_filehash(const FileRepo *filerepo,
+                              const Record *record,
+                              PFile *pfile)
+{
+    const char *filehash;
+
+    if (!filerepo->fast_keys)
+        return record->key;
+
+    if (!pfile->filehash) {
+        filehash = filerepo->journal
+            ? Journal_find_hash(filerepo->journal, &pfile->file)
+            : NULL;
+        if (!filehash) {
+            int64_t begin = Events_trace_begin(filerepo->events);
+
+            filehash = Hasher_hash_file(filerepo->hasher, pfile->file.path);
+            Events_trace_end(filerepo->events, "hash", pfile->file.path,
+                             begin);
+        }
+        if (!filehash)
+            return NULL;
+        if (filerepo->journal)
+            Journal_add_hash(filerepo->journal, &pfile->file, filehash);
+
+        pfile->filehash = strdup(filehash);
+        if (!pfile->filehash)
+            warn("strdup");
+    }
+    return pfile->filehash;
+}
+
+// With fast keys, a file sharing its key with different files is only a
+// checksum collision if it shares the checksum too.
+static
+int FileRepo_collision(const FileRepo *filerepo,
+                       const Record *record,
+                       PFile *new_pfile)
+{
+    const char *filehash;
+    PFile *pfile;
+
+    filehash = FileRepo_filehash(filerepo, record, new_pfile);
+    if (!filehash)
+        return -1;
+
+    LL_FOREACH(record->unique_files, pfile) {
+        const char *other = FileRepo_filehash(filerepo, record, pfile);
+
+        if (other && strcmp(other, filehash) == 0) {
+            Events_collision(filerepo->events, &new_pfile->file, filehash);
+            break;
+        }
+    }
+    return 0;
+}
+
+static
+int FileRepo_freshen(FileRepo *filerepo, Record *record, PFile *pfile)
+{
+    Fresh *fresh;
+
+    if (!filerepo->incremental || pfile->fresh)
+        return 0;
+
+    fresh = malloc(sizeof(Fresh));
+    if (!fresh) {
+        warn("malloc");
+        return -1;
+    }
+
+    *fresh = (Fresh){
+        .record = record,
+        .pfile = pfile,
+    };
+    pthread_mutex_lock(&filerepo->lock);
+    LL_PREPEND(filerepo->fresh, fresh);
+    pthread_mutex_unlock(&filerepo->lock);
+    pfile->fresh = true;
+    return 0;
+}
+
+static
+int FileRepo_know(FileRepo *filerepo, Record *record, PFile *pfile)
+{
+    Known *known;
+
+    if (!filerepo->incremental)
+        return 0;
+
+    known = malloc(sizeof(Known));
+    if (!known) {
+        warn("malloc");
+        return -1;
+    }
+
+    *known = (Known){
+        .record = record,
+        .pfile = pfile,
+    };
+    pthread_mutex_lock(&filerepo->lock);
+    HASH_ADD_KEYPTR(hh, filerepo->known, pfile->file.path,
+                    strlen(pfile->file.path), known);
+    pthread_mutex_unlock(&filerepo->lock);
+    return 0;
+}
+
+static
+void FileRepo_forget(FileRepo *filerepo, const char *path)
+{
+    Known *known;
+
+    if (!filerepo->incremental)
+        return;
+
+    pthread_mutex_lock(&filerepo->lock);
+    HASH_FIND_STR(filerepo->known, path, known);
+    if (known)
+        HASH_DEL(filerepo->known, known);
+    pthread_mutex_unlock(&filerepo->lock);
+    free(known);
+}
+
+static
+void Stale_del(Stale *stale)
+{
+    if (!stale)
+        return;
+
+    File_free(&stale->file);
+    free(stale->filehash);
+    free(stale);
+}
+
+// The file of the entry is kept as it is, with its own copy of the path.
+static
+int FileRepo_stale(FileRepo *filerepo, Record *record, PFile *pfile)
+{
+    const char *filehash;
+    Stale *stale;
+
+    if (!pfile->linked)
+        return 0;
+
+    filehash = FileRepo_filehash(filerepo, record, pfile);
+    if (!filehash)
+        return -1;
+
+    stale = malloc(sizeof(Stale));
+    if (!stale) {
+        warn("malloc");
+        return -1;
+    }
+
+    *stale = (Stale){
+        .file = pfile->file,
+        .filehash = strdup(filehash),
+    };
+    stale->file.path = strdup(pfile->file.path);
+    if (!stale->filehash || !stale->file.path) {
+        warn("strdup");
+        Stale_del(stale);
+        return -1;
+    }
+
+    pthread_mutex_lock(&filerepo->lock);
+    LL_PREPEND(filerepo->stale, stale);
+    pthread_mutex_unlock(&filerepo->lock);
+    pfile->linked = false;
+    return 0;
+}
+
 static
 int FileRepo_handle_duplicate(FileRepo *filerepo,
+                              Record *record,
                               PFile *pfile,
                               PFile *duplicate)
 {
@@ -113,11 +390,27 @@ int FileRepo_handle_duplicate(FileRepo *filerepo,
     // the case, we want to keep the oldest file, since the most
     // recent copy is likely to be wrong (unless the clock was in the
     // past for the host that made the copy.
-    if (duplicate->file.mtime < pfile->file.mtime)
+    if (duplicate->seq < pfile->seq)
+        pfile->seq = duplicate->seq;
+    if (duplicate->file.mtime < pfile->file.mtime) {
+        // The links to the replaced file, if any, are to be removed.
+        if (FileRepo_stale(filerepo, record, pfile))
+            return -1;
+        FileRepo_forget(filerepo, pfile->file.path);
         File_objswap(&pfile->file, &duplicate->file);
+        if (FileRepo_know(filerepo, record, pfile)
+                || FileRepo_freshen(filerepo, record, pfile))
+            return -1;
+    }
 
     Events_duplicate(filerepo->events, &pfile->file, &duplicate->file);
+    if (filerepo->journal
+            && Journal_add_duplicate(filerepo->journal, &duplicate->file,
+                                     &pfile->file))
+        return -1;
+    pthread_mutex_lock(&filerepo->lock);
     LL_PREPEND(filerepo->removals, duplicate);
+    pthread_mutex_unlock(&filerepo->lock);
     return 0;
 }
 
@@ -129,41 +422,72 @@ int FileRepo_attach_pfile(FileRepo *filerepo,
     PFile *pfile;
 
     LL_FOREACH(record->unique_files, pfile) {
+        int64_t begin;
         bool is_copy;
+        int ex;
 
         if (File_identical(&pfile->file, &new_pfile->file)) {
             Events_ignored_identical(filerepo->events, &pfile->file,
                 &new_pfile->file);
+            if (new_pfile->seq < pfile->seq)
+                pfile->seq = new_pfile->seq;
             PFile_del(new_pfile);
             return 0;
         }
 
-        if (Hasher_comp_files(
+        begin = Events_trace_begin(filerepo->events);
+        ex = Hasher_comp_files(
                 filerepo->hasher,
                 pfile->file.path,
                 new_pfile->file.path,
-                &is_copy) == -1)
+                &is_copy);
+        Events_trace_end(filerepo->events, "compare", new_pfile->file.path,
+                         begin);
+        if (ex == -1)
             return -1;
 
         if (is_copy)
-            return FileRepo_handle_duplicate(filerepo, pfile, new_pfile);
+            return FileRepo_handle_duplicate(filerepo, record, pfile,
+                                             new_pfile);
     }
 
-    Events_collision(filerepo->events, &new_pfile->file, record->filehash);
-    LL_PREPEND(record->unique_files, new_pfile);
+    if (FileRepo_collision(filerepo, record, new_pfile))
+        return -1;
+    if (FileRepo_freshen(filerepo, record, new_pfile)
+            || FileRepo_know(filerepo, record, new_pfile))
+        return -1;
+    Record_insert(record, new_pfile);
     return 0;
 }
 
+static
+Shard *FileRepo_shard(const FileRepo *filerepo, const char *key)
+{
+    uint32_t h = 2166136261u;
+
+    if (filerepo->nshards == 1)
+        return filerepo->shards;
+
+    // FNV-1a: keys are checksums, but not necessarily hexadecimal ones.
+    for (; *key; ++key)
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    return &filerepo->shards[h % filerepo->nshards];
+}
+
 static
 int FileRepo_attach_record(FileRepo *filerepo,
-                           const char *filehash,
+                           Shard *shard,
+                           const char *key,
                            PFile *pfile)
 {
     Record *record;
 
-    HASH_FIND_STR(filerepo->records, filehash, record);
-    if (record)
+    HASH_FIND_STR(shard->records, key, record);
+    if (record) {
+        if (pfile->seq < record->seq)
+            record->seq = pfile->seq;
         return FileRepo_attach_pfile(filerepo, record, pfile);
+    }
 
     record = malloc(sizeof(Record));
     if (!record) {
@@ -173,101 +497,337 @@ int FileRepo_attach_record(FileRepo *filerepo,
 
     *record = (Record){
         .unique_files = pfile,
-        .filehash = strdup(filehash),
+        .key = strdup(key),
+        .seq = pfile->seq,
     };
 
-    if (!record->filehash) {
+    if (!record->key) {
         warn("strdup");
         goto fail;
     }
 
+    if (FileRepo_freshen(filerepo, record, pfile)
+            || FileRepo_know(filerepo, record, pfile))
+        goto fail;
+
     HASH_ADD_KEYPTR(
         hh,
-        filerepo->records,
-        record->filehash,
-        strlen(record->filehash),
+        shard->records,
+        record->key,
+        strlen(record->key),
         record);
 
     return 0;
 
 fail:
     if (record) {
-        free((void *)record->filehash);
+        free((void *)record->key);
         free(record);
     }
     return -1;
 }
 
-int FileRepo_add(FileRepo *filerepo, const char *path)
+static
+bool Known_same(const Known *known, const File *file)
 {
-    PFile *pfile = NULL;
-    const char *filehash;
+    return File_identical(&known->pfile->file, file)
+        && known->pfile->file.size == file->size
+        && known->pfile->file.mtime == file->mtime;
+}
 
-    pfile = PFile_new(path);
+bool FileRepo_unchanged(FileRepo *filerepo, const File *file)
+{
+    Known *known;
+    bool same;
+
+    if (!filerepo->incremental)
+        return false;
+
+    pthread_mutex_lock(&filerepo->lock);
+    HASH_FIND_STR(filerepo->known, file->path, known);
+    same = known && Known_same(known, file);
+    pthread_mutex_unlock(&filerepo->lock);
+    return same;
+}
+
+// With incremental tracking, a file catalogued under the same path is
+// either the same, and kept, or was modified (or replaced) since, and
+// is no longer catalogued.  Returns 1 if the file is the same.
+static
+int FileRepo_replace(FileRepo *filerepo, File *file)
+{
+    Known *known;
+    Shard *shard;
+    Fresh *fresh;
+    PFile *pfile;
+    int ex = 0;
+
+    pthread_mutex_lock(&filerepo->lock);
+    HASH_FIND_STR(filerepo->known, file->path, known);
+    if (known && Known_same(known, file))
+        ex = 1;
+    else if (known)
+        HASH_DEL(filerepo->known, known);
+    pthread_mutex_unlock(&filerepo->lock);
+    if (!known || ex)
+        return ex;
+
+    pfile = known->pfile;
+    shard = FileRepo_shard(filerepo, known->record->key);
+    pthread_mutex_lock(&shard->lock);
+    if (FileRepo_stale(filerepo, known->record, pfile))
+        ex = -1;
+
+    pthread_mutex_lock(&filerepo->lock);
+    LL_FOREACH(filerepo->fresh, fresh)
+        if (fresh->pfile == pfile)
+            break;
+    if (fresh)
+        LL_DELETE(filerepo->fresh, fresh);
+    pthread_mutex_unlock(&filerepo->lock);
+    free(fresh);
+
+    LL_DELETE(known->record->unique_files, pfile);
+    if (!known->record->unique_files) {
+        HASH_DEL(shard->records, known->record);
+        Record_del(known->record);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    PFile_del(pfile);
+    free(known);
+    return ex;
+}
+
+int FileRepo_add_file(FileRepo *filerepo,
+                      File *file,
+                      uint64_t seq,
+                      const char *key,
+                      const char *filehash)
+{
+    Shard *shard = FileRepo_shard(filerepo, key);
+    PFile *pfile;
+    int ex;
+
+    ex = filerepo->incremental ? FileRepo_replace(filerepo, file) : 0;
+    if (ex == 1) {
+        File_free(file);
+        *file = (File){};
+        return 0;
+    }
+    if (ex)
+        return -1;
+
+    // With fast keys, the checksum is journaled once known.
+    if (!filerepo->fast_keys)
+        filehash = key;
+    if (filerepo->journal && filehash
+            && Journal_add_hash(filerepo->journal, file, filehash))
+        return -1;
+
+    pfile = PFile_new(file);
     if (!pfile)
-        goto fail;
+        return -1;
+    pfile->seq = seq;
 
-    filehash = Hasher_hash_file(filerepo->hasher, path);
-    if (!filehash)
+    if (filerepo->fast_keys && filehash) {
+        pfile->filehash = strdup(filehash);
+        if (!pfile->filehash)
+            warn("strdup");
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    ex = FileRepo_attach_record(filerepo, shard, key, pfile);
+    pthread_mutex_unlock(&shard->lock);
+
+    if (ex) {
+        // Give the file back, so that the caller keeps its ownership.
+        File_objswap(&pfile->file, file);
+        PFile_del(pfile);
+        return -1;
+    }
+
+    return 0;
+}
+
+int FileRepo_set_concurrent(FileRepo *filerepo)
+{
+    for (unsigned i = 0; i < filerepo->nshards; ++i)
+        if (filerepo->shards[i].records) {
+            warnx("cannot shard a repository already in use");
+            return -1;
+        }
+    return FileRepo_set_shards(filerepo, FileRepo_SHARDS);
+}
+
+void FileRepo_set_journal(FileRepo *filerepo, Journal *journal)
+{
+    filerepo->journal = journal;
+}
+
+void FileRepo_set_dircache(FileRepo *filerepo, DirCache *dircache)
+{
+    filerepo->dircache = dircache;
+}
+
+const char *FileRepo_journaled_key(const FileRepo *filerepo,
+                                   const File *file)
+{
+    if (!filerepo->journal || filerepo->fast_keys)
+        return NULL;
+    return Journal_find_hash(filerepo->journal, file);
+}
+
+int FileRepo_add(FileRepo *filerepo,
+                 const char *path,
+                 uint64_t seq,
+                 off_t *size)
+{
+    File file = {};
+    const char *key;
+    char *filehash = NULL;
+    int64_t begin;
+    int ex;
+
+    begin = Events_trace_begin(filerepo->events);
+    ex = File_init_at(&file, filerepo->dircache, path);
+    Events_trace_end(filerepo->events, "stat", path, begin);
+    if (ex)
+        return -1;
+    if (size)
+        *size = file.size;
+
+    // Seen again (e.g. by a rescan): not worth reading.
+    if (FileRepo_unchanged(filerepo, &file)) {
+        File_free(&file);
+        return 0;
+    }
+
+    key = FileRepo_journaled_key(filerepo, &file);
+    if (!key) {
+        begin = Events_trace_begin(filerepo->events);
+        key = filerepo->fast_keys
+            ? Hasher_fast_file(filerepo->hasher, path, &filehash)
+            : Hasher_hash_file(filerepo->hasher, path);
+        Events_trace_end(filerepo->events, "hash", path, begin);
+    }
+    if (!key)
         goto fail;
 
-    if (FileRepo_attach_record(filerepo, filehash, pfile))
+    if (FileRepo_add_file(filerepo, &file, seq, key, filehash))
         goto fail;
 
+    free(filehash);
     return 0;
 
 fail:
-    PFile_del(pfile);
+    free(filehash);
+    File_free(&file);
     return -1;
 }
 
+int FileRepo_key_files(const FileRepo *filerepo,
+                       const char * const *paths,
+                       size_t n,
+                       char **keys,
+                       char **filehashes)
+{
+    for (size_t i = 0; i < n; ++i)
+        filehashes[i] = NULL;
+
+    if (filerepo->fast_keys)
+        return Hasher_fast_files(filerepo->hasher, paths, n, keys,
+                                 filehashes);
+    return Hasher_hash_files(filerepo->hasher, paths, n, keys);
+}
+
+// Sharded, the records are sorted by rank, so that they come in the
+// same order as when one thread adds them.
+static
+const Record **FileRepo_sorted_records(const FileRepo *filerepo, size_t *n)
+{
+    const Record **records, *record;
+    size_t count = 0;
+
+    for (unsigned i = 0; i < filerepo->nshards; ++i)
+        count += HASH_COUNT(filerepo->shards[i].records);
+
+    records = malloc((count ? count : 1) * sizeof(Record *));
+    if (!records) {
+        warn("malloc");
+        return NULL;
+    }
+
+    *n = 0;
+    for (unsigned i = 0; i < filerepo->nshards; ++i)
+        for (record = filerepo->shards[i].records; record;
+                record = record->hh.next)
+            records[(*n)++] = record;
+
+    qsort(records, *n, sizeof(Record *), Record_cmp_seq);
+    return records;
+}
+
 const FileRepo_Entry *FileRepo_iter(const FileRepo *filerepo, void **aux)
 {
     typedef struct {
+        const Record **records;     // NULL unless sharded
+        size_t nrecords;
+        size_t next;
         const Record *record;
-        const PFile *pfile;
+        PFile *pfile;
         FileRepo_Entry entry;
     } Iter;
 
     Iter *iter = *aux;
 
     if (iter == NULL) {
-        if (!filerepo->records)
-            return NULL;    // Empty. Stop immediately.
-
         iter = *aux = malloc(sizeof(Iter));
         if (!iter) {
             warn("malloc failed, iteration yields nothing");
             return NULL;
         }
 
-        // Take the first record, and the first of the files of
-        // the record.
-        *iter = (Iter){
-            .record = filerepo->records,
-            .pfile = filerepo->records->unique_files,
-        };
-    }
-    else if (iter->pfile->next) {
-        iter->pfile = iter->pfile->next;
-    } else {
-        // Advance record, take the first pfile of the record.
-        iter->record = iter->record->hh.next;
-
-        if (!iter->record) {
-            // Cannot advance, reached end of iteration.
-            free(iter);
-            return *aux = NULL;
+        *iter = (Iter){};
+        if (filerepo->nshards > 1) {
+            iter->records = FileRepo_sorted_records(filerepo,
+                                                    &iter->nrecords);
+            if (!iter->records) {
+                warnx("iteration yields nothing");
+                free(iter);
+                return *aux = NULL;
+            }
         }
-        iter->pfile = iter->record->unique_files;
+    } else if (iter->pfile->next) {
+        iter->pfile = iter->pfile->next;
+        goto entry;
     }
 
+    // Advance record, take the first pfile of the record.
+    if (iter->records)
+        iter->record = iter->next < iter->nrecords
+            ? iter->records[iter->next++]
+            : NULL;
+    else
+        iter->record = iter->record
+            ? iter->record->hh.next
+            : filerepo->shards[0].records;
+
+    if (!iter->record) {
+        // Cannot advance, reached end of iteration.
+        free(iter->records);
+        free(iter);
+        return *aux = NULL;
+    }
+    iter->pfile = iter->record->unique_files;
+
+entry:
     if (!iter->pfile || !iter->record)
         errx(EX_SOFTWARE, "buggy! %p %p", iter->pfile, iter->record);
 
     iter->entry = (FileRepo_Entry){
         .file = &iter->pfile->file,
-        .filehash = iter->record->filehash,
+        .filehash = FileRepo_filehash(filerepo, iter->record, iter->pfile),
     };
     return &iter->entry;
 }
@@ -286,23 +846,111 @@ const File *FileRepo_iter_removals(const FileRepo *filerepo,
     return &pfile->file;
 }
 
+void FileRepo_set_incremental(FileRepo *filerepo)
+{
+    filerepo->incremental = true;
+}
+
+const FileRepo_Entry *FileRepo_next_fresh(FileRepo *filerepo)
+{
+    Fresh *fresh = filerepo->fresh;
+
+    if (!fresh)
+        return NULL;
+
+    filerepo->fresh = fresh->next;
+    fresh->pfile->fresh = false;
+    fresh->pfile->linked = true;
+    filerepo->fresh_entry = (FileRepo_Entry){
+        .file = &fresh->pfile->file,
+        .filehash = FileRepo_filehash(filerepo, fresh->record, fresh->pfile),
+    };
+    free(fresh);
+    return &filerepo->fresh_entry;
+}
+
+const FileRepo_Entry *FileRepo_next_stale(FileRepo *filerepo)
+{
+    Stale *stale = filerepo->stale;
+
+    Stale_del(filerepo->stale_entry);
+    filerepo->stale_entry = NULL;
+    if (!stale)
+        return NULL;
+
+    filerepo->stale = stale->next;
+    filerepo->stale_entry = stale;
+    filerepo->fresh_entry = (FileRepo_Entry){
+        .file = &stale->file,
+        .filehash = stale->filehash,
+    };
+    return &filerepo->fresh_entry;
+}
+
+const File *FileRepo_next_fresh_removal(FileRepo *filerepo)
+{
+    PFile *pfile;
+
+    // Removals are prepended: the fresh ones precede the mark.
+    pfile = filerepo->removals_cursor
+        ? filerepo->removals_cursor->next
+        : filerepo->removals;
+
+    if (pfile == filerepo->removals_mark) {
+        filerepo->removals_mark = filerepo->removals;
+        filerepo->removals_cursor = NULL;
+        return NULL;
+    }
+
+    filerepo->removals_cursor = pfile;
+    return &pfile->file;
+}
+
 void FileRepo_del(FileRepo *filerepo)
 {
     Record *record, *tmp1;
     PFile *pfile, *tmp2;
+    Known *known, *tmp3;
 
     if (!filerepo)
         return;
 
-    HASH_ITER(hh, filerepo->records, record, tmp1) {
-        HASH_DEL(filerepo->records, record);
-        Record_del(record);
+    for (unsigned i = 0; i < filerepo->nshards; ++i) {
+        Shard *shard = &filerepo->shards[i];
+
+        HASH_ITER(hh, shard->records, record, tmp1) {
+            HASH_DEL(shard->records, record);
+            Record_del(record);
+        }
+        pthread_mutex_destroy(&shard->lock);
     }
+    free(filerepo->shards);
 
     LL_FOREACH_SAFE(filerepo->removals, pfile, tmp2) {
         LL_DELETE(filerepo->removals, pfile);
         PFile_del(pfile);
     }
 
+    while (filerepo->fresh) {
+        Fresh *fresh = filerepo->fresh;
+
+        filerepo->fresh = fresh->next;
+        free(fresh);
+    }
+
+    while (filerepo->stale) {
+        Stale *stale = filerepo->stale;
+
+        filerepo->stale = stale->next;
+        Stale_del(stale);
+    }
+    Stale_del(filerepo->stale_entry);
+
+    HASH_ITER(hh, filerepo->known, known, tmp3) {
+        HASH_DEL(filerepo->known, known);
+        free(known);
+    }
+
+    pthread_mutex_destroy(&filerepo->lock);
     free(filerepo);
 }
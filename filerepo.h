@@ -1,21 +1,84 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include "file.h"
 #include "hasher.h"
+#include "journal.h"
+
+enum {
+    FileRepo_SHARDS = 64,
+};
 
 typedef struct FileRepo FileRepo;
 typedef struct {
     const File *file;
-    const char *filehash;
+    const char *filehash;   // NULL if it could not be computed
 } FileRepo_Entry;
 
 struct Events;
 
-FileRepo *FileRepo_new(const Hasher *, struct Events *);
+// With fast keys, files are grouped by a fast non cryptographic hash, and
+// the checksum of a file is only computed when needed: when its key is
+// shared by a different file, and when it is iterated.
+FileRepo *FileRepo_new(const Hasher *, struct Events *, bool fast_keys);
 
+// Entries come in the order of the input, by the rank of the first of
+// the files sharing their key, however many threads added them.
 const FileRepo_Entry *FileRepo_iter(const FileRepo *, void **aux);
 const File *FileRepo_iter_removals(const FileRepo *, void **aux);
 
-int FileRepo_add(FileRepo *, const char *path);
+// Lets several threads add files at once, FileRepo_add and
+// FileRepo_add_file being thread-safe from then on.  Must be called
+// before any file is added.
+int FileRepo_set_concurrent(FileRepo *);
+
+// With a journal, the checksums and duplicate decisions are recorded,
+// and the checksums recorded by a previous run are reused.
+void FileRepo_set_journal(FileRepo *, Journal *);
+
+// Files added are stat'ed under their cached directory.
+void FileRepo_set_dircache(FileRepo *, DirCache *);
+
+// The key of the file, as recorded by the journal, or NULL.
+const char *FileRepo_journaled_key(const FileRepo *, const File *);
+
+// With incremental tracking, whether the file is catalogued already and
+// unchanged since: adding it again would not change anything.
+bool FileRepo_unchanged(FileRepo *, const File *);
+
+// The file comes at rank seq in the input.  Yields the size of the file
+// in size, if not NULL.
+int FileRepo_add(FileRepo *, const char *path, uint64_t seq, off_t *size);
+
+// Computes the keys of the files (checksums, or fast keys), as
+// Hasher_hash_files does.  With fast keys, the checksums read along
+// (see Hasher_fast_file) go to filehashes, NULL otherwise.
+int FileRepo_key_files(const FileRepo *,
+                       const char * const *paths,
+                       size_t n,
+                       char **keys,
+                       char **filehashes);
+
+// Add an already initialized file, of rank seq in the input, with its
+// key, and with fast keys its checksum if known already (or NULL).  On success the repository takes
+// over the file, which is left zeroed.
+int FileRepo_add_file(FileRepo *,
+                      File *,
+                      uint64_t seq,
+                      const char *key,
+                      const char *filehash);
+
+// With incremental tracking, the entries added since the last call (or
+// whose file was replaced by an older copy), and the removals decided
+// since the last call, can be iterated.  So can the entries once
+// returned as fresh, but no longer catalogued since: a returned entry
+// is valid until the next call.
+void FileRepo_set_incremental(FileRepo *);
+const FileRepo_Entry *FileRepo_next_fresh(FileRepo *);
+const FileRepo_Entry *FileRepo_next_stale(FileRepo *);
+const File *FileRepo_next_fresh_removal(FileRepo *);
 
 void FileRepo_del(FileRepo *);
@@ -1,25 +1,105 @@
 #include <ctype.h>
+#include <errno.h>
 #include <err.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "coproc.h"
+#include "murmur3.h"
+#include "resume.h"
 #include "util.h"
 #include "hasher.h"
+#include "sha1.h"
+#include "throttle.h"
+#include "uring.h"
 
 struct Hasher {
     const char *hashprg;
     const char *compprg;
-    char *buffer;
+    bool builtin_hash;
+    bool builtin_comp;
+    Stream_Policy policy;
+    Coproc *hashcoproc;
+    Coproc *compcoproc;
+    Uring *uring;
+    Throttle *throttle;         // NULL unless throttling
+    DirCache *dircache;         // NULL unless opening relative to dirs
+    Resume *resume;             // NULL unless resuming appended files
+    pthread_key_t scratch;
+    bool has_scratch;
 };
 
+// Each thread has its own buffers: for the checksum returned, and for
+// the streams.
+typedef struct {
+    char *buffer;
+    char *streambuf[2];
+} Hasher_Scratch;
+
 enum {
     Hasher_checksum_length = 128, // ok for anything up to sha512
     Hasher_buflen = Hasher_checksum_length + 1,
 };
 
+static
+void Hasher_Scratch_del(void *arg)
+{
+    Hasher_Scratch *scratch = arg;
+
+    if (!scratch)
+        return;
+
+    free(scratch->buffer);
+    free(scratch->streambuf[0]);
+    free(scratch->streambuf[1]);
+    free(scratch);
+}
+
+static
+Hasher_Scratch *Hasher_scratch(const Hasher *hasher)
+{
+    Hasher_Scratch *scratch;
+
+    scratch = pthread_getspecific(hasher->scratch);
+    if (scratch)
+        return scratch;
+
+    scratch = calloc(1, sizeof(Hasher_Scratch));
+    if (!scratch) {
+        warn("calloc");
+        return NULL;
+    }
+
+    scratch->buffer = malloc(Hasher_buflen);
+    if (!scratch->buffer) {
+        warn("malloc");
+        goto fail;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        scratch->streambuf[i] = Stream_buffer_new();
+        if (!scratch->streambuf[i])
+            goto fail;
+    }
+
+    // Freed on exit by the threads other than the one deleting the
+    // hasher.
+    errno = pthread_setspecific(hasher->scratch, scratch);
+    if (errno) {
+        warn("pthread_setspecific");
+        goto fail;
+    }
+    return scratch;
+
+fail:
+    Hasher_Scratch_del(scratch);
+    return NULL;
+}
+
 void Hasher_del(Hasher *hasher)
 {
     if (!hasher)
@@ -27,11 +107,21 @@ void Hasher_del(Hasher *hasher)
 
     free((void *)hasher->hashprg);
     free((void *)hasher->compprg);
-    free((void *)hasher->buffer);
+    if (hasher->has_scratch) {
+        Hasher_Scratch_del(pthread_getspecific(hasher->scratch));
+        pthread_key_delete(hasher->scratch);
+    }
+    Coproc_del(hasher->hashcoproc);
+    Coproc_del(hasher->compcoproc);
+    Uring_del(hasher->uring);
     free(hasher);
 }
 
-Hasher *Hasher_new(const char *hashprg, const char *compprg)
+Hasher *Hasher_new(const char *hashprg,
+                   const char *compprg,
+                   Stream_Policy policy,
+                   unsigned coprocs,
+                   unsigned depth)
 {
     Hasher *hasher = malloc(sizeof(Hasher));
     if (!hasher) {
@@ -52,10 +142,35 @@ Hasher *Hasher_new(const char *hashprg, const char *compprg)
         goto fail;
     }
 
-    hasher->buffer = malloc(Hasher_buflen);
-    if (!hasher->buffer) {
-        warn("malloc");
+    hasher->builtin_hash = strcmp(hashprg, Hasher_BUILTIN) == 0;
+    hasher->builtin_comp = strcmp(compprg, Hasher_BUILTIN) == 0;
+    hasher->policy = policy;
+
+    errno = pthread_key_create(&hasher->scratch, Hasher_Scratch_del);
+    if (errno) {
+        warn("pthread_key_create");
+        goto fail;
+    }
+    hasher->has_scratch = true;
+
+    // Allocated upfront for this thread, lazily for the others.
+    if (!Hasher_scratch(hasher))
         goto fail;
+
+    // Without io_uring, the builtin hasher just reads files one by one.
+    if (depth && hasher->builtin_hash)
+        hasher->uring = Uring_new(depth, policy);
+
+    if (coprocs && !hasher->builtin_hash) {
+        hasher->hashcoproc = Coproc_new(hashprg, coprocs);
+        if (!hasher->hashcoproc)
+            goto fail;
+    }
+
+    if (coprocs && !hasher->builtin_comp) {
+        hasher->compcoproc = Coproc_new(compprg, coprocs);
+        if (!hasher->compcoproc)
+            goto fail;
     }
 
     return hasher;
@@ -65,6 +180,14 @@ fail:
     return NULL;
 }
 
+static
+ssize_t Hasher_stream_read(const Hasher *hasher,
+                           Stream *stream,
+                           const char **data)
+{
+    return Throttle_stream_read(hasher->throttle, stream, data);
+}
+
 static
 int Hasher_wait(pid_t child, int *exit_status)
 {
@@ -111,14 +234,14 @@ void Hasher_exec(const char * const hashprg, int r, int w, const char *path)
 }
 
 static
-int Hasher_read(const Hasher *hasher, int r)
+int Hasher_read(char *result, int r)
 {
     ssize_t n;
     char *buffer;
     int room;
 
     room = Hasher_buflen;
-    buffer = hasher->buffer;
+    buffer = result;
 
     do {
         n = read(r, buffer, room);
@@ -142,10 +265,416 @@ int Hasher_read(const Hasher *hasher, int r)
     if (n == 0)
         warnx("invalid hash, zero bytes answer from subcommand");
     else
-        warnx("invalid hash: %.*s", Hasher_buflen, hasher->buffer);
+        warnx("invalid hash: %.*s", Hasher_buflen, result);
     return -1;
 }
 
+static
+int Hasher_builtin_comp(const Hasher *hasher,
+                        const char *path1,
+                        const char *path2,
+                        bool *equals)
+{
+    Hasher_Scratch *scratch = Hasher_scratch(hasher);
+    Stream s1, s2;
+    const char *d1 = NULL, *d2 = NULL;
+    ssize_t n1 = 0, n2 = 0;
+    int ex = -1;
+
+    if (!scratch)
+        return -1;
+    if (Stream_open(&s1, hasher->dircache, path1, hasher->policy,
+                    scratch->streambuf[0]))
+        return -1;
+    if (Stream_open(&s2, hasher->dircache, path2, hasher->policy,
+                    scratch->streambuf[1])) {
+        Stream_close(&s1);
+        return -1;
+    }
+
+    if (s1.size != s2.size) {
+        *equals = false;
+        ex = 0;
+        goto exit;
+    }
+
+    for (;;) {
+        size_t n;
+
+        if (n1 == 0 && (n1 = Hasher_stream_read(hasher, &s1, &d1)) == -1)
+            goto exit;
+        if (n2 == 0 && (n2 = Hasher_stream_read(hasher, &s2, &d2)) == -1)
+            goto exit;
+
+        if (n1 == 0 || n2 == 0) {
+            *equals = n1 == n2;
+            break;
+        }
+
+        n = n1 < n2 ? n1 : n2;
+        if (memcmp(d1, d2, n)) {
+            *equals = false;
+            break;
+        }
+        d1 += n;
+        d2 += n;
+        n1 -= n;
+        n2 -= n;
+    }
+    ex = 0;
+
+exit:
+    Stream_close(&s1);
+    Stream_close(&s2);
+    return ex;
+}
+
+enum {
+    // Files read in one go, by either reader, are hashed several at
+    // once; up to that many bytes of them are kept waiting.
+    Hasher_SMALL = Uring_BLOCK,
+    Hasher_PENDING = 64 << 20,
+};
+
+typedef struct {
+    size_t index;
+    size_t len;
+    uint8_t *data;
+} Hasher_Small;
+
+typedef struct {
+    char **digests;
+    Throttle *throttle;
+    Sha1 *sha1;
+    Hasher_Small *small;
+    size_t nsmall;
+    size_t pending;
+} Hasher_Files;
+
+static
+void Hasher_set_digest(char **out, const uint8_t *digest)
+{
+    char hex[2 * Sha1_DIGEST_LENGTH + 1];
+
+    Util_hexlify(digest, Sha1_DIGEST_LENGTH, hex);
+    *out = strdup(hex);
+    if (!*out)
+        warn("strdup");
+}
+
+static
+int Hasher_cmp_small(const void *a, const void *b)
+{
+    const Hasher_Small *s1 = a, *s2 = b;
+
+    if (s1->len != s2->len)
+        return s1->len < s2->len ? -1 : 1;
+    return s1->index < s2->index ? -1 : s1->index > s2->index;
+}
+
+static
+void Hasher_small_flush(Hasher_Files *files)
+{
+    // Same-size files end up side by side, so lanes are seldom wasted.
+    qsort(files->small, files->nsmall, sizeof(Hasher_Small),
+          Hasher_cmp_small);
+
+    for (size_t i = 0; i < files->nsmall; i += Sha1_LANES) {
+        const uint8_t *data[Sha1_LANES];
+        size_t lens[Sha1_LANES];
+        uint8_t digests[Sha1_LANES][Sha1_DIGEST_LENGTH];
+        unsigned n = files->nsmall - i < Sha1_LANES
+                     ? files->nsmall - i
+                     : Sha1_LANES;
+
+        for (unsigned l = 0; l < n; ++l) {
+            data[l] = files->small[i + l].data;
+            lens[l] = files->small[i + l].len;
+        }
+
+        if (n == 1) {
+            Sha1 sha1;
+
+            Sha1_init(&sha1);
+            Sha1_update(&sha1, data[0], lens[0]);
+            Sha1_final(&sha1, digests[0]);
+        } else {
+            Sha1_multi(data, lens, n, digests);
+        }
+
+        for (unsigned l = 0; l < n; ++l) {
+            Hasher_set_digest(&files->digests[files->small[i + l].index],
+                              digests[l]);
+            free(files->small[i + l].data);
+        }
+    }
+
+    files->nsmall = 0;
+    files->pending = 0;
+}
+
+static
+void Hasher_small_add(Hasher_Files *files,
+                      size_t i,
+                      const char *data,
+                      size_t len)
+{
+    uint8_t *copy;
+
+    copy = malloc(len ? len : 1);
+    if (!copy) {
+        warn("malloc");
+        return;
+    }
+    memcpy(copy, data, len);
+
+    files->small[files->nsmall++] = (Hasher_Small){
+        .index = i,
+        .len = len,
+        .data = copy,
+    };
+
+    files->pending += len;
+    if (files->pending >= Hasher_PENDING)
+        Hasher_small_flush(files);
+}
+
+static
+void Hasher_uring_handler(void *ctx,
+                          size_t i,
+                          off_t size,
+                          const char *data,
+                          size_t len)
+{
+    Hasher_Files *files = ctx;
+    uint8_t digest[Sha1_DIGEST_LENGTH];
+
+    if (!data)
+        return;
+
+    // The time a block took is not known.
+    if (files->throttle && len)
+        Throttle_take(files->throttle, len, -1);
+
+    // A small file comes whole, in one block.
+    if (size <= Hasher_SMALL) {
+        if (len || size == 0)
+            Hasher_small_add(files, i, data, len);
+        return;
+    }
+
+    if (len) {
+        Sha1_update(&files->sha1[i], data, len);
+        return;
+    }
+
+    Sha1_final(&files->sha1[i], digest);
+    Hasher_set_digest(&files->digests[i], digest);
+}
+
+// Hashes a large file from where a previous run left it, if it was only
+// appended to since, and records where this run leaves it: at the last
+// read starting on a probe boundary, so that any I/O policy can resume.
+static
+void Hasher_resume_file(const Hasher *hasher,
+                        Hasher_Files *files,
+                        size_t i,
+                        const char *path,
+                        Stream *stream)
+{
+    Sha1 sha1, saved;
+    uint8_t digest[Sha1_DIGEST_LENGTH];
+    const char *data;
+    off_t offset, saved_at = 0;
+    ssize_t n;
+
+    offset = Resume_restore(hasher->resume, path, stream->fd, &sha1);
+    if (offset && Stream_seek(stream, offset))
+        return;
+
+    while (n = Hasher_stream_read(hasher, stream, &data), n > 0) {
+        offset = stream->offset - n;
+        if (offset % Resume_PROBE == 0) {
+            saved = sha1;
+            saved_at = offset;
+        }
+        Sha1_update(&sha1, data, n);
+    }
+
+    if (n == -1)
+        return;
+
+    if (saved_at >= Resume_MINSIZE)
+        Resume_save(hasher->resume, path, stream->fd, saved_at, &saved);
+
+    Sha1_final(&sha1, digest);
+    Hasher_set_digest(&files->digests[i], digest);
+}
+
+static
+void Hasher_stream_file(const Hasher *hasher,
+                        Hasher_Files *files,
+                        size_t i,
+                        const char *path)
+{
+    Hasher_Scratch *scratch = Hasher_scratch(hasher);
+    Stream stream;
+    Sha1 sha1;
+    uint8_t digest[Sha1_DIGEST_LENGTH];
+    const char *data;
+    ssize_t n;
+
+    if (!scratch)
+        return;
+    if (Stream_open(&stream, hasher->dircache, path, hasher->policy,
+                    scratch->streambuf[0]))
+        return;
+
+    if (hasher->resume && stream.size >= Resume_MINSIZE) {
+        Hasher_resume_file(hasher, files, i, path, &stream);
+        Stream_close(&stream);
+        return;
+    }
+
+    n = Hasher_stream_read(hasher, &stream, &data);
+    if (stream.size <= Hasher_SMALL && n == stream.size) {
+        Hasher_small_add(files, i, data, n);
+        Stream_close(&stream);
+        return;
+    }
+
+    Sha1_init(&sha1);
+    for (; n > 0; n = Hasher_stream_read(hasher, &stream, &data))
+        Sha1_update(&sha1, data, n);
+    Stream_close(&stream);
+
+    if (n == -1)
+        return;
+
+    Sha1_final(&sha1, digest);
+    Hasher_set_digest(&files->digests[i], digest);
+}
+
+static
+int Hasher_builtin_files(const Hasher *hasher,
+                         const char * const *paths,
+                         size_t n,
+                         char **digests)
+{
+    Hasher_Files files = {
+        .digests = digests,
+        .throttle = hasher->throttle,
+    };
+    int ex = -1;
+
+    files.small = malloc((n ? n : 1) * sizeof(Hasher_Small));
+    if (!files.small) {
+        warn("malloc");
+        goto exit;
+    }
+
+    // A thread finding the ring in use by another one reads by itself,
+    // and so do all when resuming, which the ring does not.
+    if (hasher->uring && !hasher->resume && Uring_acquire(hasher->uring)) {
+        files.sha1 = malloc((n ? n : 1) * sizeof(Sha1));
+        if (files.sha1) {
+            for (size_t i = 0; i < n; ++i)
+                Sha1_init(&files.sha1[i]);
+
+            ex = Uring_read_files(hasher->uring, paths, n,
+                                  Hasher_uring_handler, &files);
+        } else {
+            warn("malloc");
+        }
+        Uring_release(hasher->uring);
+        if (!files.sha1)
+            goto exit;
+
+        // The ring failed, for good: the files it left are read by
+        // streams.
+        if (ex) {
+            Hasher_small_flush(&files);
+            for (size_t i = 0; i < n; ++i)
+                if (!digests[i])
+                    Hasher_stream_file(hasher, &files, i, paths[i]);
+            ex = 0;
+        }
+    } else {
+        for (size_t i = 0; i < n; ++i)
+            Hasher_stream_file(hasher, &files, i, paths[i]);
+        ex = 0;
+    }
+
+    Hasher_small_flush(&files);
+
+exit:
+    free(files.small);
+    free(files.sha1);
+    return ex;
+}
+
+static
+const char *Hasher_builtin_hash(const Hasher *hasher, const char *path)
+{
+    Hasher_Scratch *scratch = Hasher_scratch(hasher);
+    char *result = NULL;
+
+    if (!scratch)
+        return NULL;
+
+    Hasher_builtin_files(hasher, &path, 1, &result);
+    if (!result)
+        return NULL;
+
+    strcpy(scratch->buffer, result);
+    free(result);
+    return scratch->buffer;
+}
+
+static
+int Hasher_coproc_comp(const Hasher *hasher,
+                       const char *path1,
+                       const char *path2,
+                       bool *equals)
+{
+    const char *args[] = {path1, path2};
+    char reply[16];
+    char *end;
+    long status;
+
+    if (Coproc_request(hasher->compcoproc, args, 2, reply, sizeof(reply)))
+        return -1;
+
+    // The reply is the exit status the comparer would have had.
+    status = strtol(reply, &end, 10);
+    if (end == reply || *end != '\0') {
+        warnx("invalid comparison result: '%s'", reply);
+        return -1;
+    }
+
+    *equals = !status;
+    return 0;
+}
+
+static
+const char *Hasher_coproc_hash(const Hasher *hasher, const char *path)
+{
+    Hasher_Scratch *scratch = Hasher_scratch(hasher);
+
+    if (!scratch)
+        return NULL;
+    if (Coproc_request(hasher->hashcoproc, &path, 1, scratch->buffer,
+                       Hasher_buflen))
+        return NULL;
+
+    // Like an exit status, an empty reply tells of a failure.
+    scratch->buffer[strcspn(scratch->buffer, " \t")] = '\0';
+    if (scratch->buffer[0] == '\0')
+        return NULL;
+
+    return scratch->buffer;
+}
+
 int Hasher_comp_files(const Hasher *hash,
                       const char *path1,
                       const char *path2,
@@ -154,6 +683,11 @@ int Hasher_comp_files(const Hasher *hash,
     pid_t pid;
     int exit_status;
 
+    if (hash->builtin_comp)
+        return Hasher_builtin_comp(hash, path1, path2, equals);
+    if (hash->compcoproc)
+        return Hasher_coproc_comp(hash, path1, path2, equals);
+
     pid = fork();
     switch (pid) {
     case -1:
@@ -180,10 +714,20 @@ const char * Hasher_hash_file(const Hasher *hasher, const char *path)
         w = 1,
     };
 
+    Hasher_Scratch *scratch;
     pid_t pid = -1;
     int pipefd[2] = {-1, -1};
     int exit_status;
 
+    if (hasher->builtin_hash)
+        return Hasher_builtin_hash(hasher, path);
+    if (hasher->hashcoproc)
+        return Hasher_coproc_hash(hasher, path);
+
+    scratch = Hasher_scratch(hasher);
+    if (!scratch)
+        return NULL;
+
     if (pipe(pipefd) == -1) {
         warn("pipe");
         goto fail;
@@ -206,7 +750,7 @@ const char * Hasher_hash_file(const Hasher *hasher, const char *path)
         goto fail;
     pipefd[w] = -1;
 
-    if (Hasher_read(hasher, pipefd[r]) == -1)
+    if (Hasher_read(scratch->buffer, pipefd[r]) == -1)
         goto fail;
 
     if (Hasher_wait(pid, &exit_status) || exit_status)
@@ -214,7 +758,7 @@ const char * Hasher_hash_file(const Hasher *hasher, const char *path)
 
     Util_fdclose(&pipefd[r]);
 
-    return hasher->buffer;
+    return scratch->buffer;
     
 fail:
     if (pid > 0)
@@ -224,3 +768,110 @@ fail:
     Util_fdclose(&pipefd[w]);
     return NULL;
 }
+
+int Hasher_hash_files(const Hasher *hasher,
+                      const char * const *paths,
+                      size_t n,
+                      char **digests)
+{
+    for (size_t i = 0; i < n; ++i)
+        digests[i] = NULL;
+
+    if (hasher->builtin_hash)
+        return Hasher_builtin_files(hasher, paths, n, digests);
+
+    for (size_t i = 0; i < n; ++i) {
+        const char *filehash;
+
+        filehash = Hasher_hash_file(hasher, paths[i]);
+        if (!filehash)
+            continue;
+
+        digests[i] = strdup(filehash);
+        if (!digests[i])
+            warn("strdup");
+    }
+    return 0;
+}
+
+const char *Hasher_fast_file(const Hasher *hasher,
+                             const char *path,
+                             char **digest)
+{
+    Hasher_Scratch *scratch = Hasher_scratch(hasher);
+    Stream stream;
+    Murmur3 murmur3;
+    Sha1 sha1;
+    uint8_t key[Murmur3_DIGEST_LENGTH];
+    uint8_t sha1_digest[Sha1_DIGEST_LENGTH];
+    bool streamed = digest && hasher->builtin_hash;
+    const char *data;
+    ssize_t n;
+
+    if (digest)
+        *digest = NULL;
+    if (!scratch)
+        return NULL;
+    if (Stream_open(&stream, hasher->dircache, path, hasher->policy,
+                    scratch->streambuf[0]))
+        return NULL;
+
+    Murmur3_init(&murmur3);
+    if (streamed)
+        Sha1_init(&sha1);
+    while (n = Hasher_stream_read(hasher, &stream, &data), n > 0) {
+        Murmur3_update(&murmur3, data, n);
+        if (streamed)
+            Sha1_update(&sha1, data, n);
+    }
+    Stream_close(&stream);
+
+    if (n == -1)
+        return NULL;
+
+    if (streamed) {
+        Sha1_final(&sha1, sha1_digest);
+        Hasher_set_digest(digest, sha1_digest);
+    }
+
+    Murmur3_final(&murmur3, key);
+    Util_hexlify(key, sizeof(key), scratch->buffer);
+    return scratch->buffer;
+}
+
+int Hasher_fast_files(const Hasher *hasher,
+                      const char * const *paths,
+                      size_t n,
+                      char **keys,
+                      char **digests)
+{
+    for (size_t i = 0; i < n; ++i) {
+        const char *key;
+
+        keys[i] = NULL;
+        key = Hasher_fast_file(hasher, paths[i],
+                               digests ? &digests[i] : NULL);
+        if (!key)
+            continue;
+
+        keys[i] = strdup(key);
+        if (!keys[i])
+            warn("strdup");
+    }
+    return 0;
+}
+
+void Hasher_set_throttle(Hasher *hasher, Throttle *throttle)
+{
+    hasher->throttle = throttle;
+}
+
+void Hasher_set_dircache(Hasher *hasher, DirCache *dircache)
+{
+    hasher->dircache = dircache;
+}
+
+void Hasher_set_resume(Hasher *hasher, Resume *resume)
+{
+    hasher->resume = resume;
+}
@@ -2,14 +2,66 @@
 
 #include <stdbool.h>
 
+#include "resume.h"
+#include "stream.h"
+#include "throttle.h"
+
+// Program name selecting the in-process implementation (SHA-1 for the
+// hasher, byte-wise comparison for the comparer).
+#define Hasher_BUILTIN "builtin"
+
 typedef struct Hasher Hasher;
 
-Hasher *Hasher_new(const char *hashprg, const char *compprg);
+// With a non-zero number of coprocesses, external programs are started
+// once and fed requests (see readme.txt), instead of once per file.
+// With a non-zero queue depth, the builtin hasher reads through io_uring
+// if available.
+Hasher *Hasher_new(const char *hashprg,
+                   const char *compprg,
+                   Stream_Policy policy,
+                   unsigned coprocs,
+                   unsigned depth);
 
 const char * Hasher_hash_file(const Hasher *hash, const char *path);
+
+// Sets digests[i] to the allocated checksum of paths[i], or to NULL if
+// the file could not be hashed.  Files are read in the given order,
+// possibly several at once.
+int Hasher_hash_files(const Hasher *hash,
+                      const char * const *paths,
+                      size_t n,
+                      char **digests);
 int Hasher_comp_files(const Hasher *hash,
                       const char *path1,
                       const char *path2,
                       bool *equals);
 
+// A fast, non cryptographic, 128 bits key of the file contents, always
+// computed in-process.  Files with different keys differ.  If digest is
+// not NULL, the builtin hasher checksums the file in the same read into
+// it (to be freed), other hashers leave it NULL.
+const char *Hasher_fast_file(const Hasher *hash,
+                             const char *path,
+                             char **digest);
+
+// Like Hasher_hash_files, with fast keys.  Checksums go to digests, if
+// not NULL, as with Hasher_fast_file.
+int Hasher_fast_files(const Hasher *hash,
+                      const char * const *paths,
+                      size_t n,
+                      char **keys,
+                      char **digests);
+
+// Throttles the reads of the builtin hasher and comparer, and of the
+// fast keys.  External programs are not.
+void Hasher_set_throttle(Hasher *hash, Throttle *);
+
+// Has the builtin hasher and comparer, and the fast keys, open files
+// under their cached directory.  External programs get whole paths.
+void Hasher_set_dircache(Hasher *hash, DirCache *);
+
+// Has the builtin hasher resume the large files appended to since a
+// previous run.  Files are then not read through io_uring.
+void Hasher_set_resume(Hasher *hash, Resume *);
+
 void Hasher_del(Hasher *hash);
@@ -0,0 +1,783 @@
+#include "index.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "merge.h"
+#include "util.h"
+
+typedef struct {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t path;
+    char digest[];
+} Index_Record;
+
+struct Index {
+    const char *base;
+    size_t length;
+    const Index_Header *header;
+};
+
+typedef struct {
+    char *digest;
+    char *path;
+    uint64_t size;
+    int64_t mtime;
+    size_t seq;
+} Index_WEntry;
+
+struct Index_Writer {
+    Index_WEntry *entries;
+    size_t count;
+    size_t size;
+    char *prefix;           // spilling, if not NULL
+    size_t memcap;
+    size_t memory;
+    char **runs;
+    size_t nruns;
+};
+
+enum {
+    // Estimated allocator overhead of the strings of an entry.
+    Index_OVERHEAD = 32,
+};
+
+void Index_close(Index *index)
+{
+    if (!index)
+        return;
+
+    if (index->base && munmap((void *)index->base, index->length))
+        warn("munmap");
+    free(index);
+}
+
+static
+bool Index_valid(const Index *index, const char *path)
+{
+    const Index_Header *header = index->header;
+
+    if (index->length < sizeof(Index_Header)
+            || memcmp(header->magic, Index_MAGIC, sizeof(header->magic))) {
+        warnx("%s: not an index file", path);
+        return false;
+    }
+
+    if (header->version != Index_VERSION) {
+        warnx("%s: unsupported index version %u", path, header->version);
+        return false;
+    }
+
+    if (header->keylen == 0
+            || header->entsize < sizeof(Index_Record) + header->keylen
+            || header->entries > index->length
+            || header->count > (index->length - header->entries)
+                               / header->entsize
+            || header->strings > index->length
+            || header->strings_size > index->length - header->strings
+            || header->sizes % sizeof(uint64_t)
+            || header->sizes > index->length
+            || header->nsizes > (index->length - header->sizes)
+                                / sizeof(uint64_t)) {
+        warnx("%s: corrupted index", path);
+        return false;
+    }
+
+    return true;
+}
+
+Index *Index_open(const char *path)
+{
+    Index *index;
+    struct stat statbuf;
+    int fd = -1;
+    void *base;
+
+    index = malloc(sizeof(Index));
+    if (!index) {
+        warn("malloc");
+        goto fail;
+    }
+    *index = (Index){};
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        warn("open(%s, ...)", path);
+        goto fail;
+    }
+
+    if (fstat(fd, &statbuf) == -1) {
+        warn("fstat(%s)", path);
+        goto fail;
+    }
+
+    if ((size_t)statbuf.st_size < sizeof(Index_Header)) {
+        warnx("%s: not an index file", path);
+        goto fail;
+    }
+
+    base = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        warn("mmap(%s)", path);
+        goto fail;
+    }
+
+    index->base = base;
+    index->length = statbuf.st_size;
+    index->header = base;
+    if (!Index_valid(index, path))
+        goto fail;
+
+    Util_fdclose(&fd);
+    return index;
+
+fail:
+    Util_fdclose(&fd);
+    Index_close(index);
+    return NULL;
+}
+
+size_t Index_count(const Index *index)
+{
+    return index->header->count;
+}
+
+static
+const Index_Record *Index_record(const Index *index, size_t i)
+{
+    return (const Index_Record *)(index->base
+                                  + index->header->entries
+                                  + i * index->header->entsize);
+}
+
+static
+const char *Index_digest(const Index *index, const Index_Record *record)
+{
+    // The digest is NUL-padded: a full field means a corrupted entry.
+    if (record->digest[index->header->keylen - 1] != '\0')
+        return "";
+    return record->digest;
+}
+
+void Index_entry(const Index *index, size_t i, Index_Entry *entry)
+{
+    const Index_Record *record = Index_record(index, i);
+    const char *strings = index->base + index->header->strings;
+    uint64_t path = record->path;
+
+    *entry = (Index_Entry){
+        .digest = Index_digest(index, record),
+        .path = "",
+        .size = record->size,
+        .mtime = record->mtime,
+    };
+
+    if (path < index->header->strings_size
+            && memchr(strings + path, '\0',
+                      index->header->strings_size - path))
+        entry->path = strings + path;
+}
+
+int Index_find(const Index *index,
+               const char *digest,
+               size_t *first,
+               size_t *count)
+{
+    size_t lo = 0, hi = index->header->count, n;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (strcmp(Index_digest(index, Index_record(index, mid)),
+                   digest) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (n = 0; lo + n < index->header->count; ++n)
+        if (strcmp(Index_digest(index, Index_record(index, lo + n)),
+                   digest))
+            break;
+
+    if (n == 0)
+        return -1;
+
+    *first = lo;
+    *count = n;
+    return 0;
+}
+
+bool Index_has_size(const Index *index, uint64_t size)
+{
+    const uint64_t *sizes;
+    size_t lo = 0, hi = index->header->nsizes;
+
+    sizes = (const uint64_t *)(index->base + index->header->sizes);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (sizes[mid] == size)
+            return true;
+        if (sizes[mid] < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return false;
+}
+
+Index_Writer *Index_Writer_new(void)
+{
+    Index_Writer *writer;
+
+    writer = malloc(sizeof(Index_Writer));
+    if (!writer) {
+        warn("malloc");
+        return NULL;
+    }
+
+    *writer = (Index_Writer){};
+    return writer;
+}
+
+static
+void Index_Writer_clear(Index_Writer *writer)
+{
+    for (size_t i = 0; i < writer->count; ++i) {
+        free(writer->entries[i].digest);
+        free(writer->entries[i].path);
+    }
+    writer->count = 0;
+    writer->memory = 0;
+}
+
+static
+void Index_Writer_drop_runs(Index_Writer *writer)
+{
+    for (size_t i = 0; i < writer->nruns; ++i) {
+        if (unlink(writer->runs[i]))
+            warn("unlink(%s)", writer->runs[i]);
+        free(writer->runs[i]);
+    }
+    free(writer->runs);
+    writer->runs = NULL;
+    writer->nruns = 0;
+}
+
+void Index_Writer_del(Index_Writer *writer)
+{
+    if (!writer)
+        return;
+
+    Index_Writer_clear(writer);
+    Index_Writer_drop_runs(writer);
+    free(writer->entries);
+    free(writer->prefix);
+    free(writer);
+}
+
+int Index_Writer_set_spill(Index_Writer *writer,
+                           const char *prefix,
+                           size_t memcap)
+{
+    free(writer->prefix);
+    writer->prefix = strdup(prefix);
+    if (!writer->prefix) {
+        warn("strdup");
+        return -1;
+    }
+
+    writer->memcap = memcap;
+    return 0;
+}
+
+static int Index_Writer_spill(Index_Writer *);
+
+int Index_Writer_add(Index_Writer *writer,
+                     const char *digest,
+                     const File *file)
+{
+    Index_WEntry *entry;
+
+    if (writer->count == writer->size) {
+        size_t size = writer->size ? writer->size * 2 : 1024;
+        Index_WEntry *entries;
+
+        entries = realloc(writer->entries, size * sizeof(Index_WEntry));
+        if (!entries) {
+            warn("realloc");
+            return -1;
+        }
+        writer->entries = entries;
+        writer->size = size;
+    }
+
+    entry = &writer->entries[writer->count];
+    *entry = (Index_WEntry){
+        .digest = strdup(digest),
+        .path = strdup(file->path),
+        .size = file->size,
+        .mtime = file->mtime,
+        .seq = writer->count,
+    };
+
+    if (!entry->digest || !entry->path) {
+        warn("strdup");
+        free(entry->digest);
+        free(entry->path);
+        return -1;
+    }
+
+    writer->count++;
+    writer->memory += sizeof(Index_WEntry) + strlen(entry->digest)
+                      + strlen(entry->path) + 2 + Index_OVERHEAD;
+
+    if (writer->prefix && writer->memory > writer->memcap)
+        return Index_Writer_spill(writer);
+    return 0;
+}
+
+int Index_Writer_add_index(Index_Writer *writer, const char *path)
+{
+    Index *index;
+    int ex = 0;
+
+    if (access(path, F_OK) && errno == ENOENT)
+        return 0;
+
+    index = Index_open(path);
+    if (!index)
+        return -1;
+
+    for (size_t i = 0; !ex && i < Index_count(index); ++i) {
+        Index_Entry entry;
+
+        Index_entry(index, i, &entry);
+        ex = Index_Writer_add(writer, entry.digest, &(File){
+            .path = entry.path,
+            .size = entry.size,
+            .mtime = entry.mtime,
+        });
+    }
+
+    Index_close(index);
+    return ex;
+}
+
+static
+int Index_Writer_cmp(const void *a, const void *b)
+{
+    const Index_WEntry *e1 = a, *e2 = b;
+    int cmp;
+
+    cmp = strcmp(e1->digest, e2->digest);
+    if (cmp)
+        return cmp;
+    return e1->seq < e2->seq ? -1 : e1->seq > e2->seq;
+}
+
+// Sorts the entries, and drops the ones having the digest and the path
+// of an entry added before.
+static
+void Index_Writer_sort(Index_Writer *writer)
+{
+    size_t group = 0, kept = 0;
+
+    qsort(writer->entries, writer->count, sizeof(Index_WEntry),
+          Index_Writer_cmp);
+
+    for (size_t i = 0; i < writer->count; ++i) {
+        Index_WEntry *entry = &writer->entries[i];
+        bool repeated = false;
+
+        if (kept && strcmp(writer->entries[kept - 1].digest, entry->digest))
+            group = kept;
+        for (size_t j = group; j < kept && !repeated; ++j)
+            repeated = strcmp(writer->entries[j].path, entry->path) == 0;
+
+        if (repeated) {
+            free(entry->digest);
+            free(entry->path);
+        } else {
+            writer->entries[kept++] = *entry;
+        }
+    }
+    writer->count = kept;
+}
+
+// Whether an entry of the group, before the i-th one, has the same path.
+static
+bool Index_repeated(const Index_Entry *entries, size_t i)
+{
+    for (size_t j = 0; j < i; ++j)
+        if (strcmp(entries[j].path, entries[i].path) == 0)
+            return true;
+    return false;
+}
+
+static
+int Index_cmp_size(const void *a, const void *b)
+{
+    uint64_t s1 = *(const uint64_t *)a, s2 = *(const uint64_t *)b;
+
+    return s1 < s2 ? -1 : s1 > s2;
+}
+
+static
+int Index_Writer_dump(const Index_Writer *writer, FILE *out)
+{
+    Index_Header header = {
+        .version = Index_VERSION,
+        .keylen = 1,
+        .count = writer->count,
+        .entries = sizeof(Index_Header),
+    };
+    Index_Record *record;
+    uint64_t *sizes;
+    uint64_t path = 0;
+
+    sizes = malloc((writer->count ? writer->count : 1) * sizeof(uint64_t));
+    if (!sizes) {
+        warn("malloc");
+        return -1;
+    }
+
+    for (size_t i = 0; i < writer->count; ++i) {
+        size_t len = strlen(writer->entries[i].digest) + 1;
+
+        if (len > header.keylen)
+            header.keylen = len;
+        header.strings_size += strlen(writer->entries[i].path) + 1;
+        sizes[i] = writer->entries[i].size;
+    }
+
+    qsort(sizes, writer->count, sizeof(uint64_t), Index_cmp_size);
+    for (size_t i = 0; i < writer->count; ++i)
+        if (header.nsizes == 0 || sizes[header.nsizes - 1] != sizes[i])
+            sizes[header.nsizes++] = sizes[i];
+
+    // Keep entries and sizes 8-bytes aligned.
+    header.entsize = (sizeof(Index_Record) + header.keylen + 7) & ~7ul;
+    header.sizes = header.entries + header.count * header.entsize;
+    header.strings = header.sizes + header.nsizes * sizeof(uint64_t);
+
+    memcpy(header.magic, Index_MAGIC, sizeof(header.magic));
+
+    record = calloc(1, header.entsize);
+    if (!record) {
+        warn("calloc");
+        free(sizes);
+        return -1;
+    }
+
+    fwrite(&header, sizeof(header), 1, out);
+
+    for (size_t i = 0; i < writer->count; ++i) {
+        const Index_WEntry *entry = &writer->entries[i];
+
+        memset(record, 0, header.entsize);
+        record->size = entry->size;
+        record->mtime = entry->mtime;
+        record->path = path;
+        strcpy(record->digest, entry->digest);
+        fwrite(record, header.entsize, 1, out);
+
+        path += strlen(entry->path) + 1;
+    }
+
+    fwrite(sizes, sizeof(uint64_t), header.nsizes, out);
+
+    for (size_t i = 0; i < writer->count; ++i)
+        fwrite(writer->entries[i].path,
+               strlen(writer->entries[i].path) + 1, 1, out);
+
+    free(record);
+    free(sizes);
+    return 0;
+}
+
+// A run is an index of its own, only meant to be merged.
+static
+int Index_Writer_spill(Index_Writer *writer)
+{
+    char number[24];
+    char **runs;
+    char *path;
+    FILE *out;
+
+    runs = realloc(writer->runs, (writer->nruns + 1) * sizeof(char *));
+    if (!runs) {
+        warn("realloc");
+        return -1;
+    }
+    writer->runs = runs;
+
+    snprintf(number, sizeof(number), "%zu", writer->nruns);
+    path = Util_concat(writer->prefix, number, NULL);
+    if (!path)
+        return -1;
+
+    Index_Writer_sort(writer);
+
+    out = fopen(path, "w");
+    if (!out) {
+        warn("fopen(%s, ...)", path);
+        free(path);
+        return -1;
+    }
+
+    // Once the run is listed, the writer takes care of removing it.
+    writer->runs[writer->nruns++] = path;
+
+    if (Index_Writer_dump(writer, out) || fflush(out) || ferror(out)) {
+        warn("write(%s)", path);
+        fclose(out);
+        return -1;
+    }
+
+    if (fclose(out)) {
+        warn("fclose(%s)", path);
+        return -1;
+    }
+
+    Index_Writer_clear(writer);
+    return 0;
+}
+
+// Counts the distinct sizes of the runs, writing them out if asked to.
+static
+uint64_t Index_merge_sizes(Index * const *runs, size_t nruns, FILE *out)
+{
+    size_t *pos;
+    uint64_t nsizes = 0, last = 0;
+
+    pos = calloc(nruns, sizeof(size_t));
+    if (!pos) {
+        warn("calloc");
+        return UINT64_MAX;
+    }
+
+    for (;;) {
+        const uint64_t *sizes;
+        uint64_t min = UINT64_MAX;
+        bool found = false;
+
+        for (size_t i = 0; i < nruns; ++i) {
+            if (pos[i] == runs[i]->header->nsizes)
+                continue;
+
+            sizes = (const uint64_t *)(runs[i]->base
+                                       + runs[i]->header->sizes);
+            if (!found || sizes[pos[i]] < min)
+                min = sizes[pos[i]];
+            found = true;
+        }
+        if (!found)
+            break;
+
+        for (size_t i = 0; i < nruns; ++i) {
+            sizes = (const uint64_t *)(runs[i]->base
+                                       + runs[i]->header->sizes);
+            if (pos[i] < runs[i]->header->nsizes && sizes[pos[i]] == min)
+                pos[i]++;
+        }
+
+        if (nsizes == 0 || min != last) {
+            if (out)
+                fwrite(&min, sizeof(min), 1, out);
+            last = min;
+            nsizes++;
+        }
+    }
+
+    free(pos);
+    return nsizes;
+}
+
+// Entries, sizes and strings are written in three passes over the runs,
+// after one counting the entries kept.
+static
+int Index_dump_runs(Index * const *runs, size_t nruns, FILE *out)
+{
+    Index_Header header = {
+        .version = Index_VERSION,
+        .keylen = 1,
+        .entries = sizeof(Index_Header),
+    };
+    const Index_Entry *entries;
+    Index_Record *record = NULL;
+    Merge *merge = NULL;
+    uint64_t path = 0;
+    size_t count;
+    int ex = -1, e;
+
+    for (size_t i = 0; i < nruns; ++i)
+        if (runs[i]->header->keylen > header.keylen)
+            header.keylen = runs[i]->header->keylen;
+
+    merge = Merge_new(runs, nruns);
+    if (!merge)
+        return -1;
+    while (e = Merge_next(merge, &entries, &count), e == 0 && count)
+        for (size_t i = 0; i < count; ++i)
+            if (!Index_repeated(entries, i)) {
+                header.count++;
+                header.strings_size += strlen(entries[i].path) + 1;
+            }
+    Merge_del(merge);
+    merge = NULL;
+    if (e)
+        return -1;
+
+    header.nsizes = Index_merge_sizes(runs, nruns, NULL);
+    if (header.nsizes == UINT64_MAX)
+        return -1;
+
+    header.entsize = (sizeof(Index_Record) + header.keylen + 7) & ~7ul;
+    header.sizes = header.entries + header.count * header.entsize;
+    header.strings = header.sizes + header.nsizes * sizeof(uint64_t);
+    memcpy(header.magic, Index_MAGIC, sizeof(header.magic));
+
+    record = calloc(1, header.entsize);
+    if (!record) {
+        warn("calloc");
+        return -1;
+    }
+
+    fwrite(&header, sizeof(header), 1, out);
+
+    merge = Merge_new(runs, nruns);
+    if (!merge)
+        goto exit;
+    while (e = Merge_next(merge, &entries, &count), e == 0 && count)
+        for (size_t i = 0; i < count; ++i) {
+            if (Index_repeated(entries, i))
+                continue;
+
+            memset(record, 0, header.entsize);
+            record->size = entries[i].size;
+            record->mtime = entries[i].mtime;
+            record->path = path;
+            strcpy(record->digest, entries[i].digest);
+            fwrite(record, header.entsize, 1, out);
+
+            path += strlen(entries[i].path) + 1;
+        }
+    Merge_del(merge);
+    merge = NULL;
+    if (e)
+        goto exit;
+
+    Index_merge_sizes(runs, nruns, out);
+
+    merge = Merge_new(runs, nruns);
+    if (!merge)
+        goto exit;
+    while (e = Merge_next(merge, &entries, &count), e == 0 && count)
+        for (size_t i = 0; i < count; ++i)
+            if (!Index_repeated(entries, i))
+                fwrite(entries[i].path, strlen(entries[i].path) + 1, 1,
+                       out);
+    if (e)
+        goto exit;
+
+    ex = 0;
+
+exit:
+    Merge_del(merge);
+    free(record);
+    return ex;
+}
+
+static
+int Index_Writer_dump_runs(Index_Writer *writer, FILE *out)
+{
+    Index **runs;
+    int ex = -1;
+
+    if (writer->count && Index_Writer_spill(writer))
+        return -1;
+
+    runs = calloc(writer->nruns, sizeof(Index *));
+    if (!runs) {
+        warn("calloc");
+        return -1;
+    }
+
+    for (size_t i = 0; i < writer->nruns; ++i) {
+        runs[i] = Index_open(writer->runs[i]);
+        if (!runs[i])
+            goto exit;
+    }
+
+    ex = Index_dump_runs(runs, writer->nruns, out);
+
+exit:
+    for (size_t i = 0; i < writer->nruns; ++i)
+        Index_close(runs[i]);
+    free(runs);
+    return ex;
+}
+
+int Index_Writer_write(Index_Writer *writer, const char *path)
+{
+    char *tmppath;
+    FILE *out = NULL;
+
+    if (!writer->nruns)
+        Index_Writer_sort(writer);
+
+    // Write aside and rename, so that readers never see a partial
+    // index.
+    tmppath = Util_concat(path, ".tmp", NULL);
+    if (!tmppath)
+        return -1;
+
+    out = fopen(tmppath, "w");
+    if (!out) {
+        warn("fopen(%s, ...)", tmppath);
+        goto fail;
+    }
+
+    if (writer->nruns ? Index_Writer_dump_runs(writer, out)
+                      : Index_Writer_dump(writer, out))
+        goto fail;
+
+    if (fflush(out) || ferror(out) || fsync(fileno(out))) {
+        warn("write(%s)", tmppath);
+        goto fail;
+    }
+
+    if (fclose(out)) {
+        out = NULL;
+        warn("fclose(%s)", tmppath);
+        goto fail;
+    }
+    out = NULL;
+
+    if (rename(tmppath, path)) {
+        warn("rename(%s, %s)", tmppath, path);
+        goto fail;
+    }
+
+    Index_Writer_drop_runs(writer);
+    free(tmppath);
+    return 0;
+
+fail:
+    if (out)
+        fclose(out);
+    unlink(tmppath);
+    free(tmppath);
+    return -1;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file.h"
+
+// The index is a sorted, memory-mappable catalog file, mapping each
+// digest to the files (size, mtime, path) having it.
+//
+// Layout, in native byte order:
+//
+//   header    Index_Header
+//   entries   count records of entsize bytes each, sorted by digest:
+//             uint64_t size, int64_t mtime, uint64_t path offset, and
+//             the digest, NUL-padded to keylen bytes.
+//   sizes     nsizes distinct uint64_t file sizes, sorted.
+//   strings   NUL-terminated paths, referenced by the path offsets.
+
+#define Index_MAGIC "CATHYIDX"
+#define Index_FILENAME "index"
+
+enum {
+    Index_VERSION = 2,
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t keylen;
+    uint64_t count;
+    uint64_t entsize;
+    uint64_t entries;
+    uint64_t strings;
+    uint64_t strings_size;
+    uint64_t sizes;
+    uint64_t nsizes;
+} Index_Header;
+
+typedef struct {
+    const char *digest;
+    const char *path;
+    uint64_t size;
+    int64_t mtime;
+} Index_Entry;
+
+typedef struct Index Index;
+
+Index *Index_open(const char *path);
+
+size_t Index_count(const Index *);
+
+void Index_entry(const Index *, size_t i, Index_Entry *);
+
+// Yields the position of the first entry having the digest, and the
+// number of such entries.  Returns -1 if there is none.
+int Index_find(const Index *, const char *digest, size_t *first,
+               size_t *count);
+
+// Tells if any of the indexed files has the given size.
+bool Index_has_size(const Index *, uint64_t size);
+
+void Index_close(Index *);
+
+typedef struct Index_Writer Index_Writer;
+
+Index_Writer *Index_Writer_new(void);
+
+// Bounds the memory held by the writer: beyond memcap bytes, the entries
+// are sorted and spilled to run files, named after the prefix followed
+// by a number, and the runs are merged when writing.
+int Index_Writer_set_spill(Index_Writer *, const char *prefix,
+                           size_t memcap);
+
+// Paths and digests are copied.
+int Index_Writer_add(Index_Writer *, const char *digest, const File *);
+
+// Adds the entries of the index at path, if there is one.
+int Index_Writer_add_index(Index_Writer *, const char *path);
+
+// Entries with the same digest keep the order in which they were added,
+// and the ones having the digest and the path of an entry added before
+// are dropped.
+int Index_Writer_write(Index_Writer *, const char *path);
+
+void Index_Writer_del(Index_Writer *);
@@ -0,0 +1,333 @@
+#include "journal.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <uthash.h>
+
+typedef struct {
+    char *path;
+    char *hash;         // NULL unless checksummed
+    off_t size;
+    time_t mtime;
+    bool linked;
+    bool removed;
+    UT_hash_handle hh;
+} Entry;
+
+struct Journal {
+    Entry *entries;     // as recorded by the previous runs
+    FILE *file;
+    pthread_mutex_t lock;       // of the file, for concurrent writers
+    unsigned pending;
+    bool resumed;
+};
+
+enum {
+    Journal_MAXFIELDS = 5,
+};
+
+static
+unsigned Journal_nfields(char type)
+{
+    switch (type) {
+    case 'H':
+        return 5;
+    case 'D':
+        return 3;
+    case 'L':
+    case 'U':
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+static
+Entry *Journal_entry(Journal *journal, const char *path)
+{
+    Entry *entry;
+
+    HASH_FIND_STR(journal->entries, path, entry);
+    if (entry)
+        return entry;
+
+    entry = malloc(sizeof(Entry));
+    if (!entry) {
+        warn("malloc");
+        return NULL;
+    }
+
+    *entry = (Entry){
+        .path = strdup(path),
+    };
+    if (!entry->path) {
+        warn("strdup");
+        free(entry);
+        return NULL;
+    }
+
+    HASH_ADD_KEYPTR(hh, journal->entries, entry->path, strlen(entry->path),
+                    entry);
+    return entry;
+}
+
+static
+int Journal_apply(Journal *journal, char * const *fields)
+{
+    Entry *entry;
+
+    entry = Journal_entry(journal, fields[1]);
+    if (!entry)
+        return -1;
+
+    switch (fields[0][0]) {
+    case 'H':
+        free(entry->hash);
+        entry->hash = strdup(fields[4]);
+        if (!entry->hash) {
+            warn("strdup");
+            return -1;
+        }
+        entry->size = strtoll(fields[2], NULL, 10);
+        entry->mtime = strtoll(fields[3], NULL, 10);
+        break;
+    case 'D':
+    case 'U':
+        entry->removed = true;
+        break;
+    case 'L':
+        entry->linked = true;
+        break;
+    }
+    return 0;
+}
+
+static
+int Journal_load(Journal *journal, const char *path)
+{
+    char *fields[Journal_MAXFIELDS] = {};
+    size_t sizes[Journal_MAXFIELDS] = {};
+    unsigned nfields = 0, expected = 0;
+    off_t end = 0;
+    ssize_t len;
+    int ex = -1;
+
+    rewind(journal->file);
+    while (len = getdelim(&fields[nfields], &sizes[nfields], '\0',
+                          journal->file),
+           len > 0 && fields[nfields][len - 1] == '\0') {
+        if (nfields == 0) {
+            expected = len == 2 ? Journal_nfields(fields[0][0]) : 0;
+            if (!expected) {
+                warnx("%s: corrupt journal", path);
+                goto exit;
+            }
+        }
+
+        if (++nfields < expected)
+            continue;
+
+        if (Journal_apply(journal, fields))
+            goto exit;
+        journal->resumed = true;
+        nfields = 0;
+        end = ftello(journal->file);
+    }
+
+    if (ferror(journal->file)) {
+        warn("getdelim(%s)", path);
+        goto exit;
+    }
+
+    // Drop the record truncated by a crash, if any, so that the new ones
+    // are appended after the last complete one.
+    if (fseeko(journal->file, 0, SEEK_END) || ftello(journal->file) != end) {
+        if (ftruncate(fileno(journal->file), end)) {
+            warn("ftruncate(%s)", path);
+            goto exit;
+        }
+        warnx("%s: truncated record discarded", path);
+    }
+    ex = 0;
+
+exit:
+    for (unsigned i = 0; i < Journal_MAXFIELDS; ++i)
+        free(fields[i]);
+    return ex;
+}
+
+void Journal_del(Journal *journal)
+{
+    Entry *entry, *tmp;
+
+    if (!journal)
+        return;
+
+    if (journal->file) {
+        if (journal->pending)
+            Journal_sync(journal);
+        if (fclose(journal->file))
+            warn("fclose");
+    }
+
+    HASH_ITER(hh, journal->entries, entry, tmp) {
+        HASH_DEL(journal->entries, entry);
+        free(entry->path);
+        free(entry->hash);
+        free(entry);
+    }
+    pthread_mutex_destroy(&journal->lock);
+    free(journal);
+}
+
+Journal *Journal_open(const char *path)
+{
+    Journal *journal;
+
+    journal = malloc(sizeof(Journal));
+    if (!journal) {
+        warn("malloc");
+        goto fail;
+    }
+    *journal = (Journal){};
+    pthread_mutex_init(&journal->lock, NULL);
+
+    journal->file = fopen(path, "a+");
+    if (!journal->file) {
+        warn("fopen(%s)", path);
+        goto fail;
+    }
+
+    if (Journal_load(journal, path))
+        goto fail;
+
+    return journal;
+
+fail:
+    Journal_del(journal);
+    return NULL;
+}
+
+bool Journal_resumed(const Journal *journal)
+{
+    return journal->resumed;
+}
+
+static
+const Entry *Journal_find(const Journal *journal, const char *path)
+{
+    Entry *entries = journal->entries, *entry;
+
+    HASH_FIND_STR(entries, path, entry);
+    return entry;
+}
+
+const char *Journal_find_hash(const Journal *journal, const File *file)
+{
+    const Entry *entry = Journal_find(journal, file->path);
+
+    if (!entry || !entry->hash || entry->size != file->size
+            || entry->mtime != file->mtime)
+        return NULL;
+    return entry->hash;
+}
+
+bool Journal_is_linked(const Journal *journal, const char *path)
+{
+    const Entry *entry = Journal_find(journal, path);
+
+    return entry && entry->linked;
+}
+
+bool Journal_is_removed(const Journal *journal, const char *path)
+{
+    const Entry *entry = Journal_find(journal, path);
+
+    return entry && entry->removed;
+}
+
+static
+int Journal_flush(Journal *journal)
+{
+    journal->pending = 0;
+
+    if (fflush(journal->file) == EOF) {
+        warn("fflush");
+        return -1;
+    }
+    if (fdatasync(fileno(journal->file))) {
+        warn("fdatasync");
+        return -1;
+    }
+    return 0;
+}
+
+int Journal_sync(Journal *journal)
+{
+    int ex;
+
+    pthread_mutex_lock(&journal->lock);
+    ex = Journal_flush(journal);
+    pthread_mutex_unlock(&journal->lock);
+    return ex;
+}
+
+static
+int Journal_write(Journal *journal, const char * const *fields, unsigned n)
+{
+    int ex = -1;
+
+    pthread_mutex_lock(&journal->lock);
+    for (unsigned i = 0; i < n; ++i)
+        if (fputs(fields[i], journal->file) == EOF
+                || fputc('\0', journal->file) == EOF) {
+            warn("cannot write the journal");
+            goto exit;
+        }
+
+    ex = ++journal->pending >= Journal_BATCH ? Journal_flush(journal) : 0;
+
+exit:
+    pthread_mutex_unlock(&journal->lock);
+    return ex;
+}
+
+int Journal_add_hash(Journal *journal, const File *file, const char *hash)
+{
+    const char *known;
+    char size[24], mtime[24];
+
+    known = Journal_find_hash(journal, file);
+    if (known && strcmp(known, hash) == 0)
+        return 0;
+
+    snprintf(size, sizeof(size), "%jd", (intmax_t)file->size);
+    snprintf(mtime, sizeof(mtime), "%jd", (intmax_t)file->mtime);
+    return Journal_write(journal,
+                         (const char *[]){"H", file->path, size, mtime, hash},
+                         5);
+}
+
+int Journal_add_duplicate(Journal *journal,
+                          const File *file,
+                          const File *kept)
+{
+    return Journal_write(journal,
+                         (const char *[]){"D", file->path, kept->path},
+                         3);
+}
+
+int Journal_add_link(Journal *journal, const char *path)
+{
+    return Journal_write(journal, (const char *[]){"L", path}, 2);
+}
+
+int Journal_add_unlink(Journal *journal, const char *path)
+{
+    return Journal_write(journal, (const char *[]){"U", path}, 2);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "file.h"
+
+// Append-only record of the progress of a run: checksummed files,
+// duplicate decisions, links created and files unlinked.  A run given
+// the journal of an interrupted one skips the work already done.
+//
+// Records are sequences of NUL-terminated fields, the first one being
+// the record type:
+//
+//  H path size mtime checksum
+//  D path kept_path            (path is a duplicate, to be removed)
+//  L path                      (path is linked in by-hash and by-time)
+//  U path                      (path was unlinked)
+//
+// The journal is synced every Journal_BATCH records, and before files
+// are unlinked.  A record truncated by a crash is discarded.
+
+enum {
+    Journal_BATCH = 1024,
+};
+
+typedef struct Journal Journal;
+
+Journal *Journal_open(const char *path);
+
+// Whether the journal had records of a previous run.
+bool Journal_resumed(const Journal *);
+
+// The recorded checksum of the file, if its size and modification time
+// did not change since.
+const char *Journal_find_hash(const Journal *, const File *);
+
+bool Journal_is_linked(const Journal *, const char *path);
+
+// Whether the file was found a duplicate (and possibly unlinked).
+bool Journal_is_removed(const Journal *, const char *path);
+
+int Journal_add_hash(Journal *, const File *, const char *hash);
+int Journal_add_duplicate(Journal *, const File *, const File *kept);
+int Journal_add_link(Journal *, const char *path);
+int Journal_add_unlink(Journal *, const char *path);
+
+int Journal_sync(Journal *);
+
+void Journal_del(Journal *);
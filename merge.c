@@ -0,0 +1,158 @@
+#include "merge.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The cursors are kept in a binary min-heap, ordered by the digest of
+// their current entry, then by index position.
+
+typedef struct {
+    const Index *index;
+    size_t source;
+    size_t pos;
+    Index_Entry entry;
+} Cursor;
+
+struct Merge {
+    Cursor *cursors;
+    Cursor **heap;
+    size_t heapsize;
+    Index_Entry *group;
+    size_t groupsize;
+};
+
+void Merge_del(Merge *merge)
+{
+    if (!merge)
+        return;
+
+    free(merge->cursors);
+    free(merge->heap);
+    free(merge->group);
+    free(merge);
+}
+
+static
+bool Cursor_less(const Cursor *c1, const Cursor *c2)
+{
+    int cmp = strcmp(c1->entry.digest, c2->entry.digest);
+
+    return cmp < 0 || (cmp == 0 && c1->source < c2->source);
+}
+
+static
+void Merge_sift_down(Merge *merge, size_t i)
+{
+    for (;;) {
+        size_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+        Cursor *tmp;
+
+        if (l < merge->heapsize
+                && Cursor_less(merge->heap[l], merge->heap[min]))
+            min = l;
+        if (r < merge->heapsize
+                && Cursor_less(merge->heap[r], merge->heap[min]))
+            min = r;
+        if (min == i)
+            return;
+
+        tmp = merge->heap[i];
+        merge->heap[i] = merge->heap[min];
+        merge->heap[min] = tmp;
+        i = min;
+    }
+}
+
+Merge *Merge_new(Index * const *indexes, size_t nindexes)
+{
+    Merge *merge;
+
+    merge = malloc(sizeof(Merge));
+    if (!merge) {
+        warn("malloc");
+        goto fail;
+    }
+    *merge = (Merge){};
+
+    merge->cursors = calloc(nindexes ? nindexes : 1, sizeof(Cursor));
+    merge->heap = calloc(nindexes ? nindexes : 1, sizeof(Cursor *));
+    if (!merge->cursors || !merge->heap) {
+        warn("calloc");
+        goto fail;
+    }
+
+    for (size_t i = 0; i < nindexes; ++i) {
+        Cursor *cursor = &merge->cursors[i];
+
+        if (Index_count(indexes[i]) == 0)
+            continue;
+
+        *cursor = (Cursor){
+            .index = indexes[i],
+            .source = i,
+        };
+        Index_entry(cursor->index, 0, &cursor->entry);
+        merge->heap[merge->heapsize++] = cursor;
+    }
+
+    for (size_t i = merge->heapsize / 2; i-- > 0;)
+        Merge_sift_down(merge, i);
+
+    return merge;
+
+fail:
+    Merge_del(merge);
+    return NULL;
+}
+
+static
+int Merge_collect(Merge *merge, size_t *count, const Index_Entry *entry)
+{
+    if (*count == merge->groupsize) {
+        size_t size = merge->groupsize ? merge->groupsize * 2 : 16;
+        Index_Entry *group;
+
+        group = realloc(merge->group, size * sizeof(Index_Entry));
+        if (!group) {
+            warn("realloc");
+            return -1;
+        }
+        merge->group = group;
+        merge->groupsize = size;
+    }
+
+    merge->group[(*count)++] = *entry;
+    return 0;
+}
+
+int Merge_next(Merge *merge, const Index_Entry **entries, size_t *count)
+{
+    const char *digest;
+
+    *count = 0;
+    *entries = merge->group;
+    if (merge->heapsize == 0)
+        return 0;
+
+    // Entry strings point to the mapped indexes, so they stay valid
+    // while cursors move on.
+    digest = merge->heap[0]->entry.digest;
+
+    while (merge->heapsize
+            && strcmp(merge->heap[0]->entry.digest, digest) == 0) {
+        Cursor *cursor = merge->heap[0];
+
+        if (Merge_collect(merge, count, &cursor->entry))
+            return -1;
+
+        if (++cursor->pos < Index_count(cursor->index))
+            Index_entry(cursor->index, cursor->pos, &cursor->entry);
+        else
+            merge->heap[0] = merge->heap[--merge->heapsize];
+        Merge_sift_down(merge, 0);
+    }
+
+    *entries = merge->group;
+    return 0;
+}
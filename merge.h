@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "index.h"
+
+// K-way merge of indexes (e.g. the partial catalogs of sharded runs).
+// The indexes must stay open while merging.
+
+typedef struct Merge Merge;
+
+Merge *Merge_new(Index * const *indexes, size_t nindexes);
+
+// Yields all the entries having the next digest, in the order of the
+// indexes, and of the entries within each index.  The count is 0 at
+// the end.
+int Merge_next(Merge *, const Index_Entry **entries, size_t *count);
+
+void Merge_del(Merge *);
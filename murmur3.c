@@ -0,0 +1,130 @@
+#include "murmur3.h"
+
+#include <string.h>
+
+#define rol64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static const uint64_t c1 = 0x87c37b91114253d5;
+static const uint64_t c2 = 0x4cf5ad432745937f;
+
+static
+uint64_t load_le64(const uint8_t *p)
+{
+    uint64_t v = 0;
+
+    for (int i = 7; i >= 0; --i)
+        v = v << 8 | p[i];
+    return v;
+}
+
+static
+void store_be64(uint8_t *p, uint64_t v)
+{
+    for (int i = 7; i >= 0; --i, v >>= 8)
+        p[i] = v;
+}
+
+static
+uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccd;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53;
+    k ^= k >> 33;
+    return k;
+}
+
+static
+void Murmur3_block(Murmur3 *m, const uint8_t *block)
+{
+    uint64_t k1 = load_le64(block);
+    uint64_t k2 = load_le64(block + 8);
+
+    k1 *= c1;
+    k1 = rol64(k1, 31);
+    k1 *= c2;
+    m->h1 ^= k1;
+
+    m->h1 = rol64(m->h1, 27);
+    m->h1 += m->h2;
+    m->h1 = m->h1 * 5 + 0x52dce729;
+
+    k2 *= c2;
+    k2 = rol64(k2, 33);
+    k2 *= c1;
+    m->h2 ^= k2;
+
+    m->h2 = rol64(m->h2, 31);
+    m->h2 += m->h1;
+    m->h2 = m->h2 * 5 + 0x38495ab5;
+}
+
+void Murmur3_init(Murmur3 *m)
+{
+    *m = (Murmur3){};
+}
+
+void Murmur3_update(Murmur3 *m, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    size_t used = m->length % Murmur3_BLOCK_LENGTH;
+
+    m->length += len;
+
+    if (used) {
+        size_t room = Murmur3_BLOCK_LENGTH - used;
+
+        if (len < room) {
+            memcpy(m->block + used, bytes, len);
+            return;
+        }
+        memcpy(m->block + used, bytes, room);
+        Murmur3_block(m, m->block);
+        bytes += room;
+        len -= room;
+    }
+
+    for (; len >= Murmur3_BLOCK_LENGTH; len -= Murmur3_BLOCK_LENGTH) {
+        Murmur3_block(m, bytes);
+        bytes += Murmur3_BLOCK_LENGTH;
+    }
+
+    memcpy(m->block, bytes, len);
+}
+
+void Murmur3_final(Murmur3 *m, uint8_t digest[Murmur3_DIGEST_LENGTH])
+{
+    size_t used = m->length % Murmur3_BLOCK_LENGTH;
+    uint64_t k1, k2;
+
+    // The tail is read as a zero-padded block.
+    memset(m->block + used, 0, Murmur3_BLOCK_LENGTH - used);
+    k1 = load_le64(m->block);
+    k2 = load_le64(m->block + 8);
+
+    if (used > 8) {
+        k2 *= c2;
+        k2 = rol64(k2, 33);
+        k2 *= c1;
+        m->h2 ^= k2;
+    }
+    if (used) {
+        k1 *= c1;
+        k1 = rol64(k1, 31);
+        k1 *= c2;
+        m->h1 ^= k1;
+    }
+
+    m->h1 ^= m->length;
+    m->h2 ^= m->length;
+    m->h1 += m->h2;
+    m->h2 += m->h1;
+    m->h1 = fmix64(m->h1);
+    m->h2 = fmix64(m->h2);
+    m->h1 += m->h2;
+    m->h2 += m->h1;
+
+    store_be64(digest, m->h1);
+    store_be64(digest + 8, m->h2);
+}
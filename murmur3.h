@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// MurmurHash3, x64 128 bits variant (seed 0): fast, not cryptographic.
+
+enum {
+    Murmur3_DIGEST_LENGTH = 16,
+    Murmur3_BLOCK_LENGTH = 16,
+};
+
+typedef struct {
+    uint64_t h1;
+    uint64_t h2;
+    uint64_t length;
+    uint8_t block[Murmur3_BLOCK_LENGTH];
+} Murmur3;
+
+void Murmur3_init(Murmur3 *);
+
+void Murmur3_update(Murmur3 *, const void *data, size_t len);
+
+void Murmur3_final(Murmur3 *, uint8_t digest[Murmur3_DIGEST_LENGTH]);
@@ -12,25 +12,107 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#include <uthash.h>
 
 #include "util.h"
 
+typedef struct {
+    char *target;
+    UT_hash_handle hh;
+} OutDir_Target;
+
+// When relinking, the targets of the links of a by-time directory, read
+// at once: looking for each target in turn would read the directory
+// as many times.  By-hash directories only have the links of copies.
+typedef struct {
+    ino_t ino;
+    OutDir_Target *targets;
+    UT_hash_handle hh;
+} OutDir_Links;
+
 struct OutDir {
     int hashdir;
     int timedir;
+    OutDir_Layout layout;
+    OutDir_Links *links;
 };
 
-enum {
-    OutDir_PREFIX = 2,
+#define OutDir_LAYOUT_FILE ".layout"
+
+// Catalogs without a layout file have a single level of 2 characters,
+// under which older versions dropped the last character of the hash.
+static const OutDir_Layout OutDir_LEGACY = {
+    .nlevels = 1,
+    .widths = {2},
+    .legacy = true,
 };
 
+int OutDir_parse_layout(const char *spec, OutDir_Layout *layout)
+{
+    const char *c = spec;
+
+    *layout = (OutDir_Layout){};
+    for (;;) {
+        if (layout->nlevels == OutDir_MAXLEVELS
+                || *c < '1' || *c > '0' + OutDir_MAXWIDTH)
+            goto fail;
+        layout->widths[layout->nlevels++] = *c++ - '0';
+
+        if (*c == '\0')
+            return 0;
+        if (*c++ != '/')
+            goto fail;
+    }
+
+fail:
+    warnx("invalid layout: '%s'", spec);
+    *layout = (OutDir_Layout){};
+    return -1;
+}
+
+static
+void OutDir_format_layout(const OutDir_Layout *layout,
+                          char buffer[2 * OutDir_MAXLEVELS])
+{
+    for (unsigned i = 0; i < layout->nlevels; ++i) {
+        *buffer++ = '0' + layout->widths[i];
+        *buffer++ = i + 1 < layout->nlevels ? '/' : '\0';
+    }
+}
+
+static
+bool OutDir_same_layout(const OutDir_Layout *l1, const OutDir_Layout *l2)
+{
+    return l1->nlevels == l2->nlevels && l1->legacy == l2->legacy
+        && memcmp(l1->widths, l2->widths, l1->nlevels) == 0;
+}
+
+static
+void OutDir_Links_del(OutDir_Links *links)
+{
+    OutDir_Target *target, *tmp;
+
+    HASH_ITER(hh, links->targets, target, tmp) {
+        HASH_DEL(links->targets, target);
+        free(target->target);
+        free(target);
+    }
+    free(links);
+}
+
 void OutDir_del(OutDir *outdir)
 {
+    OutDir_Links *links, *tmp;
+
     if (!outdir)
         return;
 
     Util_fdclose(&outdir->hashdir);
     Util_fdclose(&outdir->timedir);
+    HASH_ITER(hh, outdir->links, links, tmp) {
+        HASH_DEL(outdir->links, links);
+        OutDir_Links_del(links);
+    }
     free(outdir);
 }
 
@@ -44,7 +126,92 @@ int OutDir_mkdir(int dirfd, const char *path)
     return 0;
 }
 
-OutDir *OutDir_new(const char *path)
+static
+bool OutDir_is_empty(int dirfd, const char *path)
+{
+    DIR *dir;
+    struct dirent *entry;
+    bool empty = true;
+
+    dirfd = openat(dirfd, path, O_RDONLY | O_DIRECTORY);
+    if (dirfd == -1)
+        return true;
+
+    dir = fdopendir(dirfd);
+    if (!dir) {
+        warn("fdopendir");
+        Util_fdclose(&dirfd);
+        return false;
+    }
+
+    while (empty && (entry = readdir(dir)))
+        empty = strcmp(entry->d_name, ".") == 0
+            || strcmp(entry->d_name, "..") == 0;
+
+    if (closedir(dir))
+        warn("closedir");
+    return empty;
+}
+
+// The layout of the catalog is the one of its layout file, or the
+// legacy one if it has links already.  A new catalog takes the
+// requested layout, if any.
+static
+int OutDir_open_layout(OutDir *outdir,
+                       int basedir,
+                       const char *path,
+                       const OutDir_Layout *requested)
+{
+    char buffer[2 * OutDir_MAXLEVELS + 1] = {};
+    ssize_t len;
+    int fd;
+
+    if (requested && !requested->nlevels)
+        requested = NULL;
+
+    fd = openat(basedir, OutDir_LAYOUT_FILE, O_RDONLY);
+    if (fd != -1) {
+        len = read(fd, buffer, sizeof(buffer) - 1);
+        Util_fdclose(&fd);
+        if (len > 0 && buffer[len - 1] == '\n')
+            buffer[len - 1] = '\0';
+        if (len == -1 || OutDir_parse_layout(buffer, &outdir->layout)) {
+            warnx("%s: unreadable " OutDir_LAYOUT_FILE, path);
+            return -1;
+        }
+    } else if (errno != ENOENT) {
+        warn("openat(%s/" OutDir_LAYOUT_FILE ")", path);
+        return -1;
+    } else if (!requested || !OutDir_is_empty(basedir, "by-hash")) {
+        outdir->layout = OutDir_LEGACY;
+    }
+
+    if (outdir->layout.nlevels) {
+        if (requested && !OutDir_same_layout(requested, &outdir->layout)) {
+            warnx("%s: the catalog has a different layout", path);
+            return -1;
+        }
+        return 0;
+    }
+
+    outdir->layout = *requested;
+    OutDir_format_layout(requested, buffer);
+    strcat(buffer, "\n");
+
+    fd = openat(basedir, OutDir_LAYOUT_FILE, O_WRONLY | O_CREAT | O_EXCL,
+                0666);
+    if (fd == -1) {
+        warn("openat(%s/" OutDir_LAYOUT_FILE ")", path);
+        return -1;
+    }
+    len = write(fd, buffer, strlen(buffer));
+    if (len != (ssize_t)strlen(buffer))
+        warn("write(%s/" OutDir_LAYOUT_FILE ")", path);
+    Util_fdclose(&fd);
+    return len == (ssize_t)strlen(buffer) ? 0 : -1;
+}
+
+OutDir *OutDir_new(const char *path, const OutDir_Layout *layout)
 {
     int basedir = -1;
     OutDir *outdir;
@@ -67,6 +234,9 @@ OutDir *OutDir_new(const char *path)
     if (basedir == -1)
         goto fail;
 
+    if (OutDir_open_layout(outdir, basedir, path, layout))
+        goto fail;
+
     if (OutDir_mkdir(basedir, "by-hash") == -1)
         goto fail;
     outdir->hashdir = openat(basedir, "by-hash", O_DIRECTORY);
@@ -88,32 +258,57 @@ fail:
     return NULL;
 }
 
+// Levels are separated by slashes in the buffer: the last one is the
+// directory of the hash.
+static
+int OutDir_hash_name(const OutDir *outdir,
+                     const char *hash,
+                     char buffer[PATH_MAX])
+{
+    const OutDir_Layout *layout = &outdir->layout;
+    size_t hashlen, prefix = 0;
+
+    hashlen = strlen(hash);
+    for (unsigned i = 0; i < layout->nlevels; ++i)
+        prefix += layout->widths[i];
+    if (hashlen <= prefix || hashlen + layout->nlevels > PATH_MAX - 1)
+        return -1;
+    if (layout->legacy)
+        --hashlen;
+
+    for (unsigned i = 0; i < layout->nlevels; ++i) {
+        memcpy(buffer, hash, layout->widths[i]);
+        buffer += layout->widths[i];
+        hash += layout->widths[i];
+        hashlen -= layout->widths[i];
+        *buffer++ = '/';
+    }
+    memcpy(buffer, hash, hashlen);
+    buffer[hashlen] = '\0';
+    return 0;
+}
+
 static
 int OutDir_hash_path(const OutDir *outdir,
                      const OutDir_LinkInfo *linkinfo)
 {
     char buffer[PATH_MAX];
-    size_t hashlen;
+    char *slash;
     int dirfd;
 
-    hashlen = strlen(linkinfo->hash);
-    if (hashlen < OutDir_PREFIX || hashlen > sizeof(buffer) - 1) {
+    if (OutDir_hash_name(outdir, linkinfo->hash, buffer)) {
         warnx("hash for '%s' has unexpected length, %zu bytes",
               linkinfo->path,
-              hashlen);
+              strlen(linkinfo->hash));
         return -1;
     }
 
-    memcpy(buffer, linkinfo->hash, OutDir_PREFIX);
-    buffer[OutDir_PREFIX] = '\0';
-    if (OutDir_mkdir(outdir->hashdir, buffer))
-        return -1;
+    for (slash = buffer; slash = strchr(slash, '/'), slash; *slash++ = '/') {
+        *slash = '\0';
+        if (OutDir_mkdir(outdir->hashdir, buffer))
+            return -1;
+    }
 
-    buffer[OutDir_PREFIX] = '/';
-    memcpy(buffer + OutDir_PREFIX + 1,
-           linkinfo->hash + OutDir_PREFIX,
-           hashlen - OutDir_PREFIX - 1);
-    buffer[hashlen] = '\0';
     if (OutDir_mkdir(outdir->hashdir, buffer))
         return -1;
 
@@ -123,12 +318,21 @@ int OutDir_hash_path(const OutDir *outdir,
     return dirfd;
 }
 
-static
-int OutDir_time_path(const OutDir *outdir,
-                     const OutDir_LinkInfo *linkinfo)
+bool OutDir_has_hash(const OutDir *outdir, const char *hash)
 {
     char buffer[PATH_MAX];
-    int dirfd;
+    struct stat statbuf;
+
+    if (OutDir_hash_name(outdir, hash, buffer))
+        return false;
+
+    return fstatat(outdir->hashdir, buffer, &statbuf, 0) == 0
+        && S_ISDIR(statbuf.st_mode);
+}
+
+static
+int OutDir_time_name(const OutDir_LinkInfo *linkinfo, char buffer[PATH_MAX])
+{
     struct tm tm;
 
     if (gmtime_r(&linkinfo->mtime, &tm) == NULL) {
@@ -136,10 +340,22 @@ int OutDir_time_path(const OutDir *outdir,
         return -1;
     }
 
-    if (strftime(buffer, sizeof(buffer), "%Y/%m/%d", &tm) == 0) {
+    if (strftime(buffer, PATH_MAX, "%Y/%m/%d", &tm) == 0) {
         warnx("strftime failed");
         return -1;
     }
+    return 0;
+}
+
+static
+int OutDir_time_path(const OutDir *outdir,
+                     const OutDir_LinkInfo *linkinfo)
+{
+    char buffer[PATH_MAX];
+    int dirfd;
+
+    if (OutDir_time_name(linkinfo, buffer))
+        return -1;
 
     buffer[4] = '\0';
     if (OutDir_mkdir(outdir->timedir, buffer))
@@ -204,36 +420,187 @@ int OutDir_link_under(int dirfd, const char *target)
     if (links_count == -1)
         return -1;
 
-    snprintf(
-        linkname,
-        sizeof(linkname),
-        "%.*d",
-        OutDir_PREFIX - 1,
-        links_count);
+    for (;;) {
+        snprintf(linkname, sizeof(linkname), "%d", links_count);
+
+        if (symlinkat(target, dirfd, linkname) == 0)
+            return 0;
+
+        if (errno != EEXIST) {
+            warn("symlinkat(%s, %d, %s)", target, dirfd, linkname);
+            return -1;
+        }
+
+        // Someone else linked under the same directory meanwhile.
+        ++links_count;
+    }
+}
 
-    if (symlinkat(target, dirfd, linkname)) {
-        warn("symlinkat(%s, %d, %s)", target, dirfd, linkname);
+static
+int OutDir_find_link(int dirfd, const char *target)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char buffer[PATH_MAX];
+    ssize_t len;
+    int result = 0;
+
+    dirfd = dup(dirfd);
+    if (dirfd == -1) {
+        warn("dup");
         return -1;
     }
 
-    return 0;
+    dir = fdopendir(dirfd);
+    if (!dir) {
+        warn("fdopendir");
+        Util_fdclose(&dirfd);
+        return -1;
+    }
+
+    while (errno = 0, !result && (entry = readdir(dir))) {
+        if (entry->d_type != DT_LNK)
+            continue;
+
+        len = readlinkat(dirfd, entry->d_name, buffer, sizeof(buffer));
+        result = len != -1 && (size_t)len == strlen(target)
+            && memcmp(buffer, target, len) == 0;
+    }
+
+    if (errno) {
+        warn("readdir");
+        result = -1;
+    }
+    if (closedir(dir))
+        warn("closedir");
+
+    return result;
 }
 
-int OutDir_link(const OutDir *outdir, const OutDir_LinkInfo *linkinfo)
+static
+int OutDir_read_links(int dirfd, OutDir_Links *links)
 {
-    int dirfd = -1, ex = -1;
+    DIR *dir;
+    struct dirent *entry;
+    char buffer[PATH_MAX];
+    OutDir_Target *target;
+    ssize_t len;
+    int ex = 0;
+
+    dirfd = dup(dirfd);
+    if (dirfd == -1) {
+        warn("dup");
+        return -1;
+    }
+
+    dir = fdopendir(dirfd);
+    if (!dir) {
+        warn("fdopendir");
+        Util_fdclose(&dirfd);
+        return -1;
+    }
+
+    while (errno = 0, !ex && (entry = readdir(dir))) {
+        if (entry->d_type != DT_LNK)
+            continue;
+
+        len = readlinkat(dirfd, entry->d_name, buffer, sizeof(buffer) - 1);
+        if (len == -1)
+            continue;
+        buffer[len] = '\0';
+
+        HASH_FIND_STR(links->targets, buffer, target);
+        if (target)
+            continue;
+
+        target = malloc(sizeof(OutDir_Target));
+        if (!target) {
+            warn("malloc");
+            ex = -1;
+            break;
+        }
+
+        target->target = strdup(buffer);
+        if (!target->target) {
+            warn("strdup");
+            free(target);
+            ex = -1;
+            break;
+        }
+        HASH_ADD_KEYPTR(hh, links->targets, target->target, len, target);
+    }
+
+    if (!ex && errno) {
+        warn("readdir");
+        ex = -1;
+    }
+    if (closedir(dir))
+        warn("closedir");
+
+    return ex;
+}
+
+// As OutDir_find_link, with the links of the directory read once.
+static
+int OutDir_find_time_link(OutDir_Links **head, int dirfd, const char *target)
+{
+    OutDir_Links *links;
+    OutDir_Target *found;
+    struct stat statbuf;
+
+    if (fstat(dirfd, &statbuf)) {
+        warn("fstat");
+        return -1;
+    }
+
+    HASH_FIND(hh, *head, &statbuf.st_ino, sizeof(ino_t), links);
+    if (!links) {
+        links = malloc(sizeof(OutDir_Links));
+        if (!links) {
+            warn("malloc");
+            return -1;
+        }
+
+        *links = (OutDir_Links){
+            .ino = statbuf.st_ino,
+        };
+        if (OutDir_read_links(dirfd, links)) {
+            OutDir_Links_del(links);
+            return -1;
+        }
+        HASH_ADD(hh, *head, ino, sizeof(ino_t), links);
+    }
+
+    HASH_FIND_STR(links->targets, target, found);
+    return found != NULL;
+}
+
+// When relinking, the links already there are found, those of the
+// by-time directories through the table given.
+static
+int OutDir_link_paths(const OutDir *outdir,
+                      const OutDir_LinkInfo *linkinfo,
+                      OutDir_Links **relink)
+{
+    int dirfd = -1, ex = -1, found = 0;
 
     dirfd = OutDir_hash_path(outdir, linkinfo);
     if (dirfd == -1)
         goto exit;
-    if (OutDir_link_under(dirfd, linkinfo->path))
+    if (relink)
+        found = OutDir_find_link(dirfd, linkinfo->path);
+    if (found == -1 || (!found && OutDir_link_under(dirfd, linkinfo->path)))
         goto exit;
 
     Util_fdclose(&dirfd);
     dirfd = OutDir_time_path(outdir, linkinfo);
     if (dirfd == -1)
         goto exit;
-    if (OutDir_link_under(dirfd, linkinfo->path))
+    // The by-time link is made after the by-hash one: it cannot exist if
+    // the by-hash one does not.
+    if (found)
+        found = OutDir_find_time_link(relink, dirfd, linkinfo->path);
+    if (found == -1 || (!found && OutDir_link_under(dirfd, linkinfo->path)))
         goto exit;
 
     ex = 0;
@@ -241,3 +608,88 @@ exit:
     Util_fdclose(&dirfd);
     return ex;
 }
+
+// Removes the links to the target under the directory, if it exists.
+static
+int OutDir_unlink_under(int parentfd, const char *path, const char *target)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char buffer[PATH_MAX];
+    ssize_t len;
+    int dirfd, ex = 0;
+
+    dirfd = openat(parentfd, path, O_RDONLY | O_DIRECTORY);
+    if (dirfd == -1) {
+        if (errno == ENOENT)
+            return 0;
+        warn("openat(%d, %s, O_DIRECTORY)", parentfd, path);
+        return -1;
+    }
+
+    dir = fdopendir(dirfd);
+    if (!dir) {
+        warn("fdopendir");
+        Util_fdclose(&dirfd);
+        return -1;
+    }
+
+    while (errno = 0, entry = readdir(dir)) {
+        if (entry->d_type != DT_LNK)
+            continue;
+
+        len = readlinkat(dirfd, entry->d_name, buffer, sizeof(buffer));
+        if (len == -1 || (size_t)len != strlen(target)
+                || memcmp(buffer, target, len) != 0)
+            continue;
+
+        if (unlinkat(dirfd, entry->d_name, 0)) {
+            warn("unlinkat(%d, %s, 0)", dirfd, entry->d_name);
+            ex = -1;
+        }
+    }
+
+    if (errno) {
+        warn("readdir");
+        ex = -1;
+    }
+    if (closedir(dir))
+        warn("closedir");
+
+    return ex;
+}
+
+int OutDir_unlink(const OutDir *outdir, const OutDir_LinkInfo *linkinfo)
+{
+    char buffer[PATH_MAX];
+
+    if (OutDir_hash_name(outdir, linkinfo->hash, buffer)) {
+        warnx("hash for '%s' has unexpected length, %zu bytes",
+              linkinfo->path,
+              strlen(linkinfo->hash));
+        return -1;
+    }
+    if (OutDir_unlink_under(outdir->hashdir, buffer, linkinfo->path))
+        return -1;
+
+    // The directory of the hash is left only if other files have it.
+    if (unlinkat(outdir->hashdir, buffer, AT_REMOVEDIR)
+            && errno != ENOENT && errno != ENOTEMPTY && errno != EEXIST) {
+        warn("unlinkat(%d, %s, AT_REMOVEDIR)", outdir->hashdir, buffer);
+        return -1;
+    }
+
+    if (OutDir_time_name(linkinfo, buffer))
+        return -1;
+    return OutDir_unlink_under(outdir->timedir, buffer, linkinfo->path);
+}
+
+int OutDir_link(const OutDir *outdir, const OutDir_LinkInfo *linkinfo)
+{
+    return OutDir_link_paths(outdir, linkinfo, NULL);
+}
+
+int OutDir_relink(OutDir *outdir, const OutDir_LinkInfo *linkinfo)
+{
+    return OutDir_link_paths(outdir, linkinfo, &outdir->links);
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <time.h>
 
@@ -11,6 +12,34 @@ typedef struct {
     time_t mtime;
 } OutDir_LinkInfo;
 
-OutDir *OutDir_new(const char *path);
+enum {
+    OutDir_MAXLEVELS = 4,
+    OutDir_MAXWIDTH = 8,
+};
+
+// The by-hash tree has nlevels of directories, named after the next
+// widths[i] characters of the hash, above the directory named after the
+// rest of it.
+typedef struct {
+    unsigned nlevels;
+    unsigned char widths[OutDir_MAXLEVELS];
+    bool legacy;
+} OutDir_Layout;
+
+// Parses slash-separated widths, e.g. "2/2".
+int OutDir_parse_layout(const char *spec, OutDir_Layout *);
+
+// The layout of an existing catalog is kept: a different requested one
+// is an error.  A NULL or empty layout takes the one of the catalog.
+OutDir *OutDir_new(const char *path, const OutDir_Layout *);
 int OutDir_link(const OutDir *outdir, const OutDir_LinkInfo *);
+
+// As OutDir_link, but the links to the path already there are kept, and
+// not made again.  The links of each by-time directory are read once.
+int OutDir_relink(OutDir *outdir, const OutDir_LinkInfo *);
+
+// Removes the links to the path, and the directory of the hash if no
+// other file has it.
+int OutDir_unlink(const OutDir *outdir, const OutDir_LinkInfo *);
+bool OutDir_has_hash(const OutDir *outdir, const char *hash);
 void OutDir_del(OutDir *outdir);
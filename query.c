@@ -0,0 +1,133 @@
+#include "query.h"
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "index.h"
+#include "ioread.h"
+#include "outdir.h"
+#include "util.h"
+
+// The catalog index, if present, allows to skip the hashing of any file
+// whose size matches no catalogued file.  Without index, the by-hash
+// tree is looked up, and every file is hashed.
+
+typedef struct {
+    Index *index;
+    OutDir *outdir;
+    const Hasher *hasher;
+} Query;
+
+static
+int Query_known(const Query *query,
+                const char *path,
+                const File *file,
+                bool *known)
+{
+    const char *filehash;
+    size_t first, count;
+
+    *known = false;
+
+    if (query->index && !Index_has_size(query->index, file->size))
+        return 0;
+
+    filehash = Hasher_hash_file(query->hasher, path);
+    if (!filehash)
+        return -1;
+
+    if (!query->index) {
+        *known = OutDir_has_hash(query->outdir, filehash);
+        return 0;
+    }
+
+    if (Index_find(query->index, filehash, &first, &count))
+        return 0;
+
+    for (size_t i = first; i < first + count; ++i) {
+        Index_Entry entry;
+
+        Index_entry(query->index, i, &entry);
+        if (entry.size == (uint64_t)file->size) {
+            *known = true;
+            break;
+        }
+    }
+    return 0;
+}
+
+static
+int Query_open(Query *query, const char *catalog)
+{
+    char *path;
+    struct stat statbuf;
+
+    path = Util_concat(catalog, "/", Index_FILENAME, NULL);
+    if (!path)
+        return -1;
+
+    if (access(path, F_OK) == 0) {
+        query->index = Index_open(path);
+        free(path);
+        return query->index ? 0 : -1;
+    }
+    free(path);
+
+    // Do not let OutDir_new create a catalog where there is none.
+    path = Util_concat(catalog, "/by-hash", NULL);
+    if (!path)
+        return -1;
+
+    if (stat(path, &statbuf) == -1 || !S_ISDIR(statbuf.st_mode)) {
+        warnx("%s: not a catalog", catalog);
+        free(path);
+        return -1;
+    }
+    free(path);
+
+    query->outdir = OutDir_new(catalog, NULL);
+    return query->outdir ? 0 : -1;
+}
+
+int Query_run(const char *catalog, const Hasher *hasher)
+{
+    Query query = {
+        .hasher = hasher,
+    };
+    IORead ioread;
+    const char *fname;
+    int fails = 0;
+
+    if (Query_open(&query, catalog))
+        return 1;
+
+    IORead_init(&ioread);
+    while (fname = IORead_next(&ioread), fname != NULL) {
+        File file;
+        bool known;
+
+        if (File_init(&file, fname)) {
+            ++fails;
+            continue;
+        }
+
+        if (Query_known(&query, fname, &file, &known))
+            ++fails;
+        else
+            printf("%s\t%s\n", known ? "known" : "unknown", fname);
+
+        File_free(&file);
+    }
+    if (ioread.errno_s)
+        ++fails;
+
+    IORead_free(&ioread);
+    Index_close(query.index);
+    OutDir_del(query.outdir);
+    return fails;
+}
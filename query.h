@@ -0,0 +1,8 @@
+#pragma once
+
+#include "hasher.h"
+
+// Read NUL-separated paths from the standard input, and tell for each
+// of them whether an identical file is already in the catalog.
+// Returns the number of paths that could not be checked.
+int Query_run(const char *catalog, const Hasher *);
@@ -0,0 +1,142 @@
+#include "rebuild.h"
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "events.h"
+
+// Each thread takes a contiguous slice of the index.  Slices never
+// split the entries of a digest, so that no two threads link under the
+// same by-hash directory.  Threads can still meet under the same
+// by-time directory, which OutDir_link tolerates.
+
+typedef struct {
+    const Index *index;
+    const OutDir *outdir;
+    struct Events *events;
+    pthread_mutex_t *lock;
+    size_t begin;
+    size_t end;
+    int fails;
+} Slice;
+
+static
+void *Rebuild_slice(void *arg)
+{
+    Slice *slice = arg;
+
+    for (size_t i = slice->begin; i < slice->end; ++i) {
+        Index_Entry entry;
+
+        Index_entry(slice->index, i, &entry);
+        if (OutDir_link(slice->outdir, &(OutDir_LinkInfo){
+                .hash = entry.digest,
+                .path = entry.path,
+                .mtime = entry.mtime,
+            })
+        ) {
+            warnx("failed to link file %s (filehash %s)",
+                entry.path,
+                entry.digest);
+            ++slice->fails;
+            continue;
+        }
+
+        pthread_mutex_lock(slice->lock);
+        Events_accept_file(slice->events, &(File){
+            .path = entry.path,
+            .mtime = entry.mtime,
+            .size = entry.size,
+        });
+        pthread_mutex_unlock(slice->lock);
+    }
+
+    return NULL;
+}
+
+static
+size_t Rebuild_boundary(const Index *index, size_t pos)
+{
+    size_t count = Index_count(index);
+    Index_Entry prev, next;
+
+    if (pos == 0)
+        return 0;
+
+    Index_entry(index, pos - 1, &prev);
+    for (; pos < count; ++pos) {
+        Index_entry(index, pos, &next);
+        if (strcmp(prev.digest, next.digest))
+            break;
+    }
+    return pos;
+}
+
+int Rebuild_run(const Index *index,
+                const OutDir *outdir,
+                struct Events *events,
+                unsigned jobs)
+{
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    size_t count = Index_count(index);
+    Slice *slices;
+    pthread_t *threads;
+    unsigned started = 0;
+    int fails = 0;
+
+    if (jobs == 0)
+        jobs = 1;
+
+    slices = calloc(jobs, sizeof(Slice));
+    threads = calloc(jobs, sizeof(pthread_t));
+    if (!slices || !threads) {
+        warn("calloc");
+        free(slices);
+        free(threads);
+        return count ? count : 1;
+    }
+
+    for (unsigned j = 0; j < jobs; ++j) {
+        slices[j] = (Slice){
+            .index = index,
+            .outdir = outdir,
+            .events = events,
+            .lock = &lock,
+            .begin = j ? slices[j - 1].end : 0,
+            .end = Rebuild_boundary(index, count * (j + 1) / jobs),
+        };
+        if (slices[j].end < slices[j].begin)
+            slices[j].end = slices[j].begin;
+    }
+
+    // The first slice is handled by the calling thread.
+    for (unsigned j = 1; j < jobs; ++j) {
+        int e = pthread_create(&threads[j], NULL, Rebuild_slice,
+                               &slices[j]);
+
+        if (e) {
+            errno = e;
+            warn("pthread_create");
+            break;
+        }
+        started = j;
+    }
+
+    // Slices whose thread could not be started are handled here too.
+    for (unsigned j = started + 1; j < jobs; ++j)
+        Rebuild_slice(&slices[j]);
+    Rebuild_slice(&slices[0]);
+
+    for (unsigned j = 1; j <= started; ++j)
+        pthread_join(threads[j], NULL);
+
+    for (unsigned j = 0; j < jobs; ++j)
+        fails += slices[j].fails;
+
+    free(slices);
+    free(threads);
+    return fails;
+}
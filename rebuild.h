@@ -0,0 +1,11 @@
+#pragma once
+
+#include "index.h"
+#include "outdir.h"
+
+struct Events;
+
+// Regenerate the symlink trees from an index, using the given number of
+// threads.  Returns the number of entries that could not be linked.
+int Rebuild_run(const Index *, const OutDir *, struct Events *,
+                unsigned jobs);
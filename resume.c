@@ -0,0 +1,337 @@
+#include "resume.h"
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <uthash.h>
+
+#include "murmur3.h"
+#include "stream.h"
+#include "util.h"
+
+enum {
+    Resume_NFIELDS = 6,
+    Resume_PROBELEN = 2 * Murmur3_DIGEST_LENGTH,
+};
+
+typedef struct {
+    char *path;
+    dev_t device_id;
+    ino_t inode_id;
+    off_t offset;
+    char probe[Resume_PROBELEN + 1];
+    uint32_t state[5];
+    UT_hash_handle hh;
+} Entry;
+
+struct Resume {
+    char *path;
+    Entry *entries;
+    pthread_mutex_t lock;
+    bool changed;
+};
+
+static
+void Entry_del(Entry *entry)
+{
+    free(entry->path);
+    free(entry);
+}
+
+// Replaces the entry of the same path, if any.
+static
+void Resume_put(Resume *resume, Entry *entry)
+{
+    Entry *old;
+
+    HASH_FIND_STR(resume->entries, entry->path, old);
+    if (old) {
+        HASH_DEL(resume->entries, old);
+        Entry_del(old);
+    }
+    HASH_ADD_KEYPTR(hh, resume->entries, entry->path, strlen(entry->path),
+                    entry);
+}
+
+static
+int Resume_parse(Resume *resume, char * const *fields)
+{
+    Entry *entry;
+    uint32_t *s;
+
+    entry = malloc(sizeof(Entry));
+    if (!entry) {
+        warn("malloc");
+        return -1;
+    }
+
+    *entry = (Entry){
+        .path = strdup(fields[0]),
+        .device_id = strtoull(fields[1], NULL, 10),
+        .inode_id = strtoull(fields[2], NULL, 10),
+        .offset = strtoll(fields[3], NULL, 10),
+    };
+    if (!entry->path) {
+        warn("strdup");
+        free(entry);
+        return -1;
+    }
+
+    s = entry->state;
+    if (strlen(fields[4]) != Resume_PROBELEN
+            || sscanf(fields[5], "%8" SCNx32 "%8" SCNx32 "%8" SCNx32
+                      "%8" SCNx32 "%8" SCNx32,
+                      &s[0], &s[1], &s[2], &s[3], &s[4]) != 5) {
+        warnx("%s: invalid state of %s, dropped", resume->path,
+              entry->path);
+        Entry_del(entry);
+        return 0;
+    }
+    strcpy(entry->probe, fields[4]);
+
+    Resume_put(resume, entry);
+    return 0;
+}
+
+static
+int Resume_load(Resume *resume)
+{
+    char *fields[Resume_NFIELDS] = {};
+    size_t sizes[Resume_NFIELDS] = {};
+    unsigned nfields = 0;
+    ssize_t len;
+    FILE *file;
+    int ex = -1;
+
+    file = fopen(resume->path, "r");
+    if (!file) {
+        // The first run.
+        if (errno == ENOENT)
+            return 0;
+        warn("fopen(%s)", resume->path);
+        return -1;
+    }
+
+    while (len = getdelim(&fields[nfields], &sizes[nfields], '\0', file),
+           len > 0 && fields[nfields][len - 1] == '\0') {
+        if (++nfields < Resume_NFIELDS)
+            continue;
+
+        if (Resume_parse(resume, fields))
+            goto exit;
+        nfields = 0;
+    }
+
+    if (ferror(file)) {
+        warn("getdelim(%s)", resume->path);
+        goto exit;
+    }
+    if (nfields || len > 0)
+        warnx("%s: truncated record discarded", resume->path);
+    ex = 0;
+
+exit:
+    for (unsigned i = 0; i < Resume_NFIELDS; ++i)
+        free(fields[i]);
+    fclose(file);
+    return ex;
+}
+
+static
+int Resume_write(const Resume *resume)
+{
+    const Entry *entry, *tmp;
+    char *tmppath;
+    FILE *file;
+    int ex = -1;
+
+    tmppath = Util_concat(resume->path, ".tmp", NULL);
+    if (!tmppath)
+        return -1;
+
+    file = fopen(tmppath, "w");
+    if (!file) {
+        warn("fopen(%s)", tmppath);
+        goto exit;
+    }
+
+    HASH_ITER(hh, resume->entries, entry, tmp) {
+        const uint32_t *s = entry->state;
+
+        fprintf(file, "%s%c%ju%c%ju%c%jd%c%s%c"
+                "%08" PRIx32 "%08" PRIx32 "%08" PRIx32 "%08" PRIx32
+                "%08" PRIx32 "%c",
+                entry->path, 0, (uintmax_t)entry->device_id, 0,
+                (uintmax_t)entry->inode_id, 0, (intmax_t)entry->offset, 0,
+                entry->probe, 0, s[0], s[1], s[2], s[3], s[4], 0);
+    }
+
+    if (fflush(file) == EOF || fdatasync(fileno(file))) {
+        warn("cannot write %s", tmppath);
+        fclose(file);
+        goto exit;
+    }
+    if (fclose(file)) {
+        warn("fclose(%s)", tmppath);
+        goto exit;
+    }
+
+    if (rename(tmppath, resume->path)) {
+        warn("rename(%s, %s)", tmppath, resume->path);
+        goto exit;
+    }
+    ex = 0;
+
+exit:
+    free(tmppath);
+    return ex;
+}
+
+void Resume_del(Resume *resume)
+{
+    Entry *entry, *tmp;
+
+    if (!resume)
+        return;
+
+    if (resume->changed)
+        Resume_write(resume);
+
+    HASH_ITER(hh, resume->entries, entry, tmp) {
+        HASH_DEL(resume->entries, entry);
+        Entry_del(entry);
+    }
+    pthread_mutex_destroy(&resume->lock);
+    free(resume->path);
+    free(resume);
+}
+
+Resume *Resume_open(const char *path)
+{
+    Resume *resume;
+
+    resume = malloc(sizeof(Resume));
+    if (!resume) {
+        warn("malloc");
+        goto fail;
+    }
+    *resume = (Resume){
+        .path = strdup(path),
+    };
+    pthread_mutex_init(&resume->lock, NULL);
+
+    if (!resume->path) {
+        warn("strdup");
+        goto fail;
+    }
+
+    if (Resume_load(resume))
+        goto fail;
+
+    return resume;
+
+fail:
+    Resume_del(resume);
+    return NULL;
+}
+
+// The key of the first and the last Resume_PROBE bytes before offset.
+static
+int Resume_probe(int fd, off_t offset, char *probe)
+{
+    char buffer[Resume_PROBE] __attribute__((aligned(Stream_ALIGN)));
+    const off_t at[] = {0, offset - Resume_PROBE};
+    uint8_t key[Murmur3_DIGEST_LENGTH];
+    Murmur3 murmur3;
+
+    Murmur3_init(&murmur3);
+    for (unsigned i = 0; i < 2; ++i) {
+        ssize_t n = pread(fd, buffer, Resume_PROBE, at[i]);
+
+        if (n != Resume_PROBE) {
+            if (n == -1)
+                warn("pread(%d, ...)", fd);
+            return -1;
+        }
+        Murmur3_update(&murmur3, buffer, n);
+    }
+    Murmur3_final(&murmur3, key);
+    Util_hexlify(key, sizeof(key), probe);
+    return 0;
+}
+
+off_t Resume_restore(Resume *resume, const char *path, int fd, Sha1 *sha1)
+{
+    Entry *entry, found = {};
+    char probe[Resume_PROBELEN + 1];
+    struct stat statbuf;
+
+    Sha1_init(sha1);
+
+    pthread_mutex_lock(&resume->lock);
+    HASH_FIND_STR(resume->entries, path, entry);
+    if (entry)
+        found = *entry;
+    pthread_mutex_unlock(&resume->lock);
+
+    if (!entry || fstat(fd, &statbuf) == -1
+            || statbuf.st_dev != found.device_id
+            || statbuf.st_ino != found.inode_id
+            || statbuf.st_size < found.offset
+            || found.offset < Resume_MINSIZE
+            || found.offset % Resume_PROBE
+            || Resume_probe(fd, found.offset, probe)
+            || strcmp(probe, found.probe))
+        return 0;
+
+    memcpy(sha1->state, found.state, sizeof(sha1->state));
+    sha1->length = found.offset;
+    return found.offset;
+}
+
+void Resume_save(Resume *resume,
+                 const char *path,
+                 int fd,
+                 off_t offset,
+                 const Sha1 *sha1)
+{
+    struct stat statbuf;
+    Entry *entry;
+
+    if (fstat(fd, &statbuf) == -1) {
+        warn("fstat(%d)", fd);
+        return;
+    }
+
+    entry = malloc(sizeof(Entry));
+    if (!entry) {
+        warn("malloc");
+        return;
+    }
+
+    *entry = (Entry){
+        .path = strdup(path),
+        .device_id = statbuf.st_dev,
+        .inode_id = statbuf.st_ino,
+        .offset = offset,
+    };
+    memcpy(entry->state, sha1->state, sizeof(entry->state));
+    if (!entry->path || Resume_probe(fd, offset, entry->probe)) {
+        if (!entry->path)
+            warn("strdup");
+        Entry_del(entry);
+        return;
+    }
+
+    pthread_mutex_lock(&resume->lock);
+    Resume_put(resume, entry);
+    resume->changed = true;
+    pthread_mutex_unlock(&resume->lock);
+}
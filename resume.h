@@ -0,0 +1,39 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include "sha1.h"
+
+// The SHA-1 states of large files, kept from one run to the next, so
+// that a file which only grew by appending has only its new tail hashed.
+// A file is taken as appended to if it is the same inode, not shorter,
+// and the first and the last Resume_PROBE bytes of what was hashed did
+// not change: a modification elsewhere goes unnoticed.
+//
+// The state file is a sequence of NUL-terminated fields:
+//
+//  path device inode offset probe state
+//
+// and is rewritten on exit.
+
+enum {
+    Resume_MINSIZE = 4 << 20,   // smaller files are hashed anew
+    Resume_PROBE = 64 << 10,    // a multiple of the O_DIRECT alignment
+};
+
+typedef struct Resume Resume;
+
+Resume *Resume_open(const char *path);
+
+// Sets sha1 to the state of the open file as hashed up to some offset by
+// a previous run, and returns the offset, if it was only appended to
+// since.  Otherwise, initializes sha1 and returns 0.
+off_t Resume_restore(Resume *, const char *path, int fd, Sha1 *);
+
+// Records the state of the file hashed up to the offset, a multiple of
+// Resume_PROBE.
+void Resume_save(Resume *, const char *path, int fd, off_t offset,
+                 const Sha1 *);
+
+// Writes the state file back, if anything changed.
+void Resume_del(Resume *);
@@ -0,0 +1,257 @@
+#include "sha1.h"
+
+#include <string.h>
+
+#define rol(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+// The multi-buffer code is written for 16 lanes, which the compiler
+// maps onto one AVX-512, two AVX2 or four SSE2 registers, picking the
+// version for the running CPU at load time.  Elsewhere, it is scalar.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define Sha1_MULTI_TARGETS \
+    __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define Sha1_MULTI_TARGETS
+#endif
+
+typedef uint32_t Sha1_Vec __attribute__((vector_size(4 * Sha1_LANES)));
+
+static const uint32_t Sha1_IV[5] = {
+    0x67452301,
+    0xefcdab89,
+    0x98badcfe,
+    0x10325476,
+    0xc3d2e1f0,
+};
+
+static
+uint32_t load_be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24
+         | (uint32_t)p[1] << 16
+         | (uint32_t)p[2] << 8
+         | (uint32_t)p[3];
+}
+
+static
+void store_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static
+void Sha1_compress(uint32_t state[5], const uint8_t *block)
+{
+    uint32_t w[80];
+    uint32_t a, b, c, d, e;
+
+    for (int i = 0; i < 16; ++i)
+        w[i] = load_be32(block + 4 * i);
+    for (int i = 16; i < 80; ++i)
+        w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+
+    for (int i = 0; i < 80; ++i) {
+        uint32_t f, k, t;
+
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+
+        t = rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol(b, 30);
+        b = a;
+        a = t;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+void Sha1_init(Sha1 *sha1)
+{
+    *sha1 = (Sha1){};
+    memcpy(sha1->state, Sha1_IV, sizeof(Sha1_IV));
+}
+
+void Sha1_update(Sha1 *sha1, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    size_t used = sha1->length % Sha1_BLOCK_LENGTH;
+
+    sha1->length += len;
+
+    if (used) {
+        size_t room = Sha1_BLOCK_LENGTH - used;
+
+        if (len < room) {
+            memcpy(sha1->block + used, bytes, len);
+            return;
+        }
+        memcpy(sha1->block + used, bytes, room);
+        Sha1_compress(sha1->state, sha1->block);
+        bytes += room;
+        len -= room;
+    }
+
+    for (; len >= Sha1_BLOCK_LENGTH; len -= Sha1_BLOCK_LENGTH) {
+        Sha1_compress(sha1->state, bytes);
+        bytes += Sha1_BLOCK_LENGTH;
+    }
+
+    memcpy(sha1->block, bytes, len);
+}
+
+void Sha1_final(Sha1 *sha1, uint8_t digest[Sha1_DIGEST_LENGTH])
+{
+    size_t used = sha1->length % Sha1_BLOCK_LENGTH;
+    uint64_t bits = sha1->length * 8;
+
+    sha1->block[used++] = 0x80;
+    if (used > Sha1_BLOCK_LENGTH - 8) {
+        memset(sha1->block + used, 0, Sha1_BLOCK_LENGTH - used);
+        Sha1_compress(sha1->state, sha1->block);
+        used = 0;
+    }
+    memset(sha1->block + used, 0, Sha1_BLOCK_LENGTH - 8 - used);
+
+    store_be32(sha1->block + 56, bits >> 32);
+    store_be32(sha1->block + 60, bits);
+    Sha1_compress(sha1->state, sha1->block);
+
+    for (int i = 0; i < 5; ++i)
+        store_be32(digest + 4 * i, sha1->state[i]);
+}
+
+// Pads the end of a message into tail (two blocks), and tells the number
+// of blocks used there.
+static
+size_t Sha1_pad(const uint8_t *data, size_t len, uint8_t *tail)
+{
+    size_t rest = len % Sha1_BLOCK_LENGTH;
+    size_t ntail = rest + 9 > Sha1_BLOCK_LENGTH ? 2 : 1;
+    uint64_t bits = (uint64_t)len * 8;
+    uint8_t *end = tail + ntail * Sha1_BLOCK_LENGTH;
+
+    memset(tail, 0, 2 * Sha1_BLOCK_LENGTH);
+    if (rest)
+        memcpy(tail, data + len - rest, rest);
+    tail[rest] = 0x80;
+    store_be32(end - 8, bits >> 32);
+    store_be32(end - 4, bits);
+    return ntail;
+}
+
+Sha1_MULTI_TARGETS
+void Sha1_multi(const uint8_t * const *data,
+                const size_t *lens,
+                unsigned n,
+                uint8_t (*digests)[Sha1_DIGEST_LENGTH])
+{
+    uint8_t tail[Sha1_LANES][2 * Sha1_BLOCK_LENGTH];
+    size_t full[Sha1_LANES] = {}, nblocks[Sha1_LANES] = {}, steps = 0;
+    Sha1_Vec state[5];
+
+    for (unsigned l = 0; l < Sha1_LANES; ++l) {
+        if (l >= n) {
+            memset(tail[l], 0, sizeof(tail[l]));
+            continue;
+        }
+
+        full[l] = lens[l] / Sha1_BLOCK_LENGTH;
+        nblocks[l] = full[l] + Sha1_pad(data[l], lens[l], tail[l]);
+        if (nblocks[l] > steps)
+            steps = nblocks[l];
+    }
+
+    for (int i = 0; i < 5; ++i)
+        state[i] = (Sha1_Vec){} + Sha1_IV[i];
+
+    for (size_t b = 0; b < steps; ++b) {
+        Sha1_Vec w[16], active, a, c, d, e, f, k, t;
+        Sha1_Vec bb;
+
+        // Lanes past their last block go on with a dummy one, and keep
+        // their state.
+        for (unsigned l = 0; l < Sha1_LANES; ++l) {
+            const uint8_t *block;
+
+            if (b < full[l])
+                block = data[l] + b * Sha1_BLOCK_LENGTH;
+            else if (b < nblocks[l])
+                block = tail[l] + (b - full[l]) * Sha1_BLOCK_LENGTH;
+            else
+                block = tail[l];
+
+            for (int i = 0; i < 16; ++i)
+                w[i][l] = load_be32(block + 4 * i);
+            active[l] = b < nblocks[l] ? ~UINT32_C(0) : 0;
+        }
+
+        a = state[0];
+        bb = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+
+        for (int i = 0; i < 80; ++i) {
+            if (i >= 16)
+                w[i & 15] = rol(w[(i - 3) & 15] ^ w[(i - 8) & 15]
+                                ^ w[(i - 14) & 15] ^ w[i & 15], 1);
+
+            if (i < 20) {
+                f = (bb & c) | (~bb & d);
+                k = (Sha1_Vec){} + 0x5a827999;
+            } else if (i < 40) {
+                f = bb ^ c ^ d;
+                k = (Sha1_Vec){} + 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (bb & c) | (bb & d) | (c & d);
+                k = (Sha1_Vec){} + 0x8f1bbcdc;
+            } else {
+                f = bb ^ c ^ d;
+                k = (Sha1_Vec){} + 0xca62c1d6;
+            }
+
+            t = rol(a, 5) + f + e + k + w[i & 15];
+            e = d;
+            d = c;
+            c = rol(bb, 30);
+            bb = a;
+            a = t;
+        }
+
+        state[0] += a & active;
+        state[1] += bb & active;
+        state[2] += c & active;
+        state[3] += d & active;
+        state[4] += e & active;
+    }
+
+    for (unsigned l = 0; l < n; ++l)
+        for (int i = 0; i < 5; ++i)
+            store_be32(digests[l] + 4 * i, state[i][l]);
+}
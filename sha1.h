@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    Sha1_DIGEST_LENGTH = 20,
+    Sha1_BLOCK_LENGTH = 64,
+    Sha1_LANES = 16,
+};
+
+typedef struct {
+    uint32_t state[5];
+    uint64_t length;
+    uint8_t block[Sha1_BLOCK_LENGTH];
+} Sha1;
+
+void Sha1_init(Sha1 *);
+
+void Sha1_update(Sha1 *, const void *data, size_t len);
+
+void Sha1_final(Sha1 *, uint8_t digest[Sha1_DIGEST_LENGTH]);
+
+// Hashes n (at most Sha1_LANES) messages at once, each in a SIMD lane.
+// Lanes of different lengths are masked, so similar lengths work best.
+void Sha1_multi(const uint8_t * const *data,
+                const size_t *lens,
+                unsigned n,
+                uint8_t (*digests)[Sha1_DIGEST_LENGTH]);
@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+
+#include "stream.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+enum {
+    // Files up to this size are read ahead entirely when opened, bigger
+    // files are read ahead by this amount in front of the cursor.
+    Stream_READAHEAD = 8 << 20,
+};
+
+int Stream_parse_policy(const char *name, Stream_Policy *policy)
+{
+    static const char * const names[] = {
+        [Stream_CACHED] = "cached",
+        [Stream_SEQUENTIAL] = "sequential",
+        [Stream_DIRECT] = "direct",
+    };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+        if (strcmp(name, names[i]) == 0) {
+            *policy = i;
+            return 0;
+        }
+
+    warnx("unknown I/O policy '%s'", name);
+    return -1;
+}
+
+char *Stream_buffer_new(void)
+{
+    void *buffer;
+    int e;
+
+    e = posix_memalign(&buffer, Stream_ALIGN, Stream_BUFLEN);
+    if (e) {
+        errno = e;
+        warn("posix_memalign");
+        return NULL;
+    }
+    return buffer;
+}
+
+int Stream_open(Stream *stream,
+                DirCache *cache,
+                const char *path,
+                Stream_Policy policy,
+                char *buffer)
+{
+    struct stat statbuf;
+
+    *stream = (Stream){
+        .fd = -1,
+        .policy = policy,
+        .buffer = buffer,
+        .buflen = Stream_BUFLEN,
+    };
+
+    if (policy == Stream_DIRECT) {
+        stream->fd = DirCache_open(cache, path, O_RDONLY | O_DIRECT);
+
+        // Some file systems do not support direct I/O: the next best
+        // thing is not to pollute the cache.
+        if (stream->fd == -1 && errno == EINVAL)
+            stream->policy = Stream_SEQUENTIAL;
+    }
+    if (stream->fd == -1)
+        stream->fd = DirCache_open(cache, path, O_RDONLY);
+    if (stream->fd == -1) {
+        warn("open(%s, ...)", path);
+        return -1;
+    }
+
+    if (fstat(stream->fd, &statbuf) == -1) {
+        warn("fstat(%s)", path);
+        Util_fdclose(&stream->fd);
+        return -1;
+    }
+    stream->size = statbuf.st_size;
+
+    if (stream->policy == Stream_SEQUENTIAL) {
+        posix_fadvise(stream->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (stream->size <= Stream_READAHEAD) {
+            readahead(stream->fd, 0, stream->size);
+            stream->advised = stream->size;
+        }
+    }
+
+    return 0;
+}
+
+static
+void Stream_advise(Stream *stream)
+{
+    // Drop what was already consumed, as it will not be needed again.
+    if (stream->offset > stream->dropped) {
+        posix_fadvise(stream->fd,
+                      stream->dropped,
+                      stream->offset - stream->dropped,
+                      POSIX_FADV_DONTNEED);
+        stream->dropped = stream->offset;
+    }
+
+    if (stream->advised < stream->size
+            && stream->advised - stream->offset < Stream_READAHEAD / 2) {
+        readahead(stream->fd, stream->advised, Stream_READAHEAD);
+        stream->advised += Stream_READAHEAD;
+    }
+}
+
+int Stream_seek(Stream *stream, off_t offset)
+{
+    if (lseek(stream->fd, offset, SEEK_SET) == -1) {
+        warn("lseek(%d, ...)", stream->fd);
+        return -1;
+    }
+
+    stream->offset = stream->advised = stream->dropped = offset;
+    return 0;
+}
+
+ssize_t Stream_read(Stream *stream, const char **data)
+{
+    ssize_t n;
+
+    if (stream->policy == Stream_SEQUENTIAL)
+        Stream_advise(stream);
+
+    do
+        n = read(stream->fd, stream->buffer, stream->buflen);
+    while (n == -1 && errno == EINTR);
+
+    if (n == -1) {
+        warn("read(%d, ...)", stream->fd);
+        return -1;
+    }
+
+    stream->offset += n;
+    *data = stream->buffer;
+    return n;
+}
+
+void Stream_close(Stream *stream)
+{
+    if (stream->fd == -1)
+        return;
+
+    if (stream->policy == Stream_SEQUENTIAL)
+        posix_fadvise(stream->fd, 0, 0, POSIX_FADV_DONTNEED);
+    Util_fdclose(&stream->fd);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "dircache.h"
+
+typedef enum {
+    Stream_CACHED,      // plain reads through the page cache
+    Stream_SEQUENTIAL,  // read ahead, drop pages behind the cursor
+    Stream_DIRECT,      // bypass the page cache (O_DIRECT)
+} Stream_Policy;
+
+enum {
+    Stream_ALIGN = 4096,
+    Stream_BUFLEN = 1 << 20,
+};
+
+typedef struct {
+    int fd;
+    Stream_Policy policy;
+    char *buffer;
+    size_t buflen;
+    off_t size;
+    off_t offset;
+    off_t advised;
+    off_t dropped;
+} Stream;
+
+int Stream_parse_policy(const char *name, Stream_Policy *policy);
+
+// Allocate a buffer suitable for any policy.
+char *Stream_buffer_new(void);
+
+// The path is opened under its directory in the cache, if any.
+int Stream_open(Stream *, DirCache *, const char *path, Stream_Policy,
+                char *buffer);
+
+// Moves to the offset, a multiple of Stream_ALIGN for Stream_DIRECT.
+int Stream_seek(Stream *, off_t offset);
+
+// Returns the number of available bytes, 0 at end of file, -1 on error.
+ssize_t Stream_read(Stream *, const char **data);
+
+void Stream_close(Stream *);
@@ -101,6 +101,26 @@ is_hashed() {
 		grep -q 1
 }
 
+catalog() (
+	cd "$tmpdir/${1:?}"
+	shift
+	[ $# -gt 0 ] || set -- by-hash by-time
+	find "$@" -type l |
+		sort |
+		while read -r link; do
+			printf "%s -> %s\n" "$link" "$(readlink "$link")"
+		done
+)
+
+same_catalog() {
+	local d1="$1" d2="$2" c1 c2
+
+	shift 2
+	c1="$(catalog "$d1" "$@")" || return
+	c2="$(catalog "$d2" "$@")" || return
+	[ "$c1" ] && [ "$c1" = "$c2" ]
+}
+
 diag() {
 	if [ "$1" ]; then
 		printf %s\\n "$*" | sed 's/^/# /'
@@ -229,6 +249,729 @@ test_always_keep_the_oldest() {
 	ok is_hashed foo.jpeg.duplicate
 }
 
+test_batch_same_catalog() {
+	diag <<-END
+	Hashing files in batches changes the order in which they are read,
+	but not the resulting catalog.
+	END
+	{
+		mkfile foo.jpeg
+		mkfile bar.jpeg
+		duplicate foo.jpeg
+		mkfile baz.jpeg
+		hardlink bar.jpeg
+		duplicate baz.jpeg
+	} >"$tmpdir/input"
+
+	ok cathy -o plain <"$tmpdir/input"
+	ok cathy -b 2 -o batched <"$tmpdir/input"
+	ok same_catalog plain batched
+}
+
+test_builtin_hasher() {
+	diag <<-END
+	The builtin hasher and comparer produce the same catalog as the
+	external sha1sum and cmp programs, whatever the I/O policy.
+	END
+	{
+		mkfile foo.jpeg
+		mkfile bar.jpeg
+		duplicate foo.jpeg
+		hardlink bar.jpeg
+	} >"$tmpdir/input"
+	head -c 3000000 /dev/urandom >"$filehier/big.mp4"
+	cp -a "$filehier/big.mp4" "$filehier/big.mp4.copy"
+	listout "$filehier/big.mp4" "$filehier/big.mp4.copy" >>"$tmpdir/input"
+
+	ok cathy -o external <"$tmpdir/input"
+	for policy in cached sequential direct; do
+		ok cathy -H builtin -C builtin -I $policy -o $policy \
+			<"$tmpdir/input"
+		ok same_catalog external $policy
+	done
+}
+
+test_removals_across_directories() {
+	diag <<-END
+	Duplicates spread over several directories are all removed, while
+	the kept copies stay.
+	END
+	mkdir "$filehier/a" "$filehier/b" "$filehier/a/c"
+	{
+		mkfile foo.jpeg
+		mkfile a/bar.jpeg
+		duplicate foo.jpeg
+		cp -a "$filehier/foo.jpeg" "$filehier/a/c/foo.jpeg"
+		listout "$filehier/a/c/foo.jpeg"
+		cp -a "$filehier/a/bar.jpeg" "$filehier/b/bar.jpeg"
+		listout "$filehier/b/bar.jpeg"
+		duplicate a/bar.jpeg
+	} >"$tmpdir/input"
+
+	ok cathy -r -e events.log <"$tmpdir/input"
+	ok exists foo.jpeg
+	ok exists a/bar.jpeg
+	fail exists foo.jpeg.duplicate
+	fail exists a/c/foo.jpeg
+	fail exists b/bar.jpeg
+	fail exists a/bar.jpeg.duplicate
+	ok test "$(grep -c ^Unlinked: "$tmpdir/events.log")" = 4
+}
+
+count_links() {
+	find "$tmpdir/${1:?}" -type l | wc -l
+}
+
+targets() (
+	cd "$tmpdir/${1:?}"
+	find by-time -type l -exec readlink {} + | sort
+)
+
+test_jobs() {
+	diag <<-END
+	Files are added by several threads at once.  As long as duplicates
+	differ by modification time, the same files are kept as by one
+	thread, and numbered in the same order under by-time.
+	END
+	for i in $(seq 200); do
+		mkfile "file$i.jpeg"
+		if [ $((i % 3)) -eq 0 ]; then
+			duplicate "file$i.jpeg"
+			touch -d 2030-01-01 "$filehier/file$i.jpeg.duplicate"
+		fi
+	done >"$tmpdir/input"
+
+	ok cathy -o plain -e "$tmpdir/plain.log" <"$tmpdir/input"
+	targets plain >"$tmpdir/expected"
+	sort "$tmpdir/plain.log" >"$tmpdir/plain.sorted"
+
+	ok cathy -j 8 -o threads -e "$tmpdir/threads.log" <"$tmpdir/input"
+	ok same_catalog plain threads
+	targets threads >"$tmpdir/answer"
+	ok cmp "$tmpdir/expected" "$tmpdir/answer"
+	sort "$tmpdir/threads.log" >"$tmpdir/threads.sorted"
+	ok cmp "$tmpdir/plain.sorted" "$tmpdir/threads.sorted"
+
+	ok cathy -j 4 -b 16 -H builtin -C builtin -u 4 -o batched \
+		<"$tmpdir/input"
+	ok same_catalog plain batched
+	targets batched >"$tmpdir/answer"
+	ok cmp "$tmpdir/expected" "$tmpdir/answer"
+	ok cathy -j 4 -x -o fast <"$tmpdir/input"
+	ok same_catalog plain fast
+}
+
+count_spans() {
+	grep -c "\"name\":\"$1\"" "$tmpdir/trace.json"
+}
+
+test_trace() {
+	diag <<-END
+	The stages of each file are traced, one complete event per file and
+	stage, with the path as argument.
+	END
+	{
+		mkfile foo.jpeg
+		mkfile 'quote".jpeg'
+		mkfile 'café.jpeg'
+		duplicate foo.jpeg
+		mkfile bar.jpeg
+	} >"$tmpdir/input"
+
+	ok cathy -r -j 2 -T "$tmpdir/trace.json" <"$tmpdir/input"
+	ok test "$(head -c 16 "$tmpdir/trace.json")" = '{"traceEvents":['
+	ok test "$(count_spans stat)" -eq 5
+	ok test "$(count_spans hash)" -eq 5
+	ok test "$(count_spans compare)" -eq 1
+	ok test "$(count_spans link)" -eq 4
+	ok test "$(count_spans unlink)" -eq 1
+	ok grep -q 'quote\\".jpeg' "$tmpdir/trace.json"
+	ok grep -q 'café.jpeg' "$tmpdir/trace.json"
+	ok grep -q '"ph":"X".*"dur":' "$tmpdir/trace.json"
+}
+
+test_rebuild_from_index() {
+	diag <<-END
+	The index written at the end of a run is enough to regenerate the
+	symlink trees, in parallel.
+	END
+	{
+		mkfile foo.jpeg
+		mkfile bar.jpeg
+		duplicate foo.jpeg
+		mkfile baz.jpeg
+		mkfile qux.jpeg
+	} >"$tmpdir/input"
+
+	ok cathy -o orig <"$tmpdir/input"
+	ok test -s "$tmpdir/orig/index"
+	mkdir "$tmpdir/copy"
+	cp "$tmpdir/orig/index" "$tmpdir/copy"
+	ok cathy -R -j 3 -o copy
+	ok same_catalog orig copy by-hash
+	ok test "$(count_links orig/by-time)" = "$(count_links copy/by-time)"
+}
+
+test_query() {
+	diag <<-END
+	Files can be checked against an existing catalog, either through
+	its index, or through its by-hash tree.
+	END
+	{
+		mkfile foo.jpeg
+		mkfile bar.jpeg
+	} >"$tmpdir/input"
+	ok cathy -o catalog <"$tmpdir/input"
+
+	{
+		duplicate foo.jpeg
+		mkfile baz.jpeg
+	} >"$tmpdir/query"
+	printf "known\t%s\nunknown\t%s\n" \
+		"$filehier/foo.jpeg.duplicate" \
+		"$filehier/baz.jpeg" >"$tmpdir/expected"
+
+	ok cathy -q catalog <"$tmpdir/query" >"$tmpdir/answer"
+	ok cmp "$tmpdir/expected" "$tmpdir/answer"
+
+	rm "$tmpdir/catalog/index"
+	ok cathy -q catalog <"$tmpdir/query" >"$tmpdir/answer"
+	ok cmp "$tmpdir/expected" "$tmpdir/answer"
+}
+
+test_successive_runs() {
+	diag <<-END
+	Successive runs into the same output directory keep the entries of
+	the previous ones in the index, once each, with or without spilling.
+	END
+	mkfile foo.jpeg >"$tmpdir/input"
+	ok cathy -o catalog <"$tmpdir/input"
+	mkfile bar.jpeg >>"$tmpdir/input"
+	ok cathy -o catalog <"$tmpdir/input"
+	mkfile baz.jpeg >"$tmpdir/input"
+	ok cathy -m 1 -o catalog <"$tmpdir/input"
+
+	{
+		duplicate foo.jpeg
+		duplicate bar.jpeg
+		duplicate baz.jpeg
+	} >"$tmpdir/query"
+	printf "known\t%s\n" \
+		"$filehier/foo.jpeg.duplicate" \
+		"$filehier/bar.jpeg.duplicate" \
+		"$filehier/baz.jpeg.duplicate" >"$tmpdir/expected"
+	ok cathy -q catalog <"$tmpdir/query" >"$tmpdir/answer"
+	ok cmp "$tmpdir/expected" "$tmpdir/answer"
+
+	cathy -V -o catalog 2>"$tmpdir/stats" && status=0 || status=$?
+	ok test $status -eq 0
+	ok grep -q "verified_files *: 3$" "$tmpdir/stats"
+}
+
+test_shards_and_merge() {
+	diag <<-END
+	Several shard processes, fed the same input, produce partial
+	catalogs.  Merging them gives the same catalog as a single run,
+	and removes the duplicates found across shards, keeping the oldest
+	copy.
+	END
+	{
+		for f in a b c d e f g h; do
+			mkfile $f.jpeg
+			duplicate $f.jpeg
+		done
+	} >"$tmpdir/input"
+	for f in a b c d; do
+		touch -d @1000000000 "$filehier/$f.jpeg"
+	done
+	for f in e f g h; do
+		touch -d @1000000000 "$filehier/$f.jpeg.duplicate"
+	done
+
+	ok cathy -o single <"$tmpdir/input"
+
+	pids=
+	for shard in 0 1 2; do
+		cathy -r -s $shard/3 -o part$shard <"$tmpdir/input" 2>&3 &
+		pids="$pids $!"
+	done
+	for pid in $pids; do
+		wait $pid && status=0 || status=$?
+		ok test $status -eq 0
+	done
+	ok cathy -M -r -o merged part0/index part1/index part2/index
+	ok same_catalog single merged by-hash
+	for f in a b c d; do
+		ok exists $f.jpeg
+		fail exists $f.jpeg.duplicate
+	done
+	for f in e f g h; do
+		fail exists $f.jpeg
+		ok exists $f.jpeg.duplicate
+	done
+
+	# A shard catalogued on another host: its files are not reachable
+	# from here, and are decided on their digest.
+	mkdir "$tmpdir/remote"
+	printf "i.jpeg\n" >"$tmpdir/remote/i.jpeg"
+	touch -d @1000000000 "$tmpdir/remote/i.jpeg"
+	listout "$tmpdir/remote/i.jpeg" >"$tmpdir/input"
+	ok cathy -o part3 <"$tmpdir/input"
+	mv "$tmpdir/remote" "$tmpdir/gone"
+	mkfile i.jpeg >"$tmpdir/input"
+	ok cathy -o part4 <"$tmpdir/input"
+	ok cathy -M -r -o remote part3/index part4/index
+	fail exists i.jpeg
+	ok test "$(catalog remote by-hash)" = "$(catalog part3 by-hash)"
+}
+
+test_chunks() {
+	diag <<-END
+	Two files sharing most of their content, at different offsets, are
+	found to share chunks.  The chunks are read through the throttle.
+	END
+	head -c 1000000 /dev/urandom >"$filehier/orig.mp4"
+	{
+		echo "some header"
+		cat "$filehier/orig.mp4"
+	} >"$filehier/edited.mp4"
+	listout "$filehier/orig.mp4" "$filehier/edited.mp4" >"$tmpdir/input"
+
+	ok cathy -c -e events.log <"$tmpdir/input"
+	shared="$(sed -n 's/^Chunked: .*edited.mp4.* shares \([0-9]*\) of.*/\1/p' \
+		"$tmpdir/events.log")"
+	ok test "${shared:-0}" -gt 900000
+
+	# Throttled, the 2 MB are read twice: checksummed, and chunked.
+	start=$(date +%s)
+	ok cathy -H builtin -c -t 1M -e throttled.log <"$tmpdir/input"
+	ok test $(($(date +%s) - start)) -ge 3
+	ok grep -q "^Chunked: .*edited.mp4.* shares $shared of" \
+		"$tmpdir/throttled.log"
+}
+
+test_coprocesses() {
+	diag <<-END
+	Hasher and comparer running as coprocesses give the same catalog
+	as when they run once per file.
+	END
+	command -v bash || {
+		diag "bash not found, skipping"
+		return 0
+	}
+
+	cat >"$tmpdir/hash-coproc" <<-"END"
+	#!/usr/bin/env bash
+	while IFS= read -r -d '' f; do
+		sha1sum <"$f" || echo
+	done
+	END
+	cat >"$tmpdir/comp-coproc" <<-"END"
+	#!/usr/bin/env bash
+	while IFS= read -r -d '' a && IFS= read -r -d '' b; do
+		cmp -s "$a" "$b"
+		echo $?
+	done
+	END
+	chmod +x "$tmpdir/hash-coproc" "$tmpdir/comp-coproc"
+
+	{
+		mkfile foo.jpeg
+		mkfile bar.jpeg
+		duplicate foo.jpeg
+		hardlink bar.jpeg
+		duplicate bar.jpeg
+	} >"$tmpdir/input"
+
+	ok cathy -o plain <"$tmpdir/input"
+	ok cathy -P 2 -H "$tmpdir/hash-coproc" -C "$tmpdir/comp-coproc" \
+		-o coproc <"$tmpdir/input"
+	ok same_catalog plain coproc
+}
+
+test_uring() {
+	diag <<-END
+	Reading through io_uring, with many reads in flight across files,
+	gives the same catalog as plain reads.
+	END
+	{
+		mkfile foo.jpeg
+		mkfile bar.jpeg
+		duplicate foo.jpeg
+		hardlink bar.jpeg
+	} >"$tmpdir/input"
+	: >"$filehier/empty.txt"
+	head -c 3000000 /dev/urandom >"$filehier/big.mp4"
+	cp "$filehier/big.mp4" "$filehier/big.copy.mp4"
+	listout "$filehier/empty.txt" "$filehier/big.mp4" \
+		"$filehier/big.copy.mp4" >>"$tmpdir/input"
+
+	ok cathy -o plain <"$tmpdir/input"
+	for policy in cached sequential direct; do
+		ok cathy -H builtin -I $policy -u 4 -o single-$policy \
+			<"$tmpdir/input"
+		ok same_catalog plain single-$policy
+		ok cathy -H builtin -I $policy -u 2 -b 16 -o batch-$policy \
+			<"$tmpdir/input"
+		ok same_catalog plain batch-$policy
+	done
+}
+
+test_multibuffer() {
+	diag <<-END
+	Small files hashed several at once, in SIMD lanes, get the same
+	checksums as when hashed one by one.
+	END
+	for i in $(seq 1 40); do
+		head -c $((i % 3 * 30000 + i % 2 * 64)) /dev/urandom \
+			>"$filehier/small$i.jpeg"
+		listout "$filehier/small$i.jpeg"
+	done >"$tmpdir/input"
+	cp "$filehier/small7.jpeg" "$filehier/small7.copy.jpeg"
+	listout "$filehier/small7.copy.jpeg" >>"$tmpdir/input"
+
+	ok cathy -o plain <"$tmpdir/input"
+	ok cathy -H builtin -b 64 -o multi <"$tmpdir/input"
+	ok same_catalog plain multi
+	ok cathy -H builtin -b 64 -u 8 -o multi-uring <"$tmpdir/input"
+	ok same_catalog plain multi-uring
+}
+
+test_fast_keys() {
+	diag <<-END
+	Grouping files by a fast key, and checksumming them lazily, gives the
+	same catalog and removes the same files as checksumming them all.
+	The builtin hasher checksums each file in the same read as its key.
+	END
+	{
+		mkfile foo.jpeg
+		mkfile bar.jpeg
+		duplicate foo.jpeg
+		hardlink bar.jpeg
+		duplicate bar.jpeg
+		mkfile baz.jpeg
+	} >"$tmpdir/input"
+	change_mtime foo.jpeg
+
+	ok cathy -o plain <"$tmpdir/input"
+	ok cathy -x -o fast <"$tmpdir/input"
+	ok same_catalog plain fast
+	ok cathy -x -b 4 -H builtin -o batched <"$tmpdir/input"
+	ok same_catalog plain batched
+	ok cmp "$tmpdir/plain/index" "$tmpdir/fast/index"
+	ok cathy -x -H builtin -T "$tmpdir/trace.json" -o streamed \
+		<"$tmpdir/input"
+	ok cmp "$tmpdir/plain/index" "$tmpdir/streamed/index"
+	ok test "$(count_spans hash)" -eq 6
+
+	ok cathy -x -r -o removed <"$tmpdir/input"
+	ok same_catalog plain removed
+	ok test ! -e "$filehier/foo.jpeg"
+	ok test ! -e "$filehier/bar.jpeg.duplicate"
+	ok test -e "$filehier/foo.jpeg.duplicate"
+}
+
+test_memcap() {
+	diag <<-END
+	With a tiny memory cap, the input is sorted through many runs
+	spilled to the disk, and the catalog is the same as in memory.
+	END
+	{
+		for f in a b c d e f g h; do
+			mkfile $f.jpeg
+			duplicate $f.jpeg
+		done
+		hardlink a.jpeg
+	} >"$tmpdir/input"
+	for f in a b c d; do
+		touch -d @1000000000 "$filehier/$f.jpeg.duplicate"
+	done
+
+	ok cathy -o plain <"$tmpdir/input"
+	ok cathy -m 1k -o capped <"$tmpdir/input"
+	ok same_catalog plain capped by-hash
+	ok cmp "$tmpdir/plain/index" "$tmpdir/capped/index"
+	ok test -z "$(ls -A "$tmpdir/capped" | grep spill)"
+
+	ok cathy -m 1k -r -o removed <"$tmpdir/input"
+	ok same_catalog plain removed by-hash
+	for f in a b c d; do
+		fail exists $f.jpeg
+		ok exists $f.jpeg.duplicate
+	done
+	for f in e f g h; do
+		ok exists $f.jpeg
+		fail exists $f.jpeg.duplicate
+	done
+}
+
+test_journal() {
+	diag <<-END
+	A run resumed from the journal of an interrupted one reuses the
+	checksums, does not link the files twice, and does not fail on the
+	duplicates already removed.
+	END
+	{
+		for f in a b c d e f; do
+			mkfile $f.jpeg
+			duplicate $f.jpeg
+		done
+	} >"$tmpdir/input"
+	for f in a b c; do
+		touch -d @1000000000 "$filehier/$f.jpeg.duplicate"
+	done
+
+	ok cathy -o plain <"$tmpdir/input"
+
+	ok cathy -J "$tmpdir/journal" -o resumed <"$tmpdir/input"
+	# Interrupted while writing the last links.
+	ok truncate -s -50 "$tmpdir/journal"
+	ok cathy -J "$tmpdir/journal" -H false -o resumed <"$tmpdir/input"
+	ok same_catalog plain resumed
+
+	ok cathy -J "$tmpdir/journal" -r -o resumed <"$tmpdir/input"
+	ok cathy -J "$tmpdir/journal" -r -o resumed <"$tmpdir/input"
+	ok same_catalog plain resumed
+	for f in a b c; do
+		fail exists $f.jpeg
+		ok exists $f.jpeg.duplicate
+	done
+}
+
+test_layout() {
+	diag <<-END
+	The by-hash tree can have more levels.  The layout is recorded, and
+	kept by the next runs; queries and rebuilds understand it.
+	END
+	{
+		mkfile foo.jpeg
+		duplicate foo.jpeg
+		mkfile bar.jpeg
+	} >"$tmpdir/input"
+	printf "known\t%s\n" "$filehier/foo.jpeg.duplicate" >"$tmpdir/expected"
+	hash="$(sha1sum <"$filehier/foo.jpeg" | cut -c1-40)"
+	dir="$(echo "$hash" | sed 's|^\(..\)\(..\)\(.\)|\1/\2/\3/|')"
+
+	ok cathy -o plain <"$tmpdir/input"
+	ok cathy -L 2/2/1 -o fanout <"$tmpdir/input"
+	ok test -L "$tmpdir/fanout/by-hash/$dir/0"
+	ok same_catalog plain fanout by-time
+	fail cathy -L 2 -o fanout <"$tmpdir/input"
+	fail cathy -L 2/2 -o plain <"$tmpdir/input"
+
+	rm -r "$tmpdir/fanout/by-hash" "$tmpdir/fanout/by-time"
+	ok cathy -R -o fanout
+	ok test -L "$tmpdir/fanout/by-hash/$dir/0"
+	rm "$tmpdir/fanout/index"
+	listout "$filehier/foo.jpeg.duplicate" >"$tmpdir/query"
+	ok cathy -q fanout <"$tmpdir/query" >"$tmpdir/answer"
+	ok cmp "$tmpdir/expected" "$tmpdir/answer"
+}
+
+test_watch() {
+	diag <<-END
+	Watching a directory catalogs the files already there, and then
+	the new ones, while running: duplicates are removed as they come.
+	An older copy of a catalogued file replaces it, links included, and
+	so does a file modified in place its former version, while a file
+	written again but unchanged is not read again.
+	A directory removed and made again is watched anew.
+	The index is written on termination.  Threads are not supported.
+	END
+	mkfile foo.jpeg >/dev/null
+	mkfile bar.jpeg >/dev/null
+
+	(cd "$tmpdir" && exec cathy -w -r -o watched -T trace.json \
+		"$filehier") \
+		2>"$tmpdir/stats" &
+	pid=$!
+	sleep 1
+	duplicate foo.jpeg >/dev/null
+	mkdir "$filehier/new"
+	mkfile new/baz.jpeg >/dev/null
+	sleep 3
+
+	find "$filehier" -type f -print0 >"$tmpdir/input"
+	ok cathy -o plain <"$tmpdir/input"
+	ok same_catalog plain watched by-hash
+	fail exists foo.jpeg.duplicate
+	ok exists foo.jpeg
+
+	cp "$filehier/bar.jpeg" "$tmpdir/old.jpeg"
+	touch -d 2000-01-01 "$tmpdir/old.jpeg"
+	mv "$tmpdir/old.jpeg" "$filehier/old.jpeg"
+	sleep 3
+
+	fail exists bar.jpeg
+	ok exists old.jpeg
+	find "$filehier" -type f -print0 >"$tmpdir/input"
+	ok cathy -o older <"$tmpdir/input"
+	ok same_catalog older watched by-hash
+	catalog watched >"$tmpdir/links"
+	fail grep -q bar.jpeg "$tmpdir/links"
+	ok grep -q "^by-time/2000/01/01/0 -> .*/old.jpeg$" "$tmpdir/links"
+
+	printf more >>"$filehier/foo.jpeg"
+	sleep 3
+	find "$filehier" -type f -print0 >"$tmpdir/input"
+	ok cathy -o modified <"$tmpdir/input"
+	ok same_catalog modified watched by-hash
+
+	: >>"$filehier/old.jpeg"
+	sleep 3
+
+	rm -r "$filehier/new"
+	mkdir "$filehier/new"
+	mkfile new/qux.jpeg >/dev/null
+	sleep 3
+	catalog watched by-hash >"$tmpdir/links"
+	ok grep -q "/new/qux.jpeg$" "$tmpdir/links"
+
+	kill -TERM $pid
+	wait $pid && status=0 || status=$?
+	ok test $status -eq 0
+	ok test -s "$tmpdir/watched/index"
+	ok grep -q "unique_files *: 4$" "$tmpdir/stats"
+	ok test "$(grep -c '"name":"hash".*old.jpeg' "$tmpdir/trace.json")" -eq 1
+
+	# Refused at once, instead of watching.
+	fail timeout 5 cathy -w -j 2 -o "$tmpdir/threads" "$filehier"
+	fail test -e "$tmpdir/threads"
+}
+
+test_throttle() {
+	diag <<-END
+	Throttled reads keep to the rate, until SIGUSR1 opens the throttle.
+	END
+	head -c 2000000 /dev/urandom >"$filehier/big.mp4"
+	listout "$filehier/big.mp4" >"$tmpdir/input"
+
+	start=$(date +%s)
+	ok cathy -H builtin -t 1M -o slow <"$tmpdir/input"
+	ok test $(($(date +%s) - start)) -ge 1
+	ok test -s "$tmpdir/slow/index"
+
+	start=$(date +%s)
+	(cd "$tmpdir" && exec cathy -H builtin -t 64k,50 -o opened) \
+		<"$tmpdir/input" 2>&3 &
+	pid=$!
+	sleep 1
+	kill -USR1 $pid
+	wait $pid && status=0 || status=$?
+	ok test $status -eq 0
+	ok test $(($(date +%s) - start)) -lt 10
+
+	fail cathy -t 0 <"$tmpdir/input"
+	fail cathy -t 1M,x <"$tmpdir/input"
+}
+
+test_verify() {
+	diag <<-END
+	Verify mode checks the catalogued files against their checksums, in
+	parallel, and reports the ones gone, truncated or altered.
+	END
+	{
+		for f in a b c d e f; do
+			mkfile $f.jpeg
+		done
+	} >"$tmpdir/input"
+
+	ok cathy -o catalog <"$tmpdir/input"
+	ok cathy -V -j 4 -o catalog -e "$tmpdir/clean.log"
+	ok test "$(grep -c ^Verified: "$tmpdir/clean.log")" = 6
+
+	rm "$filehier/a.jpeg"
+	: >"$filehier/b.jpeg"
+	printf "C.jpeg\n" >"$filehier/c.jpeg"
+	fail cathy -V -j 4 -o catalog -e "$tmpdir/scrub.log"
+	ok test "$(grep -c ^Verified: "$tmpdir/scrub.log")" = 3
+	ok test "$(grep -c ^Missing: "$tmpdir/scrub.log")" = 1
+	ok test "$(grep -c ^Corrupt: "$tmpdir/scrub.log")" = 2
+	ok grep -q "^Corrupt: .*b.jpeg.* changed size" "$tmpdir/scrub.log"
+
+	fail cathy -V -r -o catalog
+	fail cathy -V -x -o catalog
+}
+
+test_resume() {
+	diag <<-END
+	A large file appended to since the previous run is hashed from where
+	that run left it, and gets the checksum it would get if hashed anew.
+	It is resumed indeed: from a tampered state, it gets another one.
+	A file modified at its start is hashed anew.
+	END
+	head -c 5000000 /dev/urandom >"$filehier/rec.mp4"
+	listout "$filehier/rec.mp4" >"$tmpdir/input"
+
+	ok cathy -H builtin -a state -o first <"$tmpdir/input"
+	ok test -s "$tmpdir/state"
+
+	# The SHA-1 state is the last field: 40 digits, and a NUL.
+	cp "$tmpdir/state" "$tmpdir/tampered"
+	at=$(($(wc -c <"$tmpdir/tampered") - 41))
+	digit="$(dd if="$tmpdir/tampered" bs=1 skip=$at count=1 2>&3)"
+	[ "$digit" = 0 ] && digit=1 || digit=0
+	printf $digit | dd of="$tmpdir/tampered" bs=1 seek=$at conv=notrunc 2>&3
+
+	head -c 1000000 /dev/urandom >>"$filehier/rec.mp4"
+	ok cathy -H builtin -a state -o appended <"$tmpdir/input"
+	ok cathy -o external <"$tmpdir/input"
+	ok same_catalog external appended
+	ok cathy -H builtin -a tampered -o tampered_out <"$tmpdir/input"
+	ok test "$(catalog tampered_out by-hash | wc -l)" -eq 1
+	fail same_catalog external tampered_out by-hash
+
+	printf X | dd of="$filehier/rec.mp4" bs=1 seek=10 conv=notrunc 2>&3
+	ok cathy -H builtin -I direct -a state -o modified <"$tmpdir/input"
+	ok cathy -o external2 <"$tmpdir/input"
+	ok same_catalog external2 modified
+
+	fail cathy -a state <"$tmpdir/input"
+}
+
+test_adaptive() {
+	diag <<-END
+	The adaptive mode finds a number of files in flight, reported with
+	the totals, and keeps the same files as a single thread.
+	END
+	for f in a b c d e f g h; do
+		mkfile $f.jpeg
+		duplicate $f.jpeg
+		touch -d 2030-01-01 "$filehier/$f.jpeg.duplicate"
+	done >"$tmpdir/input"
+	head -c 3000000 /dev/urandom >"$filehier/big.mp4"
+	listout "$filehier/big.mp4" >>"$tmpdir/input"
+
+	ok cathy -o plain <"$tmpdir/input"
+	ok cathy -A -j 4 -o adaptive -e "$tmpdir/events.log" <"$tmpdir/input"
+	ok same_catalog plain adaptive by-hash
+	ok grep -q "^Concurrency: [1-4] files in flight" "$tmpdir/events.log"
+
+	fail cathy -A -b 4 <"$tmpdir/input"
+}
+
 run test_links
 run test_duplicates
 run test_always_keep_the_oldest
+run test_batch_same_catalog
+run test_builtin_hasher
+run test_removals_across_directories
+run test_jobs
+run test_trace
+run test_rebuild_from_index
+run test_query
+run test_successive_runs
+run test_shards_and_merge
+run test_chunks
+run test_coprocesses
+run test_uring
+run test_multibuffer
+run test_fast_keys
+run test_memcap
+run test_journal
+run test_layout
+run test_watch
+run test_throttle
+run test_verify
+run test_resume
+run test_adaptive
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+
+#include "throttle.h"
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// From linux/ioprio.h, which older headers lack.
+enum {
+    Throttle_IOPRIO_WHO_PROCESS = 1,
+    Throttle_IOPRIO_CLASS_IDLE = 3,
+    Throttle_IOPRIO_CLASS_SHIFT = 13,
+};
+
+struct Throttle {
+    pthread_mutex_t lock;
+    double rate;            // bytes per second, as configured
+    double current;         // after backoff
+    int64_t latency_ns;     // 0 for no backoff
+    double tokens;          // negative when in debt
+    int64_t last_ns;
+};
+
+// Set by the signal handlers.
+static volatile sig_atomic_t Throttle_opened;
+
+static
+void Throttle_signal(int signum)
+{
+    Throttle_opened = signum == SIGUSR1;
+}
+
+static
+int64_t Throttle_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+Throttle *Throttle_new(size_t rate, unsigned latency_ms)
+{
+    Throttle *throttle;
+    struct sigaction action = {
+        .sa_handler = Throttle_signal,
+        .sa_flags = SA_RESTART,
+    };
+
+    throttle = malloc(sizeof(Throttle));
+    if (!throttle) {
+        warn("malloc");
+        return NULL;
+    }
+
+    *throttle = (Throttle){
+        .rate = rate < Throttle_MINRATE ? Throttle_MINRATE : rate,
+        .latency_ns = (int64_t)latency_ms * 1000000,
+        .last_ns = Throttle_now(),
+    };
+    throttle->current = throttle->rate;
+    pthread_mutex_init(&throttle->lock, NULL);
+
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+    sigaction(SIGUSR2, &action, NULL);
+    return throttle;
+}
+
+int Throttle_set_idle(void)
+{
+    if (syscall(SYS_ioprio_set, Throttle_IOPRIO_WHO_PROCESS, 0,
+                Throttle_IOPRIO_CLASS_IDLE << Throttle_IOPRIO_CLASS_SHIFT)) {
+        warn("ioprio_set");
+        return -1;
+    }
+    return 0;
+}
+
+// Multiplicative decrease on slow reads, additive increase otherwise.
+static
+void Throttle_adapt(Throttle *throttle, int64_t latency_ns)
+{
+    if (!throttle->latency_ns || latency_ns < 0)
+        return;
+
+    if (latency_ns > throttle->latency_ns)
+        throttle->current /= 2;
+    else
+        throttle->current += throttle->rate / 16;
+
+    if (throttle->current < Throttle_MINRATE)
+        throttle->current = Throttle_MINRATE;
+    if (throttle->current > throttle->rate)
+        throttle->current = throttle->rate;
+}
+
+void Throttle_take(Throttle *throttle, size_t bytes, int64_t latency_ns)
+{
+    int64_t now, wait_ns = 0;
+
+    if (Throttle_opened)
+        return;
+
+    pthread_mutex_lock(&throttle->lock);
+    Throttle_adapt(throttle, latency_ns);
+
+    // Bursts are limited to one second worth of reads.
+    now = Throttle_now();
+    throttle->tokens += (now - throttle->last_ns) * throttle->current / 1e9;
+    if (throttle->tokens > throttle->current)
+        throttle->tokens = throttle->current;
+    throttle->last_ns = now;
+
+    // Each reader pays the debt as it stands, including the reads of the
+    // others, so that together they keep to the rate.
+    throttle->tokens -= bytes;
+    if (throttle->tokens < 0)
+        wait_ns = -throttle->tokens / throttle->current * 1e9;
+    pthread_mutex_unlock(&throttle->lock);
+
+    while (wait_ns > 0 && !Throttle_opened) {
+        int64_t step = wait_ns < 100000000 ? wait_ns : 100000000;
+        struct timespec ts = {
+            .tv_sec = step / 1000000000,
+            .tv_nsec = step % 1000000000,
+        };
+
+        // Short steps, so that opening the throttle takes effect.
+        nanosleep(&ts, NULL);
+        wait_ns -= step;
+    }
+}
+
+ssize_t Throttle_stream_read(Throttle *throttle,
+                             Stream *stream,
+                             const char **data)
+{
+    int64_t begin;
+    ssize_t n;
+
+    if (!throttle)
+        return Stream_read(stream, data);
+
+    begin = Throttle_now();
+    n = Stream_read(stream, data);
+    if (n > 0)
+        Throttle_take(throttle, n, Throttle_now() - begin);
+    return n;
+}
+
+void Throttle_del(Throttle *throttle)
+{
+    if (!throttle)
+        return;
+
+    pthread_mutex_destroy(&throttle->lock);
+    free(throttle);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "stream.h"
+
+// Limits the rate at which files are read, with a token bucket shared by
+// all the threads.  With a latency threshold, the rate is halved each
+// time a read takes longer, and grows back while reads are fast.
+//
+// SIGUSR1 opens the throttle (no limit), SIGUSR2 closes it again.
+
+enum {
+    Throttle_MINRATE = 64 << 10,    // bytes per second, whatever backoff
+};
+
+typedef struct Throttle Throttle;
+
+Throttle *Throttle_new(size_t rate, unsigned latency_ms);
+
+// Puts the process in the idle I/O scheduling class: its reads are only
+// served when the devices are not busy otherwise.
+int Throttle_set_idle(void);
+
+// Accounts for bytes just read, and waits as long as needed to keep to
+// the rate.  A negative latency is not known.
+void Throttle_take(Throttle *, size_t bytes, int64_t latency_ns);
+
+// Stream_read, throttled if the throttle is not NULL.
+ssize_t Throttle_stream_read(Throttle *, Stream *, const char **data);
+
+void Throttle_del(Throttle *);
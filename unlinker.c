@@ -0,0 +1,202 @@
+#include "unlinker.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "events.h"
+#include "util.h"
+
+// The files to be removed are grouped by parent directory: each
+// directory is opened once, and the files are removed with unlinkat(2)
+// relative to it, sparing the kernel a full path resolution per file.
+
+struct Unlinker {
+    struct Events *events;
+    Journal *journal;
+    File *files;
+    size_t nfiles;
+    size_t size;
+    size_t limit;
+    int fails;
+};
+
+static int Unlinker_flush(Unlinker *);
+
+Unlinker *Unlinker_new(struct Events *events, size_t limit)
+{
+    Unlinker *unlinker;
+
+    unlinker = malloc(sizeof(Unlinker));
+    if (!unlinker) {
+        warn("malloc");
+        return NULL;
+    }
+
+    *unlinker = (Unlinker){
+        .events = events,
+        .limit = limit,
+    };
+    return unlinker;
+}
+
+void Unlinker_set_journal(Unlinker *unlinker, Journal *journal)
+{
+    unlinker->journal = journal;
+}
+
+void Unlinker_del(Unlinker *unlinker)
+{
+    if (!unlinker)
+        return;
+
+    for (size_t i = 0; i < unlinker->nfiles; ++i)
+        File_free(&unlinker->files[i]);
+    free(unlinker->files);
+    free(unlinker);
+}
+
+int Unlinker_add(Unlinker *unlinker, const File *file)
+{
+    if (unlinker->nfiles == unlinker->size) {
+        size_t size = unlinker->size ? unlinker->size * 2 : 1024;
+        File *files;
+
+        files = realloc(unlinker->files, size * sizeof(File));
+        if (!files) {
+            warn("realloc");
+            return -1;
+        }
+        unlinker->files = files;
+        unlinker->size = size;
+    }
+
+    unlinker->files[unlinker->nfiles] = *file;
+    unlinker->files[unlinker->nfiles].path = strdup(file->path);
+    if (!unlinker->files[unlinker->nfiles].path) {
+        warn("strdup");
+        return -1;
+    }
+
+    unlinker->nfiles++;
+    if (unlinker->limit && unlinker->nfiles >= unlinker->limit)
+        unlinker->fails += Unlinker_flush(unlinker);
+    return 0;
+}
+
+static
+size_t dirlen(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    return slash ? (size_t)(slash - path) : 0;
+}
+
+static
+int Unlinker_cmp_path(const void *a, const void *b)
+{
+    const char *p1 = ((const File *)a)->path;
+    const char *p2 = ((const File *)b)->path;
+    size_t l1 = dirlen(p1), l2 = dirlen(p2);
+    int cmp;
+
+    cmp = memcmp(p1, p2, l1 < l2 ? l1 : l2);
+    if (cmp)
+        return cmp;
+    if (l1 != l2)
+        return l1 < l2 ? -1 : 1;
+    return strcmp(p1 + l1, p2 + l2);
+}
+
+static
+int Unlinker_opendir(const char *path, size_t len)
+{
+    char *dir;
+    int dirfd;
+
+    // File paths are absolute: an empty directory is the root.
+    dir = len ? strndup(path, len) : strdup("/");
+    if (!dir) {
+        warn("strdup");
+        return -1;
+    }
+
+    dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dirfd == -1) {
+        int errnum = errno;
+
+        warn("open(%s, O_DIRECTORY)", dir);
+        errno = errnum;
+    }
+
+    free(dir);
+    return dirfd;
+}
+
+static
+int Unlinker_flush(Unlinker *unlinker)
+{
+    const char *curdir = NULL;
+    size_t curlen = 0;
+    int dirfd = -1, errnum = 0;
+    int fails = 0;
+
+    // The decisions to remove the files must outlive the files.
+    if (unlinker->journal && unlinker->nfiles
+            && Journal_sync(unlinker->journal)) {
+        fails = unlinker->nfiles;
+        goto exit;
+    }
+
+    qsort(unlinker->files, unlinker->nfiles, sizeof(File),
+          Unlinker_cmp_path);
+
+    for (size_t i = 0; i < unlinker->nfiles; ++i) {
+        const File *file = &unlinker->files[i];
+        size_t len = dirlen(file->path);
+
+        if (!curdir || len != curlen || memcmp(curdir, file->path, len)) {
+            Util_fdclose(&dirfd);
+            curdir = file->path;
+            curlen = len;
+            dirfd = Unlinker_opendir(curdir, curlen);
+            errnum = errno;
+        }
+
+        if (dirfd != -1) {
+            int64_t begin = Events_trace_begin(unlinker->events);
+            int ex = unlinkat(dirfd, file->path + len + 1, 0);
+
+            Events_trace_end(unlinker->events, "unlink", file->path, begin);
+            if (ex == 0) {
+                Events_unlinked(unlinker->events, file);
+                if (unlinker->journal)
+                    Journal_add_unlink(unlinker->journal, file->path);
+                continue;
+            }
+            errnum = errno;
+            warn("unlinkat(%s)", file->path);
+        }
+        Events_unlink_failed(unlinker->events, file, errnum);
+        ++fails;
+    }
+
+    Util_fdclose(&dirfd);
+
+exit:
+    for (size_t i = 0; i < unlinker->nfiles; ++i)
+        File_free(&unlinker->files[i]);
+    unlinker->nfiles = 0;
+    return fails;
+}
+
+int Unlinker_run(Unlinker *unlinker)
+{
+    int fails = unlinker->fails + Unlinker_flush(unlinker);
+
+    unlinker->fails = 0;
+    return fails;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "file.h"
+#include "journal.h"
+
+typedef struct Unlinker Unlinker;
+
+struct Events;
+
+// With a non-zero limit, the files are removed whenever that many are
+// pending, bounding the memory used.
+Unlinker *Unlinker_new(struct Events *, size_t limit);
+
+// The journal is synced before files are removed, and records them.
+void Unlinker_set_journal(Unlinker *, Journal *);
+
+// The file is copied.
+int Unlinker_add(Unlinker *, const File *);
+
+// Returns the number of files that could not be removed.
+int Unlinker_run(Unlinker *);
+
+void Unlinker_del(Unlinker *);
@@ -0,0 +1,648 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "util.h"
+
+enum {
+    Uring_MAXDEPTH = 4096,
+    Uring_RETRIES = 10,         // of a submission short of resources
+};
+
+typedef struct {
+    size_t file;
+    off_t offset;
+    size_t len;
+    int res;
+    bool busy;
+    bool done;
+} Uring_Slot;
+
+typedef struct {
+    int fd;
+    off_t size;
+    off_t submitted;
+    off_t consumed;
+    unsigned inflight;
+    bool failed;
+    bool done;
+} Uring_File;
+
+struct Uring {
+    int fd;
+    unsigned depth;
+    Stream_Policy policy;
+    bool fixed;
+    bool busy;
+    bool broken;        // failed, and kept busy for good
+
+    void *sqring;
+    size_t sqring_len;
+    void *cqring;
+    size_t cqring_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;
+
+    char *buffers;
+    Uring_Slot *slots;
+};
+
+void Uring_del(Uring *uring)
+{
+    if (!uring)
+        return;
+
+    if (uring->sqes)
+        munmap(uring->sqes, uring->sqes_len);
+    if (uring->cqring && uring->cqring != uring->sqring)
+        munmap(uring->cqring, uring->cqring_len);
+    if (uring->sqring)
+        munmap(uring->sqring, uring->sqring_len);
+    Util_fdclose(&uring->fd);
+
+    free(uring->buffers);
+    free(uring->slots);
+    free(uring);
+}
+
+static
+void *Uring_map(int fd, size_t len, off_t offset)
+{
+    void *p;
+
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+             fd, offset);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static
+int Uring_setup(Uring *uring)
+{
+    struct io_uring_params params = {};
+    char *sq, *cq;
+    long fd;
+
+    fd = syscall(__NR_io_uring_setup, uring->depth, &params);
+    if (fd == -1)
+        return -1;
+    uring->fd = fd;
+
+    uring->sqring_len = params.sq_off.array
+                        + params.sq_entries * sizeof(unsigned);
+    uring->cqring_len = params.cq_off.cqes
+                        + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP
+            && uring->cqring_len > uring->sqring_len)
+        uring->sqring_len = uring->cqring_len;
+
+    uring->sqring = Uring_map(uring->fd, uring->sqring_len,
+                              IORING_OFF_SQ_RING);
+    if (!uring->sqring)
+        return -1;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        uring->cqring = uring->sqring;
+    else
+        uring->cqring = Uring_map(uring->fd, uring->cqring_len,
+                                  IORING_OFF_CQ_RING);
+    if (!uring->cqring)
+        return -1;
+
+    uring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = Uring_map(uring->fd, uring->sqes_len, IORING_OFF_SQES);
+    if (!uring->sqes)
+        return -1;
+
+    sq = uring->sqring;
+    cq = uring->cqring;
+    uring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    uring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    uring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    uring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    uring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static
+void Uring_register(Uring *uring)
+{
+    struct iovec *iovecs;
+
+    iovecs = calloc(uring->depth, sizeof(struct iovec));
+    if (!iovecs)
+        return;
+
+    for (unsigned i = 0; i < uring->depth; ++i)
+        iovecs[i] = (struct iovec){
+            .iov_base = uring->buffers + (size_t)i * Uring_BLOCK,
+            .iov_len = Uring_BLOCK,
+        };
+
+    // Pinning the buffers spares the kernel from mapping them at each
+    // read, but is subject to RLIMIT_MEMLOCK: plain reads will do.
+    uring->fixed = syscall(__NR_io_uring_register, uring->fd,
+                           IORING_REGISTER_BUFFERS, iovecs,
+                           uring->depth) == 0;
+    free(iovecs);
+}
+
+static
+Uring *Uring_alloc(unsigned depth, Stream_Policy policy)
+{
+    Uring *uring;
+
+    uring = malloc(sizeof(Uring));
+    if (!uring) {
+        warn("malloc");
+        return NULL;
+    }
+
+    *uring = (Uring){
+        .fd = -1,
+        .depth = depth < Uring_MAXDEPTH ? depth : Uring_MAXDEPTH,
+        .policy = policy,
+    };
+    if (!uring->depth)
+        uring->depth = 1;
+    return uring;
+}
+
+Uring *Uring_new_stat(unsigned depth)
+{
+    Uring *uring;
+
+    uring = Uring_alloc(depth, Stream_CACHED);
+    if (!uring)
+        return NULL;
+
+    if (Uring_setup(uring)) {
+        Uring_del(uring);
+        return NULL;
+    }
+    return uring;
+}
+
+Uring *Uring_new(unsigned depth, Stream_Policy policy)
+{
+    Uring *uring;
+    void *buffers;
+
+    uring = Uring_alloc(depth, policy);
+    if (!uring)
+        return NULL;
+
+    if (posix_memalign(&buffers, Stream_ALIGN,
+                       (size_t)uring->depth * Uring_BLOCK)) {
+        warnx("posix_memalign: cannot allocate read buffers");
+        goto fail;
+    }
+    uring->buffers = buffers;
+
+    uring->slots = calloc(uring->depth, sizeof(Uring_Slot));
+    if (!uring->slots) {
+        warn("calloc");
+        goto fail;
+    }
+
+    // Kernels without io_uring, or sandboxes forbidding it, are not an
+    // error: the caller falls back to plain reads.
+    if (Uring_setup(uring))
+        goto fail;
+
+    Uring_register(uring);
+    return uring;
+
+fail:
+    Uring_del(uring);
+    return NULL;
+}
+
+static
+int Uring_open(const Uring *uring, const char *path, Uring_File *file)
+{
+    struct stat statbuf;
+
+    *file = (Uring_File){
+        .fd = -1,
+    };
+
+    if (uring->policy == Stream_DIRECT)
+        file->fd = open(path, O_RDONLY | O_DIRECT);
+    if (file->fd == -1)
+        file->fd = open(path, O_RDONLY);
+    if (file->fd == -1) {
+        warn("open(%s, ...)", path);
+        return -1;
+    }
+
+    if (fstat(file->fd, &statbuf) == -1) {
+        warn("fstat(%s)", path);
+        Util_fdclose(&file->fd);
+        return -1;
+    }
+    file->size = statbuf.st_size;
+
+    if (uring->policy == Stream_SEQUENTIAL)
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 0;
+}
+
+static
+void Uring_close(const Uring *uring, Uring_File *file)
+{
+    if (uring->policy == Stream_SEQUENTIAL)
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_DONTNEED);
+    Util_fdclose(&file->fd);
+}
+
+static
+void Uring_queue(Uring *uring, unsigned slotno, int fd)
+{
+    Uring_Slot *slot = &uring->slots[slotno];
+    unsigned tail = *uring->sq_tail;
+    unsigned index = tail & *uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+    size_t len = slot->len;
+
+    // Direct I/O wants whole blocks, even past the end of the file.
+    if (uring->policy == Stream_DIRECT)
+        len = (len + Stream_ALIGN - 1) & ~(size_t)(Stream_ALIGN - 1);
+
+    *sqe = (struct io_uring_sqe){
+        .opcode = uring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ,
+        .fd = fd,
+        .off = slot->offset,
+        .addr = (uintptr_t)(uring->buffers + (size_t)slotno * Uring_BLOCK),
+        .len = len,
+        .buf_index = uring->fixed ? slotno : 0,
+        .user_data = slotno,
+    };
+
+    uring->sq_array[index] = index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring->queued++;
+}
+
+static
+int Uring_enter(Uring *uring)
+{
+    unsigned retries = 0;
+    long n;
+
+    for (;;) {
+        n = syscall(__NR_io_uring_enter, uring->fd, uring->queued, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n != -1)
+            break;
+        if (errno == EINTR)
+            continue;
+
+        // The kernel is short of memory, or of room for completions,
+        // for the time being.
+        if ((errno == EAGAIN || errno == EBUSY) && retries++ < Uring_RETRIES) {
+            usleep(1000 * retries);
+            continue;
+        }
+
+        warn("io_uring_enter");
+        return -1;
+    }
+
+    uring->queued -= n;
+    return 0;
+}
+
+// After the ring failed, waits for the given number of operations in
+// flight, including the ones queued but not submitted, so that none
+// completes into memory about to be reused, and drops their results.
+// The ring is not used again.
+static
+int Uring_drain(Uring *uring, unsigned inflight)
+{
+    uring->broken = true;
+    inflight -= uring->queued;
+
+    while (inflight > 0) {
+        unsigned head = *uring->cq_head, tail;
+        long n;
+
+        n = syscall(__NR_io_uring_enter, uring->fd, 0, inflight,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n == -1 && errno != EINTR) {
+            warn("io_uring_enter");
+            return -1;
+        }
+
+        tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+        inflight -= tail - head;
+        __atomic_store_n(uring->cq_head, tail, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+static
+void Uring_reap(Uring *uring, Uring_File *files)
+{
+    unsigned head = *uring->cq_head;
+    unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe *cqe;
+        Uring_Slot *slot;
+
+        cqe = &uring->cqes[head & *uring->cq_mask];
+        slot = &uring->slots[cqe->user_data];
+        slot->res = cqe->res;
+        slot->done = true;
+        files[slot->file].inflight--;
+    }
+
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Feeds the completed blocks of the file to the handler, in order.
+// Returns true when the file is done with.
+static
+bool Uring_consume(Uring *uring,
+                   const char * const *paths,
+                   Uring_File *files,
+                   size_t i,
+                   Uring_Handler *handler,
+                   void *ctx)
+{
+    Uring_File *file = &files[i];
+    bool progress = true;
+
+    while (progress && !file->failed) {
+        progress = false;
+
+        for (unsigned s = 0; s < uring->depth; ++s) {
+            Uring_Slot *slot = &uring->slots[s];
+
+            if (!slot->done || slot->file != i
+                    || slot->offset != file->consumed)
+                continue;
+
+            if (slot->res < 0) {
+                errno = -slot->res;
+                warn("read(%s)", paths[i]);
+                file->failed = true;
+            } else if ((size_t)slot->res < slot->len) {
+                warnx("%s: file shrank while being read", paths[i]);
+                file->failed = true;
+            } else {
+                handler(ctx, i, file->size,
+                        uring->buffers + (size_t)s * Uring_BLOCK,
+                        slot->len);
+                file->consumed += slot->len;
+                progress = true;
+            }
+
+            *slot = (Uring_Slot){};
+            break;
+        }
+    }
+
+    if (file->failed) {
+        // Blocks still in flight are dropped as they complete.
+        for (unsigned s = 0; s < uring->depth; ++s)
+            if (uring->slots[s].done && uring->slots[s].file == i)
+                uring->slots[s] = (Uring_Slot){};
+
+        if (file->inflight)
+            return false;
+        handler(ctx, i, file->size, NULL, 0);
+    } else if (file->consumed == file->size) {
+        handler(ctx, i, file->size, "", 0);
+    } else {
+        return false;
+    }
+
+    Uring_close(uring, file);
+    file->done = true;
+    return true;
+}
+
+// Reports the files not done with as failed, once the reads still in
+// flight are over.
+static
+void Uring_fail(Uring *uring,
+                Uring_File *files,
+                size_t n,
+                Uring_Handler *handler,
+                void *ctx)
+{
+    unsigned inflight = 0;
+
+    for (unsigned s = 0; s < uring->depth; ++s)
+        inflight += uring->slots[s].busy && !uring->slots[s].done;
+
+    // The buffers are left to the reads which could not be waited for.
+    if (Uring_drain(uring, inflight))
+        uring->buffers = NULL;
+
+    for (unsigned s = 0; s < uring->depth; ++s)
+        uring->slots[s] = (Uring_Slot){};
+
+    for (size_t i = 0; i < n; ++i)
+        if (!files[i].done) {
+            handler(ctx, i, files[i].size, NULL, 0);
+            files[i].done = true;
+        }
+}
+
+int Uring_read_files(Uring *uring,
+                     const char * const *paths,
+                     size_t n,
+                     Uring_Handler *handler,
+                     void *ctx)
+{
+    Uring_File *files;
+    size_t next = 0, finished = 0;
+    int ex = -1;
+
+    files = calloc(n ? n : 1, sizeof(Uring_File));
+    if (!files) {
+        warn("calloc");
+        return -1;
+    }
+    for (size_t i = 0; i < n; ++i)
+        files[i].fd = -1;
+
+    while (finished < n) {
+        unsigned inflight = 0;
+
+        // Fill the free slots with the next blocks, moving on to the
+        // next files as the current one is entirely requested.
+        for (unsigned s = 0; s < uring->depth; ++s) {
+            Uring_Slot *slot = &uring->slots[s];
+            Uring_File *file;
+
+            if (slot->busy)
+                continue;
+
+            while (next < n) {
+                file = &files[next];
+
+                if (file->fd == -1 && !file->done) {
+                    if (Uring_open(uring, paths[next], file)) {
+                        handler(ctx, next, 0, NULL, 0);
+                        file->done = true;
+                        ++finished;
+                    } else if (file->size == 0) {
+                        handler(ctx, next, 0, "", 0);
+                        Uring_close(uring, file);
+                        file->done = true;
+                        ++finished;
+                    }
+                }
+
+                if (!file->done && !file->failed
+                        && file->submitted < file->size)
+                    break;
+                ++next;
+            }
+            if (next == n)
+                break;
+
+            *slot = (Uring_Slot){
+                .file = next,
+                .offset = file->submitted,
+                .len = file->size - file->submitted < Uring_BLOCK
+                       ? (size_t)(file->size - file->submitted)
+                       : Uring_BLOCK,
+                .busy = true,
+            };
+            file->submitted += slot->len;
+            file->inflight++;
+            Uring_queue(uring, s, file->fd);
+        }
+
+        for (unsigned s = 0; s < uring->depth; ++s)
+            inflight += uring->slots[s].busy;
+        if (inflight == 0)
+            continue;
+
+        if (Uring_enter(uring)) {
+            Uring_fail(uring, files, n, handler, ctx);
+            goto exit;
+        }
+        Uring_reap(uring, files);
+
+        for (unsigned s = 0; s < uring->depth; ++s) {
+            Uring_Slot *slot = &uring->slots[s];
+
+            if (slot->done
+                    && !files[slot->file].done
+                    && Uring_consume(uring, paths, files, slot->file,
+                                     handler, ctx))
+                ++finished;
+        }
+    }
+    ex = 0;
+
+exit:
+    for (size_t i = 0; i < n; ++i)
+        if (files[i].fd != -1)
+            Util_fdclose(&files[i].fd);
+    free(files);
+    return ex;
+}
+
+static
+void Uring_queue_statx(Uring *uring,
+                       size_t i,
+                       const char *path,
+                       struct statx *statxbuf)
+{
+    unsigned tail = *uring->sq_tail;
+    unsigned index = tail & *uring->sq_mask;
+
+    uring->sqes[index] = (struct io_uring_sqe){
+        .opcode = IORING_OP_STATX,
+        .fd = AT_FDCWD,
+        .addr = (uintptr_t)path,
+        .len = STATX_BASIC_STATS,
+        .off = (uintptr_t)statxbuf,
+        .user_data = i,
+    };
+
+    uring->sq_array[index] = index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring->queued++;
+}
+
+int Uring_stat_files(Uring *uring,
+                     const char * const *paths,
+                     size_t n,
+                     struct statx *stats,
+                     int *errnums)
+{
+    size_t next = 0, done = 0;
+    unsigned inflight = 0;
+    bool unsupported = false;
+
+    while (done < n) {
+        unsigned head, tail;
+
+        for (; next < n && inflight < uring->depth; ++next, ++inflight)
+            Uring_queue_statx(uring, next, paths[next], &stats[next]);
+
+        if (Uring_enter(uring)) {
+            Uring_drain(uring, inflight);
+            return -1;
+        }
+
+        head = *uring->cq_head;
+        tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head, --inflight, ++done) {
+            const struct io_uring_cqe *cqe;
+
+            cqe = &uring->cqes[head & *uring->cq_mask];
+            errnums[cqe->user_data] = cqe->res < 0 ? -cqe->res : 0;
+
+            // Kernels older than 5.6 do not know the operation.
+            if (cqe->res == -EINVAL)
+                unsupported = true;
+        }
+        __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return unsupported ? -1 : 0;
+}
+
+bool Uring_acquire(Uring *uring)
+{
+    return !__atomic_exchange_n(&uring->busy, true, __ATOMIC_ACQUIRE);
+}
+
+void Uring_release(Uring *uring)
+{
+    if (!uring->broken)
+        __atomic_store_n(&uring->busy, false, __ATOMIC_RELEASE);
+}
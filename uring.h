@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "stream.h"
+
+// Reads whole files through io_uring, keeping up to depth reads in
+// flight, across as many files as needed to fill the queue.
+
+enum {
+    Uring_BLOCK = 128 << 10,
+};
+
+typedef struct Uring Uring;
+
+struct statx;
+
+// Called for each block of the file number i (of the given size), in
+// file order.  A zero len tells the end of the file, a NULL data tells a
+// failure; either is the last call for that file.
+typedef void Uring_Handler(void *ctx, size_t i, off_t size,
+                           const char *data, size_t len);
+
+// Returns NULL if io_uring is not available.
+Uring *Uring_new(unsigned depth, Stream_Policy);
+
+// A ring for metadata only: Uring_read_files cannot be given it.  Returns
+// NULL if io_uring is not available.
+Uring *Uring_new_stat(unsigned depth);
+
+// Returns -1 if the ring itself failed, in which case the files not yet
+// reported as done are reported as failed, and the ring is not to be
+// used again: Uring_acquire no longer succeeds.
+int Uring_read_files(Uring *,
+                     const char * const *paths,
+                     size_t n,
+                     Uring_Handler *,
+                     void *ctx);
+
+// Stats the files (following symbolic links), up to depth at once.
+// Sets errnums[i] to 0, or to the error for file i.  Returns -1 if the
+// ring failed, or cannot stat files (kernels older than 5.6).
+int Uring_stat_files(Uring *,
+                     const char * const *paths,
+                     size_t n,
+                     struct statx *stats,
+                     int *errnums);
+
+// The ring serves one thread at a time: Uring_acquire tells whether it
+// was free, in which case Uring_release must follow.
+bool Uring_acquire(Uring *);
+void Uring_release(Uring *);
+
+void Uring_del(Uring *);
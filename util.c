@@ -1,6 +1,11 @@
 #include <err.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "util.h"
+
 int Util_fdclose(int *fdptr)
 {
     int fd = *fdptr;
@@ -12,3 +17,41 @@ int Util_fdclose(int *fdptr)
     }
     return 0;
 }
+
+void Util_hexlify(const void *data, size_t len, char *out)
+{
+    static const char digits[] = "0123456789abcdef";
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < len; ++i) {
+        *out++ = digits[bytes[i] >> 4];
+        *out++ = digits[bytes[i] & 0xf];
+    }
+    *out = '\0';
+}
+
+char *Util_concat(const char *first, ...)
+{
+    va_list ap;
+    const char *s;
+    size_t len = 0;
+    char *result, *cursor;
+
+    va_start(ap, first);
+    for (s = first; s; s = va_arg(ap, const char *))
+        len += strlen(s);
+    va_end(ap);
+
+    result = cursor = malloc(len + 1);
+    if (!result) {
+        warn("malloc");
+        return NULL;
+    }
+
+    va_start(ap, first);
+    for (s = first; s; s = va_arg(ap, const char *))
+        cursor = stpcpy(cursor, s);
+    va_end(ap);
+
+    return result;
+}
@@ -1,3 +1,11 @@
 #pragma once
 
 int Util_fdclose(int *fdptr);
+
+#include <stddef.h>
+
+// Write 2 * len hexadecimal digits plus a terminating '\0' to out.
+void Util_hexlify(const void *data, size_t len, char *out);
+
+// Concatenate a NULL-terminated list of strings into a malloc'd one.
+char *Util_concat(const char *first, ...);
@@ -0,0 +1,134 @@
+#include "verify.h"
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "events.h"
+
+// The threads take the entries one by one from a shared cursor, so that
+// a few big files do not leave the other threads idle.
+
+typedef struct {
+    const Index *index;
+    const Hasher *hasher;
+    struct Events *events;
+    size_t next;
+    int fails;
+} Verify;
+
+static
+int Verify_entry(Verify *verify, const Index_Entry *entry)
+{
+    const char *filehash;
+    struct stat statbuf;
+    const File file = {
+        .path = entry->path,
+        .mtime = entry->mtime,
+        .size = entry->size,
+    };
+
+    // The by-hash links to a missing file dangle.
+    if (stat(entry->path, &statbuf) == -1) {
+        if (errno != ENOENT) {
+            warn("stat(%s)", entry->path);
+            return -1;
+        }
+        warnx("missing: %s", entry->path);
+        Events_missing(verify->events, &file);
+        return -1;
+    }
+
+    if ((uint64_t)statbuf.st_size != entry->size) {
+        warnx("corrupt: %s: size %jd instead of %ju", entry->path,
+              (intmax_t)statbuf.st_size, (uintmax_t)entry->size);
+        Events_corrupt(verify->events, &file, NULL);
+        return -1;
+    }
+
+    filehash = Hasher_hash_file(verify->hasher, entry->path);
+    if (!filehash) {
+        warnx("cannot hash %s", entry->path);
+        return -1;
+    }
+
+    if (strcmp(filehash, entry->digest)) {
+        warnx("corrupt: %s: checksum %s instead of %s", entry->path,
+              filehash, entry->digest);
+        Events_corrupt(verify->events, &file, filehash);
+        return -1;
+    }
+
+    Events_verified(verify->events, &file);
+    return 0;
+}
+
+static
+void *Verify_worker(void *arg)
+{
+    Verify *verify = arg;
+    size_t count = Index_count(verify->index);
+    int fails = 0;
+
+    for (;;) {
+        size_t i = __atomic_fetch_add(&verify->next, 1, __ATOMIC_RELAXED);
+        Index_Entry entry;
+
+        if (i >= count)
+            break;
+
+        Index_entry(verify->index, i, &entry);
+        if (Verify_entry(verify, &entry))
+            ++fails;
+    }
+
+    __atomic_fetch_add(&verify->fails, fails, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+int Verify_run(const Index *index,
+               const Hasher *hasher,
+               struct Events *events,
+               unsigned jobs)
+{
+    Verify verify = {
+        .index = index,
+        .hasher = hasher,
+        .events = events,
+    };
+    pthread_t *threads;
+    unsigned started = 0;
+
+    if (jobs == 0)
+        jobs = 1;
+
+    threads = calloc(jobs, sizeof(pthread_t));
+    if (!threads) {
+        warn("calloc");
+        return 1;
+    }
+
+    // The calling thread is one of the workers.
+    for (unsigned j = 1; j < jobs; ++j) {
+        int e = pthread_create(&threads[j], NULL, Verify_worker, &verify);
+
+        if (e) {
+            errno = e;
+            warn("pthread_create");
+            break;
+        }
+        started = j;
+    }
+
+    Verify_worker(&verify);
+
+    for (unsigned j = 1; j <= started; ++j)
+        pthread_join(threads[j], NULL);
+
+    free(threads);
+    return verify.fails;
+}
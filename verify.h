@@ -0,0 +1,13 @@
+#pragma once
+
+#include "hasher.h"
+#include "index.h"
+
+struct Events;
+
+// Checks the files of an index against their recorded checksums, using
+// the given number of threads.  A file whose size
+// changed is reported as corrupt without being read.  Returns the number
+// of missing, corrupt or unreadable files.
+int Verify_run(const Index *, const Hasher *, struct Events *,
+               unsigned jobs);
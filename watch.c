@@ -0,0 +1,465 @@
+#define _GNU_SOURCE
+
+#include "watch.h"
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <uthash.h>
+
+#include "util.h"
+
+// New files are collected in a set, so that a file written several
+// times during a burst is reported once.
+
+enum {
+    Watch_MASK = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR,
+};
+
+typedef struct {
+    int wd;
+    char *path;
+    UT_hash_handle hh;
+} Dir;
+
+typedef struct {
+    char *path;
+    UT_hash_handle hh;
+} Pending;
+
+struct Watch {
+    int fd;
+    char * const *roots;
+    size_t nroots;
+    Dir *dirs;
+    Pending *pending;
+    size_t npending;
+    int64_t first_ms;       // arrival of the first pending file
+    int64_t last_ms;        // and of the last one
+    Pending **batch;
+    const char **paths;
+    size_t nbatch;
+    struct stat exclude;
+    bool excluding;
+    bool stopping;
+    struct sigaction oldint;
+    struct sigaction oldterm;
+};
+
+// Written by the signal handler, to wake up poll(2).
+static int Watch_sigpipe[2] = {-1, -1};
+
+static
+void Watch_signal(int signum)
+{
+    int errnum = errno;
+    ssize_t n;
+
+    (void)signum;
+    n = write(Watch_sigpipe[1], "", 1);
+    (void)n;
+    errno = errnum;
+}
+
+static
+int64_t Watch_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static
+int Watch_queue(Watch *watch, const char *dir, const char *name)
+{
+    Pending *pending;
+    char *path;
+
+    path = Util_concat(dir, "/", name, NULL);
+    if (!path)
+        return -1;
+
+    watch->last_ms = Watch_now();
+
+    HASH_FIND_STR(watch->pending, path, pending);
+    if (pending) {
+        free(path);
+        return 0;
+    }
+
+    pending = malloc(sizeof(Pending));
+    if (!pending) {
+        warn("malloc");
+        free(path);
+        return -1;
+    }
+
+    *pending = (Pending){
+        .path = path,
+    };
+    HASH_ADD_KEYPTR(hh, watch->pending, path, strlen(path), pending);
+    if (watch->npending++ == 0)
+        watch->first_ms = watch->last_ms;
+    return 0;
+}
+
+static
+int Watch_add_dir(Watch *watch, int wd, const char *path)
+{
+    Dir *dir;
+    char *copy;
+
+    copy = strdup(path);
+    if (!copy) {
+        warn("strdup");
+        return -1;
+    }
+
+    // A directory moved within the tree keeps its watch.
+    HASH_FIND(hh, watch->dirs, &wd, sizeof(wd), dir);
+    if (dir) {
+        free(dir->path);
+        dir->path = copy;
+        return 0;
+    }
+
+    dir = malloc(sizeof(Dir));
+    if (!dir) {
+        warn("malloc");
+        free(copy);
+        return -1;
+    }
+
+    *dir = (Dir){
+        .wd = wd,
+        .path = copy,
+    };
+    HASH_ADD(hh, watch->dirs, wd, sizeof(wd), dir);
+    return 0;
+}
+
+// Watches the directory and its subdirectories, and queues the files
+// already there.  The watch is added before listing the directory, so
+// that no file falls in between.
+static
+int Watch_add_tree(Watch *watch, const char *path)
+{
+    DIR *dir;
+    struct dirent *entry;
+    struct stat statbuf;
+    int fd, wd, fails = 0;
+
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        // Gone already.
+        if (errno == ENOENT)
+            return 0;
+        warn("open(%s)", path);
+        return -1;
+    }
+
+    if (fstat(fd, &statbuf) == -1) {
+        warn("fstat(%s)", path);
+        Util_fdclose(&fd);
+        return -1;
+    }
+
+    if (watch->excluding && statbuf.st_dev == watch->exclude.st_dev
+            && statbuf.st_ino == watch->exclude.st_ino) {
+        Util_fdclose(&fd);
+        return 0;
+    }
+
+    wd = inotify_add_watch(watch->fd, path, Watch_MASK);
+    if (wd == -1 || Watch_add_dir(watch, wd, path)) {
+        if (wd == -1)
+            warn("inotify_add_watch(%s)", path);
+        Util_fdclose(&fd);
+        return -1;
+    }
+
+    dir = fdopendir(fd);
+    if (!dir) {
+        warn("fdopendir");
+        Util_fdclose(&fd);
+        return -1;
+    }
+
+    while (errno = 0, entry = readdir(dir)) {
+        unsigned char type = entry->d_type;
+
+        if (strcmp(entry->d_name, ".") == 0
+                || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        if (type == DT_UNKNOWN
+                && fstatat(fd, entry->d_name, &statbuf,
+                           AT_SYMLINK_NOFOLLOW) == 0)
+            type = S_ISDIR(statbuf.st_mode) ? DT_DIR
+                : S_ISREG(statbuf.st_mode) ? DT_REG
+                : DT_UNKNOWN;
+
+        if (type == DT_DIR) {
+            char *subdir = Util_concat(path, "/", entry->d_name, NULL);
+
+            if (!subdir || Watch_add_tree(watch, subdir))
+                ++fails;
+            free(subdir);
+        } else if (type == DT_REG
+                && Watch_queue(watch, path, entry->d_name))
+            ++fails;
+    }
+
+    if (errno) {
+        warn("readdir(%s)", path);
+        ++fails;
+    }
+    if (closedir(dir))
+        warn("closedir");
+
+    return fails ? -1 : 0;
+}
+
+static
+int Watch_rescan(Watch *watch)
+{
+    int fails = 0;
+
+    for (size_t i = 0; i < watch->nroots; ++i)
+        if (Watch_add_tree(watch, watch->roots[i]))
+            ++fails;
+    return fails ? -1 : 0;
+}
+
+static
+void Watch_free_batch(Watch *watch)
+{
+    for (size_t i = 0; i < watch->nbatch; ++i) {
+        free(watch->batch[i]->path);
+        free(watch->batch[i]);
+    }
+    watch->nbatch = 0;
+}
+
+void Watch_del(Watch *watch)
+{
+    Dir *dir, *tmp1;
+    Pending *pending, *tmp2;
+
+    if (!watch)
+        return;
+
+    if (Watch_sigpipe[0] != -1) {
+        sigaction(SIGINT, &watch->oldint, NULL);
+        sigaction(SIGTERM, &watch->oldterm, NULL);
+        Util_fdclose(&Watch_sigpipe[0]);
+        Util_fdclose(&Watch_sigpipe[1]);
+    }
+
+    Util_fdclose(&watch->fd);
+
+    HASH_ITER(hh, watch->dirs, dir, tmp1) {
+        HASH_DEL(watch->dirs, dir);
+        free(dir->path);
+        free(dir);
+    }
+
+    HASH_ITER(hh, watch->pending, pending, tmp2) {
+        HASH_DEL(watch->pending, pending);
+        free(pending->path);
+        free(pending);
+    }
+
+    if (watch->batch)
+        Watch_free_batch(watch);
+    free(watch->batch);
+    free(watch->paths);
+    free(watch);
+}
+
+Watch *Watch_new(char * const *roots, size_t nroots, const char *exclude)
+{
+    Watch *watch;
+    struct sigaction action = {
+        .sa_handler = Watch_signal,
+    };
+
+    watch = malloc(sizeof(Watch));
+    if (!watch) {
+        warn("malloc");
+        goto fail;
+    }
+
+    *watch = (Watch){
+        .fd = -1,
+        .roots = roots,
+        .nroots = nroots,
+    };
+
+    watch->batch = calloc(Watch_MAXBATCH, sizeof(Pending *));
+    watch->paths = calloc(Watch_MAXBATCH, sizeof(const char *));
+    if (!watch->batch || !watch->paths) {
+        warn("calloc");
+        goto fail;
+    }
+
+    if (exclude && stat(exclude, &watch->exclude) == 0)
+        watch->excluding = true;
+
+    if (pipe2(Watch_sigpipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        warn("pipe2");
+        goto fail;
+    }
+
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &watch->oldint);
+    sigaction(SIGTERM, &action, &watch->oldterm);
+
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd == -1) {
+        warn("inotify_init1");
+        goto fail;
+    }
+
+    if (Watch_rescan(watch))
+        goto fail;
+
+    return watch;
+
+fail:
+    Watch_del(watch);
+    return NULL;
+}
+
+static
+int Watch_read(Watch *watch)
+{
+    char buffer[64 << 10]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t len;
+
+    len = read(watch->fd, buffer, sizeof(buffer));
+    if (len == -1) {
+        if (errno == EAGAIN || errno == EINTR)
+            return 0;
+        warn("read(inotify)");
+        return -1;
+    }
+
+    for (ssize_t off = 0; off < len; off += sizeof(*event) + event->len) {
+        Dir *dir;
+
+        event = (const struct inotify_event *)(buffer + off);
+
+        // Events were lost: whatever is there may be new.
+        if (event->mask & IN_Q_OVERFLOW) {
+            warnx("inotify queue overflow, rescanning");
+            Watch_rescan(watch);
+            continue;
+        }
+
+        HASH_FIND(hh, watch->dirs, &event->wd, sizeof(event->wd), dir);
+        if (!dir)
+            continue;
+
+        if (event->mask & IN_IGNORED) {
+            HASH_DEL(watch->dirs, dir);
+            free(dir->path);
+            free(dir);
+            continue;
+        }
+
+        if (!event->len)
+            continue;
+
+        if (event->mask & IN_ISDIR) {
+            char *subdir;
+
+            if (!(event->mask & (IN_CREATE | IN_MOVED_TO)))
+                continue;
+
+            subdir = Util_concat(dir->path, "/", event->name, NULL);
+            if (subdir)
+                Watch_add_tree(watch, subdir);
+            free(subdir);
+        } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+            Watch_queue(watch, dir->path, event->name);
+    }
+    return 0;
+}
+
+static
+void Watch_take_batch(Watch *watch)
+{
+    Pending *pending, *tmp;
+
+    HASH_ITER(hh, watch->pending, pending, tmp) {
+        if (watch->nbatch == Watch_MAXBATCH)
+            break;
+
+        HASH_DEL(watch->pending, pending);
+        watch->batch[watch->nbatch] = pending;
+        watch->paths[watch->nbatch++] = pending->path;
+        --watch->npending;
+    }
+
+    // The rest is due already.
+    watch->first_ms = watch->last_ms = 0;
+}
+
+int Watch_wait(Watch *watch, const char * const **paths, size_t *npaths)
+{
+    Watch_free_batch(watch);
+
+    while (!watch->stopping && watch->npending < Watch_MAXBATCH) {
+        struct pollfd fds[] = {
+            {.fd = watch->fd, .events = POLLIN},
+            {.fd = Watch_sigpipe[0], .events = POLLIN},
+        };
+        int timeout = -1;
+
+        if (watch->npending) {
+            int64_t deadline = watch->last_ms + Watch_QUIET_MS;
+            int64_t now = Watch_now();
+
+            if (deadline > watch->first_ms + Watch_MAXDELAY_MS)
+                deadline = watch->first_ms + Watch_MAXDELAY_MS;
+            if (deadline <= now)
+                break;
+            timeout = deadline - now;
+        }
+
+        if (poll(fds, 2, timeout) == -1) {
+            if (errno == EINTR)
+                continue;
+            warn("poll");
+            return -1;
+        }
+
+        if (fds[1].revents)
+            watch->stopping = true;
+        if (fds[0].revents && Watch_read(watch))
+            return -1;
+    }
+
+    if (watch->stopping && !watch->npending)
+        return 1;
+
+    Watch_take_batch(watch);
+    *paths = watch->paths;
+    *npaths = watch->nbatch;
+    return 0;
+}
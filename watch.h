@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+
+// Watches directory trees through inotify(7), for the files closed after
+// writing, and the files moved in.  The files already there are
+// reported first, as if they were new.
+
+enum {
+    Watch_QUIET_MS = 1000,      // wait that long after the last new file
+    Watch_MAXDELAY_MS = 10000,  // but not longer after the first one
+    Watch_MAXBATCH = 4096,
+};
+
+typedef struct Watch Watch;
+
+// Nothing under the directory to exclude is watched, if given.
+Watch *Watch_new(char * const *roots, size_t nroots, const char *exclude);
+
+// Waits for a batch of new files.  The paths are valid until the next
+// call.  Returns 1 once SIGINT or SIGTERM was received, and the files
+// new until then were returned; -1 on failure.
+int Watch_wait(Watch *, const char * const **paths, size_t *npaths);
+
+void Watch_del(Watch *);